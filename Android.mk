@@ -20,8 +20,9 @@ ifneq ($(BOARD_HAVE_BLUETOOTH_NXP),)
 LOCAL_PATH := $(call my-dir)
 
 BOARD_UART_DOWNLOAD_FW := true
-# v2 is for 8887-FP101, and v3 is for other chips.
-BOARD_UART_FW_LOADER_VERSION = v3
+# v2 is for 8887-FP101, and v3 is for other chips. The loader detects the
+# bootloader protocol at runtime, v2 only turns on the 8887 ROM timeout patch.
+BOARD_UART_FW_LOADER_VERSION ?= v3
 
 # libbt-vendor.so
 include $(CLEAR_VARS)
@@ -41,7 +42,10 @@ LOCAL_C_INCLUDES += \
 
 LOCAL_SRC_FILES := \
     bt_vendor_nxp.c \
+    fw_loader_crc.c \
     fw_loader_io.c \
+    fw_loader_lz.c \
+    fw_loader_transport.c \
     hardware_nxp.c
 
 # VHAL_LOG_LEVEL decides maximum log level supported at compile time between 0-5.
@@ -49,14 +53,15 @@ LOCAL_CFLAGS += -DVHAL_LOG_LEVEL=5
 LOCAL_CFLAGS += -Wsign-compare
 ifneq ($(BOARD_UART_DOWNLOAD_FW), false)
 LOCAL_CFLAGS += -DUART_DOWNLOAD_FW
-ifneq ($(BOARD_UART_FW_LOADER_VERSION), v2)
 LOCAL_SRC_FILES += \
     fw_loader_uart.c
-else
-LOCAL_CFLAGS += -DFW_LOADER_V2
-LOCAL_SRC_FILES += \
-    fw_loader_uart_v2.c
+ifeq ($(BOARD_UART_FW_LOADER_VERSION), v2)
+LOCAL_CFLAGS += -DFW_LOADER_ROM_TIMEOUT_PATCH
+endif
 endif
+# Wait for loader deadlines on a timerfd instead of the ppoll() timeout.
+ifeq ($(BOARD_FW_LOADER_TIMERFD), true)
+LOCAL_CFLAGS += -DFW_LOADER_TIMERFD
 endif
 
 LOCAL_SHARED_LIBRARIES := \
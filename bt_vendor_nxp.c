@@ -45,11 +45,7 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#ifdef FW_LOADER_V2
-#include "fw_loader_uart_v2.h"
-#else
 #include "fw_loader_uart.h"
-#endif
 #include <limits.h>
 #include <linux/gpio.h>
 
@@ -69,7 +65,6 @@
 #define POLL_DRIVER_DURATION_US (100000U)
 #define POLL_DRIVER_MAX_TIME_MS (20000U)
 #define POLL_CONFIG_UART_MS (10U)
-#define POLL_RETRY_TIMEOUT_MS (1U)
 #define POLL_MAX_TIMEOUT_MS (1000U)
 
 #define CONF_COMMENT '#'
@@ -156,6 +151,19 @@ static char pFileName_helper[MAX_PATH_LEN] =
 static char pFileName_image[MAX_PATH_LEN] =
     "/vendor/firmware/uart8997_bt_v4.bin";
 static uint32_t iSecondBaudrate = 0;
+static uint32_t baudrate_dl_ladder[FW_UPLOAD_MAX_BAUD_LADDER];
+static uint32_t baudrate_dl_ladder_len = 0;
+static uint32_t baudrate_dl_crc_threshold = FW_UPLOAD_BAUD_LADDER_CRC_THRESHOLD;
+static uint32_t poke_backoff_ms[FW_UPLOAD_MAX_POKE_BACKOFF];
+static uint32_t poke_backoff_ms_len = 0;
+static char pFileName_bundle[MAX_PATH_LEN];
+static uint32_t download_progress_ms = 0;
+static char download_progress_file[MAX_PATH_LEN];
+#ifdef FW_LOADER_ROM_TIMEOUT_PATCH
+static bool send_rom_timeout_patch = true;
+#else
+static bool send_rom_timeout_patch = false;
+#endif
 uint8_t enable_poke_controller = 0;
 static bool send_boot_sleep_trigger = false;
 #endif
@@ -374,6 +382,54 @@ static int set_pFileName_helper(char* p_conf_name, char* p_conf_value,
   return 0;
 }
 
+static int set_baudrate_dl_ladder(char* p_conf_name, char* p_conf_value,
+                                  void* p_conf_var, int param) {
+  char* p_next = p_conf_value;
+  unsigned long rate;
+  UNUSED(p_conf_name);
+  UNUSED(p_conf_var);
+  UNUSED(param);
+
+  baudrate_dl_ladder_len = 0;
+  while (baudrate_dl_ladder_len < FW_UPLOAD_MAX_BAUD_LADDER) {
+    rate = strtoul(p_next, &p_next, 10);
+    if ((rate > UINT_MAX) || (uart_speed((uint32)rate) == B0)) {
+      VND_LOGE("Ignoring download baud rate %lu, host can't set it", rate);
+    } else {
+      baudrate_dl_ladder[baudrate_dl_ladder_len++] = (uint32_t)rate;
+    }
+    if (*p_next != ',') {
+      break;
+    }
+    p_next++;
+  }
+  return 0;
+}
+
+static int set_poke_backoff_ms(char* p_conf_name, char* p_conf_value,
+                               void* p_conf_var, int param) {
+  char* p_next = p_conf_value;
+  unsigned long interval;
+  UNUSED(p_conf_name);
+  UNUSED(p_conf_var);
+  UNUSED(param);
+
+  poke_backoff_ms_len = 0;
+  while (poke_backoff_ms_len < FW_UPLOAD_MAX_POKE_BACKOFF) {
+    interval = strtoul(p_next, &p_next, 10);
+    if ((interval == 0) || (interval > UINT_MAX)) {
+      VND_LOGE("Ignoring poke interval %lu ms", interval);
+    } else {
+      poke_backoff_ms[poke_backoff_ms_len++] = (uint32_t)interval;
+    }
+    if (*p_next != ',') {
+      break;
+    }
+    p_next++;
+  }
+  return 0;
+}
+
 #endif
 
 static int set_wakeup_adv_pattern(char* p_conf_name, char* p_conf_value,
@@ -424,6 +480,14 @@ static const conf_entry_t conf_table[] = {
     {"baudrate_dl_helper", set_param_uint32, &baudrate_dl_helper, 0},
     {"baudrate_dl_image", set_param_uint32, &baudrate_dl_image, 0},
     {"iSecondBaudrate", set_param_uint32, &iSecondBaudrate, 0},
+    {"baudrate_dl_ladder", set_baudrate_dl_ladder, NULL, 0},
+    {"baudrate_dl_crc_threshold", set_param_uint32, &baudrate_dl_crc_threshold,
+     0},
+    {"poke_backoff_ms", set_poke_backoff_ms, NULL, 0},
+    {"pFileName_bundle", set_param_string, &pFileName_bundle, 0},
+    {"download_progress_ms", set_param_uint32, &download_progress_ms, 0},
+    {"download_progress_file", set_param_string, &download_progress_file, 0},
+    {"send_rom_timeout_patch", set_param_bool, &send_rom_timeout_patch, 0},
     {"uart_sleep_after_dl", set_param_uint32, &uart_sleep_after_dl, 0},
     {"enable_poke_controller", set_param_uint8, &enable_poke_controller, 0},
     {"send_boot_sleep_trigger", set_param_bool, &send_boot_sleep_trigger, 0},
@@ -525,39 +589,28 @@ static void vnd_load_conf(const char* p_path) {
  **
  ** Function:        read_hci_event
  **
- ** Description:     Reads hci event.
+ ** Description:     Reads hci event, giving up once deadline expires.
  **
  ** Return Value:    0 is successful, -1 otherwise
  **
  *
  *****************************************************************************/
 
-static int read_hci_event(hci_event* evt_pkt, uint64_t retry_delay_ms,
-                          uint32_t max_duration_ms) {
-  ssize_t r;
-  uint8_t count, remain;
-  uint32_t total_duration = 0;
+static int read_hci_event(hci_event* evt_pkt,
+                          const fw_upload_deadline_t* deadline) {
+  uint8_t remain;
 
   /* The first byte identifies the packet type. For HCI event packets, it
    * should be 0x04, so we read until we get to the 0x04. */
   VND_LOGV("start read hci event 0x4");
-  count = 0;
-  while (fw_upload_GetBufferSize(mchar_fd) <
-         HCI_EVENT_HEADER_SIZE + HCI_PACKET_TYPE_SIZE) {
-    usleep((useconds_t)(retry_delay_ms * 1000));
-    total_duration += (uint32_t)retry_delay_ms;
-    if (total_duration >= max_duration_ms) {
-      VND_LOGE("Read hci complete event failed timed out. Total_duration = %u",
-               total_duration);
-      return -1;
-    }
-  };
-  r = read(mchar_fd, evt_pkt->raw_data,
-           HCI_EVENT_HEADER_SIZE + HCI_PACKET_TYPE_SIZE);
-  if (r <= 0) {
-    VND_LOGV("read hci event 0x04 failed");
-    VND_LOGV("Error %s (%d)", strerror(errno), errno);
+  if (!fw_upload_WaitForBytesUntil(
+          mchar_fd, HCI_EVENT_HEADER_SIZE + HCI_PACKET_TYPE_SIZE, deadline)) {
+    VND_LOGE("Read hci complete event failed timed out. Total_duration = %llu",
+             fw_upload_DeadlineElapsedMs(deadline));
+    return -1;
   }
+  fw_upload_ComReadChars(mchar_fd, evt_pkt->raw_data,
+                         HCI_EVENT_HEADER_SIZE + HCI_PACKET_TYPE_SIZE);
   if (evt_pkt->info.packet_type != HCI_PACKET_EVENT) {
     VND_LOGE("Invalid packet type(%02X) received", evt_pkt->info.packet_type);
     return -1;
@@ -570,17 +623,11 @@ static int read_hci_event(hci_event* evt_pkt, uint64_t retry_delay_ms,
     remain = HCI_EVENT_PAYLOAD_SIZE;
     VND_LOGE("Payload size(%d) greater than capacity", evt_pkt->info.para_len);
   }
-  while (fw_upload_GetBufferSize(mchar_fd) < (uint32_t)remain)
-    ;
-  while ((count) < remain) {
-    r = read(mchar_fd, evt_pkt->info.payload + count, remain - (count));
-    if (r <= 0) {
-      VND_LOGE("read hci event para failed");
-      VND_LOGE("Error: %s (%d)", strerror(errno), errno);
-      return -1;
-    }
-    count += r;
+  if (!fw_upload_WaitForBytesUntil(mchar_fd, (uint32_t)remain, deadline)) {
+    VND_LOGE("Read hci event para timed out");
+    return -1;
   }
+  fw_upload_ComReadChars(mchar_fd, evt_pkt->info.payload, remain);
   return 0;
 }
 
@@ -654,31 +701,29 @@ static int8_t check_hci_event_status(hci_event* evt_pkt, uint16_t opcode) {
  **
  *
  *****************************************************************************/
-static int8_t read_hci_event_status(uint16_t opcode, uint64_t retry_delay_ms,
+static int8_t read_hci_event_status(uint16_t opcode,
                                     uint64_t max_duration_ms) {
   int8_t ret = -1;
   hci_event evt_pkt;
   memset(&evt_pkt, 0x00, sizeof(evt_pkt));
-  uint64_t start_ms = fw_upload_GetTime();
-  uint64_t cost_ms = 0;
-  uint64_t remaining_time_ms = max_duration_ms;
+  fw_upload_deadline_t deadline;
   int read_hci_flag;
+  fw_upload_DeadlineInit(&deadline, (uint32_t)max_duration_ms, NULL);
   VND_LOGD("Reading %s event", hw_bt_cmd_to_str(opcode));
-  read_hci_flag =
-      read_hci_event(&evt_pkt, retry_delay_ms, (uint32_t)remaining_time_ms);
-  while ((cost_ms < max_duration_ms) && (read_hci_flag == 0)) {
+  read_hci_flag = read_hci_event(&evt_pkt, &deadline);
+  while (read_hci_flag == 0) {
     ret = check_hci_event_status(&evt_pkt, opcode);
-    if (ret == 0) {
+    if ((ret == 0) || fw_upload_DeadlineExpired(&deadline)) {
       break;
     }
-    remaining_time_ms = max_duration_ms - (fw_upload_GetTime() - start_ms);
-    read_hci_flag =
-        read_hci_event(&evt_pkt, retry_delay_ms, (uint32_t)remaining_time_ms);
-    cost_ms = fw_upload_GetTime() - start_ms;
+    read_hci_flag = read_hci_event(&evt_pkt, &deadline);
   }
-  if (cost_ms >= max_duration_ms) {
-    VND_LOGE("Read hci complete event failed, timed out at: %u",
-             (uint32_t)cost_ms);
+  if (ret != 0) {
+    VND_LOGE("Read hci complete event failed, timed out at: %llu",
+             fw_upload_DeadlineElapsedMs(&deadline));
+  } else {
+    VND_LOGD("%s event received in %llu ms", hw_bt_cmd_to_str(opcode),
+             fw_upload_DeadlineElapsedMs(&deadline));
   }
   return ret;
 }
@@ -696,8 +741,8 @@ static int8_t send_hci_reset(void) {
   int8_t ret = -1;
   if (hw_bt_send_hci_cmd_raw(HCI_CMD_NXP_RESET) != 0) {
     VND_LOGE("Failed to write reset command");
-  } else if ((read_hci_event_status(HCI_CMD_NXP_RESET, POLL_CONFIG_UART_MS,
-                                    POLL_MAX_TIMEOUT_MS) != 0)) {
+  } else if ((read_hci_event_status(HCI_CMD_NXP_RESET, POLL_MAX_TIMEOUT_MS) !=
+              0)) {
     VND_LOGE("Failed to read HCI RESET CMD response!");
   } else {
     VND_LOGD("HCI reset completed successfully");
@@ -737,11 +782,11 @@ int get_prop_int32(const char* name) {
  **
  ** Description:     Return the baud rate corresponding to the frequency.
  **
- ** Return Value:    Baudrate
+ ** Return Value:    Baudrate, B0 if the frequency is not supported
  *
  *****************************************************************************/
 
-static uint32 uart_speed(uint32 s) {
+uint32 uart_speed(uint32 s) {
   uint32 ret = 0;
   switch (s) {
     case 9600U:
@@ -783,9 +828,21 @@ static uint32 uart_speed(uint32 s) {
     case 1500000U:
       ret = B1500000;
       break;
+    case 2000000U:
+      ret = B2000000;
+      break;
+    case 2500000U:
+      ret = B2500000;
+      break;
     case 3000000U:
       ret = B3000000;
       break;
+    case 3500000U:
+      ret = B3500000;
+      break;
+    case 4000000U:
+      ret = B4000000;
+      break;
     default:
       ret = B0;
       break;
@@ -844,9 +901,21 @@ static uint32 uart_speed_translate(uint32 s) {
     case B1500000:
       ret = 1500000U;
       break;
+    case B2000000:
+      ret = 2000000U;
+      break;
+    case B2500000:
+      ret = 2500000U;
+      break;
     case B3000000:
       ret = 3000000U;
       break;
+    case B3500000:
+      ret = 3500000U;
+      break;
+    case B4000000:
+      ret = 4000000U;
+      break;
     default:
       ret = 0;
       break;
@@ -910,9 +979,16 @@ static int32 uart_set_speed(int32 fd, struct termios* ter, uint32 speed) {
  **
  ** Return Value        Valid fd on success
  **
+ ** Notes               The settings and last baud rate used later by
+ **                     config_uart() are only kept for mchar_port, so the
+ **                     firmware loader can open other ports from its own
+ **                     threads at the same time.
+ **
  *****************************************************************************/
 
 int32 init_uart(int8* dev, uint32 dwBaudRate, uint8 ucFlowCtrl) {
+  struct termios term;
+  bool bMcharPort = (strcmp(dev, mchar_port) == 0);
   int32 fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
   if (fd < 0) {
     VND_LOGE("Can't open serial port");
@@ -920,54 +996,53 @@ int32 init_uart(int8* dev, uint32 dwBaudRate, uint8 ucFlowCtrl) {
     return -1;
   }
 
-  tcflush(fd, TCIOFLUSH);
+  fw_upload_ComFlush(fd, TCIOFLUSH);
 
-  if (tcgetattr(fd, &ti) < 0) {
+  if (tcgetattr(fd, &term) < 0) {
     VND_LOGE("Can't get port settings");
     VND_LOGE("Error: %s (%d)", strerror(errno), errno);
     close(fd);
     return -1;
   }
 
-  cfmakeraw(&ti);
-#ifdef FW_LOADER_V2
-  ti.c_cflag |= CLOCAL | CREAD;
-#else
-  ti.c_cflag |= CLOCAL;
-#endif
+  cfmakeraw(&term);
+  term.c_cflag |= CLOCAL | CREAD;
 
   /* Set 1 stop bit & no parity (8-bit data already handled by cfmakeraw) */
-  ti.c_cflag &= ~(CSTOPB | PARENB);
+  term.c_cflag &= ~(CSTOPB | PARENB);
 
   if (ucFlowCtrl) {
-    ti.c_cflag |= CRTSCTS;
+    term.c_cflag |= CRTSCTS;
   } else {
-    ti.c_cflag &= ~CRTSCTS;
+    term.c_cflag &= ~CRTSCTS;
   }
 
   /*FOR READS: set timeout time w/ no minimum characters needed
                          (since we read only 1 at at time...)          */
-  ti.c_cc[VMIN] = 0;
-  ti.c_cc[VTIME] = TIMEOUT_SEC * 10;
+  term.c_cc[VMIN] = 0;
+  term.c_cc[VTIME] = TIMEOUT_SEC * 10;
 
-  if (tcsetattr(fd, TCSANOW, &ti) < 0) {
+  if (tcsetattr(fd, TCSANOW, &term) < 0) {
     VND_LOGE("Can't set port settings");
     VND_LOGE("Error: %s (%d)", strerror(errno), errno);
     close(fd);
     return -1;
   }
-  tcflush(fd, TCIOFLUSH);
-  if (independent_reset_mode == IR_MODE_INBAND_VSC) {
-    last_baudrate = uart_get_speed(&ti);
+  fw_upload_ComFlush(fd, TCIOFLUSH);
+  if (bMcharPort && (independent_reset_mode == IR_MODE_INBAND_VSC)) {
+    last_baudrate = uart_get_speed(&term);
     VND_LOGD("Last baud rate = %d", last_baudrate);
   }
   /* Set actual baudrate */
-  if (uart_set_speed(fd, &ti, dwBaudRate) < 0) {
+  if (uart_set_speed(fd, &term, dwBaudRate) < 0) {
     VND_LOGE("Can't set baud rate");
     VND_LOGE("Error: %s (%d)", strerror(errno), errno);
     close(fd);
     return -1;
   }
+  if (bMcharPort) {
+    ti = term;
+  }
 
   return fd;
 }
@@ -1003,6 +1078,33 @@ static int uart_init_open(int8* dev, int32 dwBaudRate, uint8 ucFlowCtrl) {
   return fd;
 }
 #ifdef UART_DOWNLOAD_FW
+/*******************************************************************************
+**
+** Function        download_progress
+**
+** Description     Logs the firmware download progress
+**
+** Returns         None
+**
+*******************************************************************************/
+
+static void download_progress(const fw_upload_progress_t* progress,
+                              void* ctx) {
+  (void)ctx;
+  if (progress->bDone) {
+    VND_LOGI("FW download %s: %u bytes in %u ms (%u B/s), %u baud, %u resent",
+             progress->ulResult == 0 ? "done" : "failed",
+             progress->uiBytesSent, progress->uiElapsedMs,
+             progress->uiBytesPerSec, progress->uiBaudRate,
+             progress->uiRetransmits);
+  } else {
+    VND_LOGI("FW download %u/%u bytes, %u B/s, ETA %u ms, %u baud, %u resent",
+             progress->uiBytesSent, progress->uiTotalBytes,
+             progress->uiBytesPerSec, progress->uiEtaMs, progress->uiBaudRate,
+             progress->uiRetransmits);
+  }
+}
+
 /*******************************************************************************
 **
 ** Function        detect_and_download_fw
@@ -1016,15 +1118,29 @@ static int uart_init_open(int8* dev, int32 dwBaudRate, uint8 ucFlowCtrl) {
 
 static uint32 detect_and_download_fw() {
   uint32 download_ret = 1;
-#ifndef FW_LOADER_V2
-  init_crc8();
-#endif
+  fw_upload_fw_status_t fw_status;
+
+  bt_vnd_mrvl_set_baud_ladder(baudrate_dl_ladder, baudrate_dl_ladder_len,
+                              baudrate_dl_crc_threshold);
+  bt_vnd_mrvl_set_poke_backoff(poke_backoff_ms, poke_backoff_ms_len);
+  bt_vnd_mrvl_set_rom_timeout_patch(send_rom_timeout_patch);
+  if (download_progress_ms != 0) {
+    bt_vnd_mrvl_set_progress(download_progress, NULL, download_progress_ms,
+                             download_progress_file);
+  }
+  /* read the first image while the bootloader is detected */
+  if (download_helper) {
+    bt_vnd_mrvl_prepare_fw(pFileName_helper);
+  } else if (auto_select_fw_name == false) {
+    bt_vnd_mrvl_prepare_fw(pFileName_image);
+  }
 /* force download only when header is received */
-#ifdef FW_LOADER_V2
-  if (bt_vnd_mrvl_check_fw_status_v2()) {
-#else
-  if (bt_vnd_mrvl_check_fw_status()) {
-#endif
+  fw_status = bt_vnd_mrvl_probe_fw_status();
+  if (fw_status == FW_STATUS_RUNNING) {
+    /* stale PROP_BLUETOOTH_FW_DOWNLOADED, the firmware answered the probe */
+    VND_LOGI("FW is already running");
+    download_ret = 0;
+  } else if (fw_status == FW_STATUS_BOOTLOADER) {
 #ifdef UART_DOWNLOAD_FW
     if (send_boot_sleep_trigger == true) {
       if (get_prop_int32(PROP_BLUETOOTH_BOOT_SLEEP_TRIGGER) == 0) {
@@ -1034,21 +1150,19 @@ static uint32 detect_and_download_fw() {
     }
 #endif
     if (download_helper) {
-#ifdef FW_LOADER_V2
-      download_ret = bt_vnd_mrvl_download_fw_v2(mchar_port, baudrate_dl_helper,
-                                                pFileName_helper);
-#else
       download_ret = bt_vnd_mrvl_download_fw(mchar_port, baudrate_dl_helper,
                                              pFileName_helper, iSecondBaudrate);
-#endif
       if (download_ret != 0) {
         VND_LOGE("helper download failed");
         goto done;
       }
+      if (auto_select_fw_name == false) {
+        bt_vnd_mrvl_prepare_fw(pFileName_image);
+      }
 
       usleep(50000);
       /* flush additional A5 header if any */
-      tcflush(mchar_fd, TCIFLUSH);
+      fw_upload_ComFlush(mchar_fd, TCIFLUSH);
 
       /* close and open the port and set baud rate to baudrate_dl_image */
       close(mchar_fd);
@@ -1057,27 +1171,23 @@ static uint32 detect_and_download_fw() {
         download_ret = 1;
         goto done;
       }
+      bt_vnd_mrvl_port_opened();
       usleep(20000);
-      tcflush(mchar_fd, TCIOFLUSH);
+      fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
     }
 
     /* download fw image */
     if (auto_select_fw_name == true) {
       fw_loader_get_default_fw_name(pFileName_image, sizeof(pFileName_image));
     }
-#ifdef FW_LOADER_V2
-    download_ret = bt_vnd_mrvl_download_fw_v2(mchar_port, baudrate_dl_image,
-                                              pFileName_image);
-#else
     download_ret = bt_vnd_mrvl_download_fw(mchar_port, baudrate_dl_image,
                                            pFileName_image, iSecondBaudrate);
-#endif
     if (download_ret != 0) {
       VND_LOGE("fw download failed");
       goto done;
     }
 
-    tcflush(mchar_fd, TCIFLUSH);
+    fw_upload_ComFlush(mchar_fd, TCIFLUSH);
     if (uart_sleep_after_dl > 0) {
       usleep((useconds_t)(uart_sleep_after_dl * 1000));
     }
@@ -1087,6 +1197,7 @@ static uint32 detect_and_download_fw() {
     }
   }
 done:
+  bt_vnd_mrvl_release_fw();
   return download_ret;
 }
 #endif
@@ -1123,7 +1234,6 @@ static int config_uart() {
       }
       VND_LOGV("start read hci event");
       if (read_hci_event_status(HCI_CMD_NXP_CHANGE_BAUDRATE,
-                                POLL_CONFIG_UART_MS,
                                 POLL_MAX_TIMEOUT_MS) != 0) {
         VND_LOGE("Failed to read set baud rate command response! ");
         return -1;
@@ -1135,7 +1245,7 @@ static int config_uart() {
 
     usleep(60000); /* Sleep to allow baud rate setting to happen in FW */
 
-    tcflush(mchar_fd, TCIOFLUSH);
+    fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
     if (uart_set_speed(mchar_fd, &ti, baudrate_bt) != 0) {
       VND_LOGE("Failed to  set baud rate ");
       return -1;
@@ -1146,11 +1256,11 @@ static int config_uart() {
       VND_LOGE("Error: %s (%d)", strerror(errno), errno);
       return -1;
     }
-    tcflush(mchar_fd, TCIOFLUSH);
+    fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
   } else {
     /* set host uart speed according to baudrate_bt */
     VND_LOGD("Set host baud rate as %d", baudrate_bt);
-    tcflush(mchar_fd, TCIOFLUSH);
+    fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
 
     /* Close and open the port as setting baudrate to baudrate_bt */
     close(mchar_fd);
@@ -1159,7 +1269,7 @@ static int config_uart() {
       return -1;
     }
     usleep(20000);
-    tcflush(mchar_fd, TCIOFLUSH);
+    fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
   }
 
   usleep(20 * 1000);
@@ -1336,15 +1446,15 @@ static int bt_vnd_send_inband_ir(uint32_t baudrate) {
       VND_LOGD("Baud rate changed from %u to %u with flow control enabled",
                baudrate, _last_baudrate);
     }
-    tcflush(mchar_fd, TCIOFLUSH);
+    fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
     if (hw_bt_send_hci_cmd_raw(HCI_CMD_INBAND_RESET)) {
       VND_LOGE("Failed to write in-band reset command ");
       VND_LOGE("Error: %s (%d)", strerror(errno), errno);
       return -1;
     } else {
       VND_LOGV("start read hci event");
-      if (read_hci_event_status(HCI_CMD_INBAND_RESET, POLL_RETRY_TIMEOUT_MS,
-                                POLL_MAX_TIMEOUT_MS) != 0) {
+      if (read_hci_event_status(HCI_CMD_INBAND_RESET, POLL_MAX_TIMEOUT_MS) !=
+          0) {
         VND_LOGE("Failed to read Inband reset response");
         return -1;
       }
@@ -1376,6 +1486,7 @@ static int bt_vnd_send_inband_ir(uint32_t baudrate) {
 *******************************************************************************/
 static void send_exit_heartbeat_mode(void) {
   hci_event evt_pkt;
+  fw_upload_deadline_t deadline;
   bool heartbeatFlag = false;
   VND_LOGD("Start to send exit heartbeat cmd ...\n");
   memset(&evt_pkt, 0x00, sizeof(evt_pkt));
@@ -1384,8 +1495,8 @@ static void send_exit_heartbeat_mode(void) {
     VND_LOGD("Failed to write exit heartbeat command \n");
     return;
   }
-  if (read_hci_event(&evt_pkt, POLL_RETRY_TIMEOUT_MS, POLL_CONFIG_UART_MS) ==
-      0) {
+  fw_upload_DeadlineInit(&deadline, POLL_CONFIG_UART_MS, NULL);
+  if (read_hci_event(&evt_pkt, &deadline) == 0) {
     if (check_hci_event_status(&evt_pkt, HCI_CMD_NXP_BLE_WAKEUP) == 0) {
       if ((evt_pkt.info.para_len > HCI_EVT_PYLD_SUBCODE_IDX) &&
           (evt_pkt.info.payload[HCI_EVT_PYLD_SUBCODE_IDX] ==
@@ -1416,6 +1527,13 @@ static int bt_vnd_init(const bt_vendor_callbacks_t* p_cb,
   }
   ALOGI("bt_vnd_init --- BT Vendor HAL Ver: %s ---", BT_HAL_VERSION);
   vnd_load_conf(VENDOR_LIB_CONF_FILE);
+#ifdef UART_DOWNLOAD_FW
+  /* map the bundle once, its image is picked when the chip is detected */
+  if (enable_download_fw && auto_select_fw_name &&
+      (pFileName_bundle[0] != '\0')) {
+    bt_vnd_mrvl_open_fw_bundle(pFileName_bundle);
+  }
+#endif
   VND_LOGI("Max supported Log Level: %d", VHAL_LOG_LEVEL);
   VND_LOGI("Selected Log Level:%d", vhal_trace_level);
   ALOGI(
@@ -1552,6 +1670,9 @@ static int bt_vnd_op(bt_vendor_opcode_t opcode, void* param) {
           }
 #endif
           mchar_fd = uart_init_open(mchar_port, baudrate, 0);
+#ifdef UART_DOWNLOAD_FW
+          bt_vnd_mrvl_port_opened();
+#endif
           if ((independent_reset_mode == IR_MODE_INBAND_VSC) &&
               (mchar_fd > 0)) {
             if (bt_vnd_send_inband_ir(baudrate) != 0) {
@@ -1597,7 +1718,7 @@ static int bt_vnd_op(bt_vendor_opcode_t opcode, void* param) {
             VND_LOGE("Error: %s (%d)", strerror(errno), errno);
             return -1;
           }
-          tcflush(mchar_fd, TCIOFLUSH);
+          fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
         }
 #else
         ti.c_cflag |= CRTSCTS;
@@ -1606,7 +1727,7 @@ static int bt_vnd_op(bt_vendor_opcode_t opcode, void* param) {
           VND_LOGE("Error: %s (%d)", strerror(errno), errno);
           return -1;
         }
-        tcflush(mchar_fd, TCIOFLUSH);
+        fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
 #endif
         if (!bluetooth_opened) {
 #ifdef UART_DOWNLOAD_FW
@@ -1679,7 +1800,7 @@ static int bt_vnd_op(bt_vendor_opcode_t opcode, void* param) {
       /* mBtChar port is blocked on read. Release the port before we close it */
       if (is_uart_port) {
         if (mchar_fd) {
-          tcflush(mchar_fd, TCIOFLUSH);
+          fw_upload_ComFlush(mchar_fd, TCIOFLUSH);
           close(mchar_fd);
           mchar_fd = 0;
         }
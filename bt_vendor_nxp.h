@@ -62,6 +62,9 @@
 #define MALLOC_RETURNED_NULL 0xB
 #define START_INDICATION_NOT_FOUND 0xC
 #define INVALID_LEN_TO_SEND 0xD
+#define IMAGE_CRC_CHECK_FAIL 0xE
+#define IMAGE_MALFORMED 0xF
+#define WRITE_PORT_FAIL 0x10
 
 #define BLE_SET_1M_POWER 0x01
 #define BLE_SET_2M_POWER 0x02
@@ -99,6 +102,11 @@
 
 #define PROP_BLUETOOTH_BOOT_SLEEP_TRIGGER \
   "bluetooth.nxp.sent_boot_sleep_triggered"
+/* Fastest firmware download baud rate that worked on this board */
+#define PROP_BLUETOOTH_DL_BAUDRATE "persist.vendor.nxp.bt_dl_baudrate"
+/* Clean downloads left before the next faster download baud rate is tried
+ * again, 0 if it is not */
+#define PROP_BLUETOOTH_DL_BAUD_CLIMB "persist.vendor.nxp.bt_dl_baud_climb"
 /* Run-time configuration file */
 #ifndef VENDOR_LIB_CONF_FILE
 #define VENDOR_LIB_CONF_FILE "/vendor/etc/bluetooth/bt_vendor.conf"
@@ -217,6 +225,7 @@ extern uint8_t enable_poke_controller;
 
 void hw_config_start(void);
 int32 init_uart(int8* dev, uint32 dwBaudRate, uint8 ucFlowCtrl);
+uint32 uart_speed(uint32 s);
 int get_prop_int32(const char* name);
 void set_prop_int32(const char* name, int value);
 int8 hw_bt_send_wakeup_disable_raw(void);
@@ -31,15 +31,65 @@
 
 #include <cutils/properties.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "bt_vendor_log.h"
 /*================================== Macros ==================================*/
 #define TIMEOUT_SEC 6
+/* Size of the RX ring, must be a power of 2 */
+#define RX_RING_SIZE 4096
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+/* Room for bytes queued ahead of the next write */
+#define TX_PENDING_SIZE 16
+/* Longest time a write may stay blocked on a full TX buffer */
+#define TX_TIMEOUT_MS 2000
+/* Interval at which CTS is sampled after a download if the transport cannot
+ * wait for it */
+#define MODEM_POLL_INTERVAL_MS 2
+/* Firmware bundle header and index entry, see fw_upload_BundleOpen() */
+#define FW_BUNDLE_MAGIC "NXBD"
+#define FW_BUNDLE_VERSION 1U
+#define FW_BUNDLE_HDR_LEN 12U
+#define FW_BUNDLE_ENTRY_LEN 12U
 
 /*================================== Typedefs=================================*/
 
+/* Receive ring sitting in front of the port. Bytes are pulled from the
+ * kernel with one bulk read() and served to the loaders from memory. */
+typedef struct {
+  int32 fd;       /* port the buffered bytes belong to */
+  uint32 uiHead;  /* free running read index */
+  uint32 uiTail;  /* free running write index */
+  uint8 ucBuf[RX_RING_SIZE];
+} fw_upload_rx_ring_t;
+
+/* Bytes queued with fw_upload_ComQueueChars(), sent together with the next
+ * write on the same port. */
+typedef struct {
+  int32 fd;
+  uint32 uiLen;
+  uint8 ucBuf[TX_PENDING_SIZE];
+} fw_upload_tx_pending_t;
+
+/* CTS pulse fw_upload_ComGetCTS_after_fw_dwnl() waits for */
+typedef struct {
+  bool bUseIcount;      /* the transport counts CTS transitions */
+  uint32 uiStartCount;  /* CTS transitions counted at the start */
+  bool bHigh;           /* CTS has been high */
+} fw_upload_cts_pulse_t;
+
 /*================================ Variables =================================*/
+/* The ring, the queued bytes and the counters belong to the thread that
+ * drives the port, so every port of a parallel download has its own */
+static __thread fw_upload_rx_ring_t rx_ring = {.fd = -1};
+static __thread fw_upload_rx_stats_t rx_stats;
+static __thread fw_upload_tx_pending_t tx_pending = {.fd = -1};
+static __thread fw_upload_tx_stats_t tx_stats;
+static const fw_upload_transport_t* transport = &fw_upload_uart_transport;
 
 /*============================ Function Prototypes ===========================*/
 
@@ -83,6 +133,31 @@ bool fw_upload_lenValid(uint16* uiLenToSend, uint8* ucArray) {
   }
 }
 
+/******************************************************************************
+ *
+ * Name: fw_upload_GetLe32
+ *
+ * Description:
+ *   Reads a little endian 32 bit field.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pBuf: the field.
+ *
+ * Return Value:
+ *   The field value.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_GetLe32(const uint8* pBuf) {
+  return pBuf[0] | ((uint32)pBuf[1] << 8) | ((uint32)pBuf[2] << 16) |
+         ((uint32)pBuf[3] << 24);
+}
+
 /******************************************************************************
  *
  * Name: fw_upload_GetDataLen
@@ -103,7 +178,45 @@ bool fw_upload_lenValid(uint16* uiLenToSend, uint8* ucArray) {
  *   None.
  *
  *****************************************************************************/
-uint16 fw_upload_GetDataLen(uint8* buf) { return (buf[8] | (buf[9] << 8)); }
+uint16 fw_upload_GetDataLen(const uint8* buf) {
+  return (buf[8] | (buf[9] << 8));
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetBlockDataLen
+ *
+ * Description:
+ *   This function decodes a V1 block header: its command and the number of
+ *   data bytes the bootloader expects after it.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   *buf:   buffer that stores the header.
+ *   pulCmd: receives the command, may be NULL.
+ *
+ * Return Value:
+ *   The length from fw_upload_GetDataLen(), 0 for the header only command
+ *   FW_BLOCK_CMD_CHANGE_TIMEOUT.
+ *
+ * Notes:
+ *   Every reader of the image blocks decodes them here, so that the index,
+ *   the image check and the V1 loader agree on where each block ends.
+ *
+ *****************************************************************************/
+uint16 fw_upload_GetBlockDataLen(const uint8* buf, uint32* pulCmd) {
+  uint32 ulCmd = fw_upload_GetLe32(buf);
+
+  if (pulCmd != NULL) {
+    *pulCmd = ulCmd;
+  }
+  if (ulCmd == FW_BLOCK_CMD_CHANGE_TIMEOUT) {
+    return 0;
+  }
+  return fw_upload_GetDataLen(buf);
+}
 
 /******************************************************************************
  *
@@ -146,6 +259,146 @@ void fw_upload_DelayInMs(uint32 uiMs) {
   }
 }
 
+/******************************************************************************
+ *
+ * Name: fw_upload_RxBind
+ *
+ * Description:
+ *   Makes sure the RX ring holds data for fd. Bytes buffered for another
+ *   port are discarded. Characters queued for transmission on fd are sent
+ *   first, as whatever is read next may be the answer to them.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_RxBind(int32 fd) {
+  fw_upload_ComSendQueued(fd);
+  if (rx_ring.fd != fd) {
+    rx_ring.fd = fd;
+    rx_ring.uiHead = 0;
+    rx_ring.uiTail = 0;
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_RxCount
+ *
+ * Description:
+ *   Returns the number of bytes buffered in the RX ring for fd.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   Number of buffered bytes.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_RxCount(int32 fd) {
+  fw_upload_RxBind(fd);
+  return rx_ring.uiTail - rx_ring.uiHead;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_RxFill
+ *
+ * Description:
+ *   Moves everything the kernel has received on fd into the RX ring.
+ *
+ * Conditions For Use:
+ *   The port must be opened in non-blocking mode.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   Number of bytes buffered in the RX ring.
+ *
+ * Notes:
+ *   Normally a single read call. A second one is only issued when the
+ *   free space of the ring wraps around and the first read filled the
+ *   contiguous part completely.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_RxFill(int32 fd) {
+  uint32 uiFree;
+  uint32 uiPos;
+  uint32 uiChunk;
+  int32 iRead;
+
+  fw_upload_RxBind(fd);
+  uiFree = RX_RING_SIZE - (rx_ring.uiTail - rx_ring.uiHead);
+  while (uiFree > 0) {
+    uiPos = rx_ring.uiTail & RX_RING_MASK;
+    uiChunk = RX_RING_SIZE - uiPos;
+    if (uiChunk > uiFree) {
+      uiChunk = uiFree;
+    }
+    rx_stats.ulReadCalls++;
+    iRead = transport->pfnRead(fd, &rx_ring.ucBuf[uiPos], uiChunk);
+    if (iRead <= 0) {
+      break;
+    }
+    rx_ring.uiTail += (uint32)iRead;
+    rx_stats.ulBytesRead += (uint64)iRead;
+    uiFree -= (uint32)iRead;
+    if ((uint32)iRead < uiChunk) {
+      break;
+    }
+  }
+  return rx_ring.uiTail - rx_ring.uiHead;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_RxCopy
+ *
+ * Description:
+ *   Copies uiCount buffered bytes out of the RX ring without consuming them.
+ *
+ * Conditions For Use:
+ *   uiCount must not exceed the number of buffered bytes.
+ *
+ * Arguments:
+ *   pBuffer : Destination buffer.
+ *   uiCount : Number of bytes to copy.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_RxCopy(uint8* pBuffer, uint32 uiCount) {
+  uint32 uiPos = rx_ring.uiHead & RX_RING_MASK;
+  uint32 uiChunk = RX_RING_SIZE - uiPos;
+
+  if (uiChunk >= uiCount) {
+    memcpy(pBuffer, &rx_ring.ucBuf[uiPos], uiCount);
+  } else {
+    memcpy(pBuffer, &rx_ring.ucBuf[uiPos], uiChunk);
+    memcpy(pBuffer + uiChunk, rx_ring.ucBuf, uiCount - uiChunk);
+  }
+}
+
 /******************************************************************************
  *
  * Name: fw_upload_ComReadChar
@@ -164,19 +417,16 @@ void fw_upload_DelayInMs(uint32 uiMs) {
  *   Returns -1 if no character available (OR TIMED-OUT)
  *
  * Notes:
- *   None.
+ *   The character is served from the RX ring, the port is only read when
+ *   the ring is empty.
  *
  *****************************************************************************/
 uint8 fw_upload_ComReadChar(int32 fd) {
-  int32 iResult = 0;
-  size_t ucNumCharToRead = 1;
   uint8 ret = 0;
 
-  if (read(fd, &iResult, ucNumCharToRead) == (ssize_t)ucNumCharToRead) {
-    ret = (uint8)(iResult & 0xFF);
-  } else {
-    //  VND_LOGV("Read error: %s (%d)", strerror(errno), errno);
-    ret = 0;
+  if ((fw_upload_RxCount(fd) > 0) || (fw_upload_RxFill(fd) > 0)) {
+    ret = rx_ring.ucBuf[rx_ring.uiHead & RX_RING_MASK];
+    rx_ring.uiHead++;
   }
   return ret;
 }
@@ -201,201 +451,1802 @@ uint8 fw_upload_ComReadChar(int32 fd) {
  *   Returns -1 if iCount characters could not be read or if Port ID is invalid.
  *
  * Notes:
- *   None.
+ *   The characters are served from the RX ring, the port is only read when
+ *   the ring holds less than iCount characters.
  *
  *****************************************************************************/
 void fw_upload_ComReadChars(int32 fd, uint8* pBuffer, uint32 uiCount) {
-  if (read(fd, pBuffer, uiCount) != (ssize_t)uiCount) {
-    VND_LOGV("Read error: %s (%d)", strerror(errno), errno);
+  uint32 uiAvail = fw_upload_RxCount(fd);
+
+  if (uiAvail < uiCount) {
+    uiAvail = fw_upload_RxFill(fd);
   }
+  if (uiAvail < uiCount) {
+    VND_LOGV("Read error: %d of %d bytes available", uiAvail, uiCount);
+    uiCount = uiAvail;
+  }
+  fw_upload_RxCopy(pBuffer, uiCount);
+  rx_ring.uiHead += uiCount;
   return;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_ComWriteChar
+ * Name: fw_upload_ComPeekChars
  *
  * Description:
- *   Write a character to the port specified by fd.
+ *   Copies up to uiCount characters received on fd into pBuffer without
+ *   consuming them. A subsequent read returns the same characters.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   fd : Port ID.
- *   iChar   : Character to be written
+ *   fd      : Port ID.
+ *   pBuffer : Destination buffer for the characters.
+ *   uiCount : Number of characters to peek at.
  *
  * Return Value:
- *   Returns true, if write is Successful.
- *   Returns false if write is a failure.
+ *   Number of characters copied into pBuffer.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-void fw_upload_ComWriteChar(int32 fd, uint8 iChar) {
-  ssize_t ucNumCharToWrite = 1;
+uint32 fw_upload_ComPeekChars(int32 fd, uint8* pBuffer, uint32 uiCount) {
+  uint32 uiAvail = fw_upload_RxCount(fd);
 
-  if (write(fd, &iChar, (size_t)ucNumCharToWrite) != ucNumCharToWrite) {
-    VND_LOGE("Write error: %s (%d)", strerror(errno), errno);
+  if (uiAvail < uiCount) {
+    uiAvail = fw_upload_RxFill(fd);
   }
-  return;
+  if (uiAvail < uiCount) {
+    uiCount = uiAvail;
+  }
+  fw_upload_RxCopy(pBuffer, uiCount);
+  return uiCount;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_ComWriteChars
+ * Name: fw_upload_ComSkipChars
  *
  * Description:
- *   Write iLen characters to the port specified by fd.
+ *   Discards uiCount characters received on fd.
  *
  * Conditions For Use:
- *   None.
+ *   The characters must have been looked at with fw_upload_ComPeekChars().
  *
  * Arguments:
- *   fd : Port ID.
- *   pBuffer : Buffer where characters are available to be written to the Port.
- *   iLen    : Number of Characters to write.
+ *   fd      : Port ID.
+ *   uiCount : Number of characters to discard.
  *
  * Return Value:
- *   Returns true, if write is Successful.
- *   Returns false if write is a failure.
+ *   None.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-void fw_upload_ComWriteChars(int32 fd, uint8* pBuffer, uint32 uiLen) {
-  if (write(fd, pBuffer, uiLen) != (ssize_t)uiLen) {
-    VND_LOGE("Write error: %s (%d)", strerror(errno), errno);
+void fw_upload_ComSkipChars(int32 fd, uint32 uiCount) {
+  uint32 uiAvail = fw_upload_RxCount(fd);
+
+  rx_ring.uiHead += (uiCount < uiAvail) ? uiCount : uiAvail;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComReadSignature
+ *
+ * Description:
+ *   Searches the received data for the first character that is one of the
+ *   uiSigCount signatures in pSignatures. Characters in front of it are
+ *   discarded and the signature itself is consumed.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd          : Port ID.
+ *   pSignatures : Header signatures to look for.
+ *   uiSigCount  : Number of entries in pSignatures.
+ *
+ * Return Value:
+ *   The signature found.
+ *   -1 if none of the received characters is a signature, in which case
+ *   all of them have been discarded.
+ *
+ * Notes:
+ *   Only the RX ring is scanned, callers refill it with
+ *   fw_upload_WaitForBytes() on a miss. The scan runs over the contiguous
+ *   parts of the ring with memchr() once per signature, each pass bounded
+ *   by the best match so far.
+ *
+ *****************************************************************************/
+int32 fw_upload_ComReadSignature(int32 fd, const uint8* pSignatures,
+                                 uint32 uiSigCount) {
+  uint32 uiAvail;
+  uint32 uiPos;
+  uint32 uiChunk;
+  uint32 uiLen;
+  uint32 i;
+  uint8* pStart;
+  uint8* pFound;
+  uint8* pHit;
+  uint8 ucSig;
+
+  uiAvail = fw_upload_RxCount(fd);
+  while (uiAvail > 0) {
+    uiPos = rx_ring.uiHead & RX_RING_MASK;
+    uiChunk = RX_RING_SIZE - uiPos;
+    if (uiChunk > uiAvail) {
+      uiChunk = uiAvail;
+    }
+    pStart = &rx_ring.ucBuf[uiPos];
+    pFound = NULL;
+    uiLen = uiChunk;
+    for (i = 0; i < uiSigCount; i++) {
+      pHit = memchr(pStart, pSignatures[i], uiLen);
+      if (pHit != NULL) {
+        pFound = pHit;
+        uiLen = (uint32)(pHit - pStart);
+      }
+    }
+    if (pFound != NULL) {
+      ucSig = *pFound;
+      rx_ring.uiHead += (uint32)(pFound - pStart) + 1;
+      return ucSig;
+    }
+    rx_ring.uiHead += uiChunk;
+    uiAvail -= uiChunk;
   }
-  return;
+  return -1;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_ComGetCTS
+ * Name: fw_upload_ComProbeHci
  *
  * Description:
- *   Check CTS status
+ *   Sends the parameterless HCI command uiOpcode and waits for whatever
+ *   answers first: a bootloader header signature or the Command Complete
+ *   event of running firmware.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
+ *   fd          : Port ID.
+ *   uiOpcode    : HCI command to send.
+ *   pSignatures : Bootloader header signatures to look for.
+ *   uiSigCount  : Number of entries in pSignatures.
+ *   pDeadline   : when to give up waiting.
  *
  * Return Value:
+ *   The signature found, which is left unread.
+ *   FW_UPLOAD_PROBE_HCI_EVENT if the Command Complete event arrived, it has
+ *   been consumed.
+ *   -1 if nothing answered before pDeadline.
  *
  * Notes:
+ *   HCI event frames are read whole, so a signature value inside an event
+ *   is not taken for a bootloader. Events other than the Command Complete
+ *   of uiOpcode are discarded, as are received characters outside a frame
+ *   that are no signature.
+ *
+ *****************************************************************************/
+int32 fw_upload_ComProbeHci(int32 fd, uint16 uiOpcode,
+                            const uint8* pSignatures, uint32 uiSigCount,
+                            const fw_upload_deadline_t* pDeadline) {
+  // Event bytes up to and including the opcode of a Command Complete
+  static const uint32 uiOpcodeEnd = HCI_PACKET_TYPE_SIZE +
+                                    HCI_EVENT_HEADER_SIZE +
+                                    HCI_EVT_PYLD_OPCODE_IDX + 2U;
+  static const uint32 uiHeaderLen =
+      HCI_PACKET_TYPE_SIZE + HCI_EVENT_HEADER_SIZE;
+  uint8 ucCmd[HCI_PACKET_TYPE_SIZE + HCI_COMMAND_HEADER_SIZE];
+  uint8 ucEvt[HCI_PACKET_TYPE_SIZE + HCI_EVENT_HEADER_SIZE +
+              HCI_EVT_PYLD_OPCODE_IDX + 2U];
+  uint32 uiAvail;
+  uint32 uiEvtLen;
+  uint8 ucByte;
+
+  ucCmd[0] = HCI_PACKET_COMMAND;
+  ucCmd[1] = (uint8)(uiOpcode & 0xFFU);
+  ucCmd[2] = (uint8)(uiOpcode >> 8);
+  ucCmd[3] = 0;
+  if (!fw_upload_ComWriteChars(fd, ucCmd, sizeof(ucCmd))) {
+    VND_LOGE("HCI probe not sent");
+  }
+
+  uiAvail = fw_upload_RxFill(fd);
+  for (;;) {
+    // Outside a frame only a signature or the start of an event counts
+    while (uiAvail > 0) {
+      ucByte = rx_ring.ucBuf[rx_ring.uiHead & RX_RING_MASK];
+      if (ucByte == HCI_PACKET_EVENT) {
+        break;
+      }
+      if (memchr(pSignatures, ucByte, uiSigCount) != NULL) {
+        return ucByte;
+      }
+      rx_ring.uiHead++;
+      uiAvail--;
+    }
+    if (uiAvail < uiHeaderLen) {
+      if (!fw_upload_WaitForBytesUntil(fd, uiAvail + 1, pDeadline)) {
+        return -1;
+      }
+      uiAvail = fw_upload_RxCount(fd);
+      continue;
+    }
+    uiEvtLen =
+        uiHeaderLen + rx_ring.ucBuf[(rx_ring.uiHead + 2U) & RX_RING_MASK];
+    if (!fw_upload_WaitForBytesUntil(fd, uiEvtLen, pDeadline)) {
+      return -1;
+    }
+    if (uiEvtLen >= uiOpcodeEnd) {
+      fw_upload_RxCopy(ucEvt, uiOpcodeEnd);
+      if ((ucEvt[1] == HCI_EVENT_COMMAND_COMPLETE) &&
+          (ucEvt[uiOpcodeEnd - 2] == (uint8)(uiOpcode & 0xFFU)) &&
+          (ucEvt[uiOpcodeEnd - 1] == (uint8)(uiOpcode >> 8))) {
+        rx_ring.uiHead += uiEvtLen;
+        return FW_UPLOAD_PROBE_HCI_EVENT;
+      }
+    }
+    VND_LOGD("HCI event 0x%02x of %u bytes skipped",
+             rx_ring.ucBuf[(rx_ring.uiHead + 1U) & RX_RING_MASK], uiEvtLen);
+    rx_ring.uiHead += uiEvtLen;
+    uiAvail = fw_upload_RxCount(fd);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComFlush
+ *
+ * Description:
+ *   Discards data on the port like tcflush(). When the receive queue is
+ *   flushed the characters buffered in the RX ring are dropped as well,
+ *   flushing the transmit queue drops queued characters.
+ *
+ * Conditions For Use:
  *   None.
  *
+ * Arguments:
+ *   fd       : Port ID.
+ *   iQueue   : TCIFLUSH, TCOFLUSH or TCIOFLUSH.
+ *
+ * Return Value:
+ *   Return value of tcflush().
+ *
+ * Notes:
+ *   Goes through the flush of the selected transport.
+ *
  *****************************************************************************/
-int32 fw_upload_ComGetCTS(int32 fd) {
-  int32 status;
-  if (ioctl(fd, TIOCMGET, &status) < 0) {
-    VND_LOGE("ioctl error: %s (%d)", strerror(errno), errno);
+int32 fw_upload_ComFlush(int32 fd, int32 iQueue) {
+  if (iQueue != TCIFLUSH) {
+    tx_pending.uiLen = 0;
   }
-  if (status & TIOCM_CTS) {
-    return 0;
-  } else {
-    return 1;
+  if (iQueue != TCOFLUSH) {
+    rx_ring.fd = fd;
+    rx_ring.uiHead = 0;
+    rx_ring.uiTail = 0;
   }
+  return transport->pfnFlush(fd, iQueue);
 }
+
 /******************************************************************************
  *
- * Name: fw_upload_ComGetBufferSize
+ * Name: fw_upload_ComDrain
  *
  * Description:
- *   Check buffer size
+ *   Waits until everything written to the port has been transmitted, queued
+ *   characters included.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   fd
+ *   fd : Port ID.
  *
  * Return Value:
- *   size in buffer
+ *   0 on success, -1 on error.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-uint32 fw_upload_GetBufferSize(int32 fd) {
-  uint32 bytes = 0;
-  if (ioctl(fd, FIONREAD, &bytes) < 0) {
-    VND_LOGE("ioctl error: %s (%d)", strerror(errno), errno);
+int32 fw_upload_ComDrain(int32 fd) {
+  fw_upload_ComSendQueued(fd);
+  return transport->pfnDrain(fd);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ImageContents
+ *
+ * Description:
+ *   Sets up the contents of an image from its file data, decompressing a
+ *   compressed container as it is read.
+ *
+ * Conditions For Use:
+ *   pImage->pFileData and pImage->uiFileSize are set.
+ *
+ * Arguments:
+ *   pImage : The image.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS, IMAGE_MALFORMED or MALLOC_RETURNED_NULL, the image is
+ *   closed on error.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_ImageContents(fw_upload_image_t* pImage) {
+  uint32 ulResult;
+
+  ulResult = fw_upload_LzOpen(pImage->pFileData, pImage->uiFileSize,
+                              &pImage->pLz, &pImage->uiSize);
+  if (ulResult != DOWNLOAD_SUCCESS) {
+    fw_upload_ImageClose(pImage);
+    return ulResult;
   }
-  return bytes;
+  if (pImage->pLz == NULL) {
+    pImage->pData = pImage->pFileData;
+    pImage->uiSize = pImage->uiFileSize;
+  }
+  return DOWNLOAD_SUCCESS;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_GetTime
+ * Name: fw_upload_ImageOpen
  *
  * Description:
- *   Get the current time
+ *   Makes the contents of the firmware file available in memory. The file
+ *   is mapped read-only so that the send paths index the page cache
+ *   directly; filesystems that cannot be mapped get a heap copy instead.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
+ *   pImage : Receives the image, release with fw_upload_ImageClose().
+ *   pFile  : The opened firmware file.
  *
  * Return Value:
- *   return the current time in milliseconds
+ *   DOWNLOAD_SUCCESS, FEEK_SEEK_ERROR, FILESIZE_IS_ZERO,
+ *   MALLOC_RETURNED_NULL, READ_FILE_FAIL or IMAGE_MALFORMED.
  *
  * Notes:
- *   None.
+ *   The file position of pFile is left at the start of the file. A
+ *   compressed container, see fw_upload_LzOpen(), has no pData and is read
+ *   with fw_upload_ImageRead().
  *
  *****************************************************************************/
+uint32 fw_upload_ImageOpen(fw_upload_image_t* pImage, FILE* pFile) {
+  struct stat st;
+  void* pMap;
+  uint8* pHeap;
+  uint32 ulReadLen;
+  uint32 ulResult;
 
-uint64 fw_upload_GetTime(void) {
-  struct timespec time;
-  clockid_t clk_id;
-  uint64 millisectime = -1;
+  memset(pImage, 0, sizeof(*pImage));
+  if (fstat(fileno(pFile), &st) < 0) {
+    VND_LOGE("fstat error: %s (%d)", strerror(errno), errno);
+    return FEEK_SEEK_ERROR;
+  }
+  if ((st.st_size <= 0) || ((uint64)st.st_size > 0xFFFFFFFFULL)) {
+    VND_LOGE("Invalid Download Size %lld", (long long)st.st_size);
+    return FILESIZE_IS_ZERO;
+  }
+  pImage->uiFileSize = (uint32)st.st_size;
+  pImage->ullDev = (uint64)st.st_dev;
+  pImage->ullIno = (uint64)st.st_ino;
+  pImage->ullMtimeNs =
+      (uint64)st.st_mtim.tv_sec * NSEC_PER_SEC + (uint64)st.st_mtim.tv_nsec;
 
-  clk_id = CLOCK_MONOTONIC;
-  if (!clock_gettime(clk_id, &time)) {
-    millisectime =
-        (((uint64)time.tv_sec) * 1000) + (((uint64)time.tv_nsec) / 1000000);
+  pMap = mmap(NULL, pImage->uiFileSize, PROT_READ, MAP_PRIVATE, fileno(pFile),
+              0);
+  if (pMap != MAP_FAILED) {
+    // Read ahead asynchronously, blocks are then sent in file order
+    madvise(pMap, pImage->uiFileSize, MADV_WILLNEED);
+    madvise(pMap, pImage->uiFileSize, MADV_SEQUENTIAL);
+    pImage->pFileData = (const uint8*)pMap;
+    pImage->bMapped = true;
   } else {
-    VND_LOGE("clock_gettime error:%s (%d)", strerror(errno), errno);
+    VND_LOGD("mmap error: %s (%d), reading image into memory",
+             strerror(errno), errno);
+    pHeap = (uint8*)malloc(pImage->uiFileSize);
+    if (pHeap == NULL) {
+      VND_LOGE("malloc() returned NULL while allocating size for file");
+      return MALLOC_RETURNED_NULL;
+    }
+    if (fseek(pFile, 0, SEEK_SET) != 0) {
+      VND_LOGE("fseek error: %s (%d)", strerror(errno), errno);
+      free(pHeap);
+      return FEEK_SEEK_ERROR;
+    }
+    ulReadLen = (uint32)fread(pHeap, 1, pImage->uiFileSize, pFile);
+    if (ulReadLen != pImage->uiFileSize) {
+      VND_LOGE("fread error: %s (%d)", strerror(errno), errno);
+      free(pHeap);
+      return READ_FILE_FAIL;
+    }
+    fseek(pFile, 0, SEEK_SET);
+    pImage->pFileData = pHeap;
+    pImage->bMapped = false;
   }
-  return millisectime;
+
+  ulResult = fw_upload_ImageContents(pImage);
+  if (ulResult != DOWNLOAD_SUCCESS) {
+    return ulResult;
+  }
+  VND_LOGD("FW image %u bytes, %s%s", pImage->uiSize,
+           pImage->bMapped ? "mapped" : "read into memory",
+           (pImage->pLz != NULL) ? ", compressed" : "");
+  return DOWNLOAD_SUCCESS;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_ComGetCTS_after_fw_dwnl
+ * Name: fw_upload_ImageClose
  *
  * Description:
- *   Polls for cts_timeout duration to check the cts status after FW download
+ *   Releases an image opened with fw_upload_ImageOpen().
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
+ *   pImage : The image, may be closed already.
  *
  * Return Value:
- *   return true, if cts is low
+ *   None.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-
-bool fw_upload_ComGetCTS_after_fw_dwnl(int32 fd, int32 cts_timeout) {
-  bool cts_high_after_fw_dnl = false;
-  int32 cts_status = 0;
-  uint64 endTime = fw_upload_GetTime() + cts_timeout;
-  do {
-    cts_status = fw_upload_ComGetCTS(fd);
-    if (!cts_high_after_fw_dnl) {
-      cts_high_after_fw_dnl = (cts_status == 1) ? true : false;
-    }
-    if (!cts_status && cts_high_after_fw_dnl) {
-      return true;
+void fw_upload_ImageClose(fw_upload_image_t* pImage) {
+  fw_upload_LzClose(pImage->pLz);
+  if ((pImage->pFileData != NULL) && !pImage->bBundled) {
+    if (pImage->bMapped) {
+      munmap((void*)pImage->pFileData, pImage->uiFileSize);
+    } else {
+      free((void*)pImage->pFileData);
     }
-  } while (endTime > fw_upload_GetTime());
-  return false;
-}
\ No newline at end of file
+  }
+  pImage->pLz = NULL;
+  pImage->pFileData = NULL;
+  pImage->uiFileSize = 0;
+  pImage->pData = NULL;
+  pImage->uiSize = 0;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ImageRead
+ *
+ * Description:
+ *   Returns uiLen bytes of the image at ulPos.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage   : The image.
+ *   ulPos    : Image position.
+ *   uiLen    : Bytes wanted.
+ *   pScratch : At least uiLen bytes, used when a compressed image does not
+ *              hold the bytes in one piece.
+ *
+ * Return Value:
+ *   The bytes, NULL if they are not all in the image or do not decompress.
+ *
+ * Notes:
+ *   The bytes of a compressed image stay valid until the next read.
+ *
+ *****************************************************************************/
+const uint8* fw_upload_ImageRead(const fw_upload_image_t* pImage, uint32 ulPos,
+                                 uint32 uiLen, uint8* pScratch) {
+  if (pImage->pLz != NULL) {
+    return fw_upload_LzRead(pImage->pLz, ulPos, uiLen, pScratch);
+  }
+  if ((ulPos > pImage->uiSize) || (uiLen > pImage->uiSize - ulPos)) {
+    return NULL;
+  }
+  return pImage->pData + ulPos;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ImageCopy
+ *
+ * Description:
+ *   Copies up to uiLen bytes of the image at ulPos.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage : The image.
+ *   ulPos  : Image position.
+ *   uiLen  : Bytes wanted.
+ *   pDst   : Receives the bytes.
+ *
+ * Return Value:
+ *   Bytes copied, less than uiLen where the image ends, 0 if the bytes do
+ *   not decompress.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+uint32 fw_upload_ImageCopy(const fw_upload_image_t* pImage, uint32 ulPos,
+                           uint32 uiLen, uint8* pDst) {
+  const uint8* pSrc;
+
+  if (ulPos >= pImage->uiSize) {
+    return 0;
+  }
+  if (uiLen > pImage->uiSize - ulPos) {
+    uiLen = pImage->uiSize - ulPos;
+  }
+  pSrc = fw_upload_ImageRead(pImage, ulPos, uiLen, pDst);
+  if (pSrc == NULL) {
+    return 0;
+  }
+  if (pSrc != pDst) {
+    memcpy(pDst, pSrc, uiLen);
+  }
+  return uiLen;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_BundleOpen
+ *
+ * Description:
+ *   Maps a bundle of firmware images for several chips and starts reading
+ *   it ahead.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pBundle : Receives the bundle, release with fw_upload_BundleClose().
+ *   pFile   : The opened bundle file.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS, FEEK_SEEK_ERROR, FILESIZE_IS_ZERO, READ_FILE_FAIL or
+ *   IMAGE_MALFORMED.
+ *
+ * Notes:
+ *   The bundle starts with the magic "NXBD", the format version and the
+ *   number of images, all 32 bit little endian. Each image follows with a
+ *   16 bit chip ID, a 16 bit mask of the chip ID bits to compare and the 32
+ *   bit position and length of the image in the file. The mapping stays
+ *   valid after pFile is closed.
+ *
+ *****************************************************************************/
+uint32 fw_upload_BundleOpen(fw_upload_bundle_t* pBundle, FILE* pFile) {
+  struct stat st;
+  void* pMap;
+  const uint8* pEntry;
+  uint32 ulOffset;
+  uint32 uiLen;
+  uint32 i;
+
+  memset(pBundle, 0, sizeof(*pBundle));
+  if (fstat(fileno(pFile), &st) < 0) {
+    VND_LOGE("fstat error: %s (%d)", strerror(errno), errno);
+    return FEEK_SEEK_ERROR;
+  }
+  if ((st.st_size < (off_t)FW_BUNDLE_HDR_LEN) ||
+      ((uint64)st.st_size > 0xFFFFFFFFULL)) {
+    VND_LOGE("Invalid bundle size %lld", (long long)st.st_size);
+    return FILESIZE_IS_ZERO;
+  }
+  pMap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(pFile),
+              0);
+  if (pMap == MAP_FAILED) {
+    VND_LOGE("mmap error: %s (%d)", strerror(errno), errno);
+    return READ_FILE_FAIL;
+  }
+  pBundle->pData = (const uint8*)pMap;
+  pBundle->uiSize = (uint32)st.st_size;
+  pBundle->ullDev = (uint64)st.st_dev;
+  pBundle->ullIno = (uint64)st.st_ino;
+  pBundle->ullMtimeNs =
+      (uint64)st.st_mtim.tv_sec * NSEC_PER_SEC + (uint64)st.st_mtim.tv_nsec;
+
+  if ((memcmp(pBundle->pData, FW_BUNDLE_MAGIC, strlen(FW_BUNDLE_MAGIC)) !=
+       0) ||
+      (fw_upload_GetLe32(pBundle->pData + 4) != FW_BUNDLE_VERSION)) {
+    VND_LOGE("Not a firmware bundle");
+    fw_upload_BundleClose(pBundle);
+    return IMAGE_MALFORMED;
+  }
+  pBundle->uiEntries = fw_upload_GetLe32(pBundle->pData + 8);
+  if ((uint64)pBundle->uiEntries * FW_BUNDLE_ENTRY_LEN >
+      pBundle->uiSize - FW_BUNDLE_HDR_LEN) {
+    VND_LOGE("Bundle index is truncated");
+    fw_upload_BundleClose(pBundle);
+    return IMAGE_MALFORMED;
+  }
+  for (i = 0; i < pBundle->uiEntries; i++) {
+    pEntry = pBundle->pData + FW_BUNDLE_HDR_LEN + i * FW_BUNDLE_ENTRY_LEN;
+    ulOffset = fw_upload_GetLe32(pEntry + 4);
+    uiLen = fw_upload_GetLe32(pEntry + 8);
+    if ((uiLen == 0) || ((uint64)ulOffset + uiLen > pBundle->uiSize)) {
+      VND_LOGE("Bundle image %u is out of bounds", i);
+      fw_upload_BundleClose(pBundle);
+      return IMAGE_MALFORMED;
+    }
+  }
+  // Read ahead asynchronously, the image is needed once the chip is known
+  madvise(pMap, pBundle->uiSize, MADV_WILLNEED);
+  VND_LOGD("FW bundle %u bytes, %u images", pBundle->uiSize,
+           pBundle->uiEntries);
+  return DOWNLOAD_SUCCESS;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_BundleFind
+ *
+ * Description:
+ *   Looks up the image of a chip in a bundle.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pBundle  : The bundle.
+ *   uiChipId : Chip ID and revision from the bootloader start indication.
+ *
+ * Return Value:
+ *   The image number, -1 if the bundle has no image for the chip.
+ *
+ * Notes:
+ *   The first image whose chip ID matches under its mask is taken, so an
+ *   image for all revisions of a chip can follow the revision specific ones.
+ *
+ *****************************************************************************/
+int32 fw_upload_BundleFind(const fw_upload_bundle_t* pBundle,
+                           uint16 uiChipId) {
+  const uint8* pEntry;
+  uint16 uiId;
+  uint16 uiMask;
+  uint32 i;
+
+  for (i = 0; i < pBundle->uiEntries; i++) {
+    pEntry = pBundle->pData + FW_BUNDLE_HDR_LEN + i * FW_BUNDLE_ENTRY_LEN;
+    uiId = (uint16)(pEntry[0] | (pEntry[1] << 8));
+    uiMask = (uint16)(pEntry[2] | (pEntry[3] << 8));
+    if (((uiChipId ^ uiId) & uiMask) == 0) {
+      return (int32)i;
+    }
+  }
+  return -1;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_BundleImage
+ *
+ * Description:
+ *   Opens an image of a bundle like fw_upload_ImageOpen() opens a file.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pBundle : The bundle.
+ *   uiEntry : Image number, see fw_upload_BundleFind().
+ *   pImage  : Receives the image, release with fw_upload_ImageClose().
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS, OPEN_FILE_FAIL, IMAGE_MALFORMED or
+ *   MALLOC_RETURNED_NULL.
+ *
+ * Notes:
+ *   The image stays in the bundle mapping, nothing is read or copied.
+ *
+ *****************************************************************************/
+uint32 fw_upload_BundleImage(const fw_upload_bundle_t* pBundle,
+                             uint32 uiEntry, fw_upload_image_t* pImage) {
+  const uint8* pEntry;
+
+  memset(pImage, 0, sizeof(*pImage));
+  if ((pBundle->pData == NULL) || (uiEntry >= pBundle->uiEntries)) {
+    return OPEN_FILE_FAIL;
+  }
+  pEntry = pBundle->pData + FW_BUNDLE_HDR_LEN + uiEntry * FW_BUNDLE_ENTRY_LEN;
+  pImage->ulFileOffset = fw_upload_GetLe32(pEntry + 4);
+  pImage->uiFileSize = fw_upload_GetLe32(pEntry + 8);
+  pImage->pFileData = pBundle->pData + pImage->ulFileOffset;
+  pImage->bMapped = true;
+  pImage->bBundled = true;
+  pImage->ullDev = pBundle->ullDev;
+  pImage->ullIno = pBundle->ullIno;
+  pImage->ullMtimeNs = pBundle->ullMtimeNs;
+  if (fw_upload_ImageContents(pImage) != DOWNLOAD_SUCCESS) {
+    return IMAGE_MALFORMED;
+  }
+  VND_LOGD("FW image %u bytes at %u of the bundle%s", pImage->uiSize,
+           pImage->ulFileOffset, (pImage->pLz != NULL) ? ", compressed" : "");
+  return DOWNLOAD_SUCCESS;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_BundleClose
+ *
+ * Description:
+ *   Releases a bundle opened with fw_upload_BundleOpen().
+ *
+ * Conditions For Use:
+ *   No image of the bundle is open.
+ *
+ * Arguments:
+ *   pBundle : The bundle, may be closed already.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void fw_upload_BundleClose(fw_upload_bundle_t* pBundle) {
+  if (pBundle->pData != NULL) {
+    munmap((void*)pBundle->pData, pBundle->uiSize);
+  }
+  memset(pBundle, 0, sizeof(*pBundle));
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComSetBaud
+ *
+ * Description:
+ *   Switches the port to a new baud rate.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd         : Port ID.
+ *   pPortName  : Device path of the port.
+ *   uiBaud     : New baud rate.
+ *   ucFlowCtrl : Enable hardware flow control.
+ *
+ * Return Value:
+ *   The port ID to use from now on, -1 on error.
+ *
+ * Notes:
+ *   Queued characters are sent at the old rate first. Anything buffered in
+ *   the RX ring is dropped, it was received at the old rate.
+ *
+ *****************************************************************************/
+int32 fw_upload_ComSetBaud(int32 fd, int8* pPortName, uint32 uiBaud,
+                           uint8 ucFlowCtrl) {
+  int32 newFd;
+
+  fw_upload_ComSendQueued(fd);
+  newFd = transport->pfnSetBaud(fd, pPortName, uiBaud, ucFlowCtrl);
+  rx_ring.fd = newFd;
+  rx_ring.uiHead = 0;
+  rx_ring.uiTail = 0;
+  return newFd;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_SetTransport
+ *
+ * Description:
+ *   Selects the transport all loader I/O goes through.
+ *
+ * Conditions For Use:
+ *   Not while a download is running.
+ *
+ * Arguments:
+ *   pTransport : fw_upload_uart_transport, fw_upload_pty_transport,
+ *                fw_upload_loopback_transport or NULL for the UART.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Buffered and queued characters of the previous transport are dropped.
+ *
+ *****************************************************************************/
+void fw_upload_SetTransport(const fw_upload_transport_t* pTransport) {
+  transport = (pTransport != NULL) ? pTransport : &fw_upload_uart_transport;
+  rx_ring.fd = -1;
+  rx_ring.uiHead = 0;
+  rx_ring.uiTail = 0;
+  tx_pending.uiLen = 0;
+  VND_LOGD("Loader transport: %s", transport->pName);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetTransport
+ *
+ * Description:
+ *   Returns the transport selected with fw_upload_SetTransport().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   The selected transport.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+const fw_upload_transport_t* fw_upload_GetTransport(void) { return transport; }
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetRxStats
+ *
+ * Description:
+ *   Returns the receive path counters.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pStats : Filled with the counters accumulated since the last
+ *            fw_upload_ResetRxStats().
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The counters are those of the calling thread.
+ *
+ *****************************************************************************/
+void fw_upload_GetRxStats(fw_upload_rx_stats_t* pStats) {
+  *pStats = rx_stats;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ResetRxStats
+ *
+ * Description:
+ *   Clears the receive path counters.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void fw_upload_ResetRxStats(void) { memset(&rx_stats, 0, sizeof(rx_stats)); }
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetTxStats
+ *
+ * Description:
+ *   Returns the transmit path counters.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pStats : Filled with the counters accumulated since the last
+ *            fw_upload_ResetTxStats().
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The counters are those of the calling thread.
+ *
+ *****************************************************************************/
+void fw_upload_GetTxStats(fw_upload_tx_stats_t* pStats) {
+  *pStats = tx_stats;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ResetTxStats
+ *
+ * Description:
+ *   Clears the transmit path counters.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void fw_upload_ResetTxStats(void) { memset(&tx_stats, 0, sizeof(tx_stats)); }
+
+/******************************************************************************
+ *
+ * Name: fw_upload_HistAdd
+ *
+ * Description:
+ *   Adds a sample to a power of two histogram.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pHist   : Histogram, all zero before the first sample.
+ *   uiValue : Sample to add.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void fw_upload_HistAdd(fw_upload_hist_t* pHist, uint32 uiValue) {
+  uint32 i = 0;
+
+  if ((pHist->uiCount == 0) || (uiValue < pHist->uiMin)) {
+    pHist->uiMin = uiValue;
+  }
+  if (uiValue > pHist->uiMax) {
+    pHist->uiMax = uiValue;
+  }
+  pHist->uiCount++;
+  pHist->ullTotal += uiValue;
+  while ((i + 1 < FW_UPLOAD_HIST_BUCKETS) && (uiValue >= (1U << i))) {
+    i++;
+  }
+  pHist->uiBucket[i]++;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_HistLog
+ *
+ * Description:
+ *   Logs the summary and the non-empty buckets of a histogram.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pName : What the histogram measures.
+ *   pUnit : Unit of the samples.
+ *   pHist : Histogram to log.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   A bucket is printed as <limit:count, the last one as >=limit:count.
+ *
+ *****************************************************************************/
+void fw_upload_HistLog(const char* pName, const char* pUnit,
+                       const fw_upload_hist_t* pHist) {
+  char line[FW_UPLOAD_HIST_BUCKETS * 24];
+  uint32 len = 0;
+  uint32 i;
+
+  if (pHist->uiCount == 0) {
+    VND_LOGD("%s: no samples", pName);
+    return;
+  }
+  VND_LOGD("%s: %u samples, min %u, avg %llu, max %u %s", pName,
+           pHist->uiCount, pHist->uiMin, pHist->ullTotal / pHist->uiCount,
+           pHist->uiMax, pUnit);
+  line[0] = '\0';
+  for (i = 0; (i < FW_UPLOAD_HIST_BUCKETS) && (len < sizeof(line)); i++) {
+    if (pHist->uiBucket[i] == 0) {
+      continue;
+    }
+    if (i + 1 < FW_UPLOAD_HIST_BUCKETS) {
+      len += (uint32)snprintf(&line[len], sizeof(line) - len, " <%u:%u",
+                              1U << i, pHist->uiBucket[i]);
+    } else {
+      len += (uint32)snprintf(&line[len], sizeof(line) - len, " >=%u:%u",
+                              1U << (i - 1), pHist->uiBucket[i]);
+    }
+  }
+  VND_LOGD("%s histogram:%s", pName, line);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_WriteV
+ *
+ * Description:
+ *   Writes the queued bytes, pFrame and pData to fd. Normally this is one
+ *   writev() call; when the kernel TX buffer is full the remainder is sent
+ *   as soon as the transport reports the port writable again.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd         : Port ID.
+ *   pFrame     : First buffer, may be NULL.
+ *   uiFrameLen : Length of pFrame.
+ *   pData      : Second buffer, may be NULL.
+ *   uiDataLen  : Length of pData.
+ *
+ * Return Value:
+ *   true if everything was written.
+ *   false on a write error or if the data could not be written within
+ *   TX_TIMEOUT_MS of the first stall.
+ *
+ * Notes:
+ *   Queued bytes that belong to another port are dropped.
+ *
+ *****************************************************************************/
+static bool fw_upload_WriteV(int32 fd, const uint8* pFrame, uint32 uiFrameLen,
+                             const uint8* pData, uint32 uiDataLen) {
+  struct iovec iov[3];
+  struct iovec* pIov = iov;
+  fw_upload_deadline_t deadline;
+  bool bStalled = false;
+  int32 iovcnt = 0;
+  int32 iRet;
+  int32 written;
+  uint64 blockStart;
+
+  if ((tx_pending.uiLen != 0) && (tx_pending.fd == fd)) {
+    iov[iovcnt].iov_base = tx_pending.ucBuf;
+    iov[iovcnt++].iov_len = tx_pending.uiLen;
+  }
+  tx_pending.uiLen = 0;
+  if (uiFrameLen != 0) {
+    iov[iovcnt].iov_base = (void*)pFrame;
+    iov[iovcnt++].iov_len = uiFrameLen;
+  }
+  if (uiDataLen != 0) {
+    iov[iovcnt].iov_base = (void*)pData;
+    iov[iovcnt++].iov_len = uiDataLen;
+  }
+
+  while (iovcnt > 0) {
+    tx_stats.ulWriteCalls++;
+    written = transport->pfnWritev(fd, pIov, iovcnt);
+    if (written < 0) {
+      return false;
+    }
+    tx_stats.ulBytesWritten += (uint64)written;
+    // Skip what went out, a partially written buffer is resumed
+    while ((iovcnt > 0) && ((size_t)written >= pIov->iov_len)) {
+      written -= (int32)pIov->iov_len;
+      pIov++;
+      iovcnt--;
+    }
+    if (iovcnt == 0) {
+      break;
+    }
+    pIov->iov_base = (uint8*)pIov->iov_base + written;
+    pIov->iov_len -= (size_t)written;
+
+    // Kernel TX buffer is full, wait until it drains
+    tx_stats.ulShortWrites++;
+    if (!bStalled) {
+      fw_upload_DeadlineInit(&deadline, TX_TIMEOUT_MS, NULL);
+      bStalled = true;
+    }
+    if (fw_upload_DeadlineExpired(&deadline)) {
+      VND_LOGE("Write timeout, port blocked for %d ms", TX_TIMEOUT_MS);
+      return false;
+    }
+    blockStart = fw_upload_GetTimeNs();
+    iRet = transport->pfnWait(fd, POLLOUT, &deadline);
+    tx_stats.ulBlockedUs += (fw_upload_GetTimeNs() - blockStart) / 1000;
+    if ((iRet < 0) || (iRet & (POLLERR | POLLHUP | POLLNVAL))) {
+      VND_LOGE("Write wait error 0x%x", iRet);
+      return false;
+    }
+  }
+  return true;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComWriteChar
+ *
+ * Description:
+ *   Write a character to the port specified by fd.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *   iChar   : Character to be written
+ *
+ * Return Value:
+ *   Returns true, if write is Successful.
+ *   Returns false if write is a failure.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+bool fw_upload_ComWriteChar(int32 fd, uint8 iChar) {
+  return fw_upload_WriteV(fd, &iChar, 1, NULL, 0);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComWriteChars
+ *
+ * Description:
+ *   Write iLen characters to the port specified by fd.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *   pBuffer : Buffer where characters are available to be written to the Port.
+ *   iLen    : Number of Characters to write.
+ *
+ * Return Value:
+ *   Returns true, if write is Successful.
+ *   Returns false if write is a failure.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+bool fw_upload_ComWriteChars(int32 fd, const uint8* pBuffer, uint32 uiLen) {
+  return fw_upload_WriteV(fd, pBuffer, uiLen, NULL, 0);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_BuildFrame
+ *
+ * Description:
+ *   Assembles a bootloader response: the header byte, the payload and the
+ *   CRC8 over both.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pFrame       : Destination, at least FW_UPLOAD_MAX_FRAME_LEN bytes.
+ *   ucHeader     : Response code, e.g. 0x7A.
+ *   pPayload     : Payload following the header, may be NULL.
+ *   uiPayloadLen : Length of pPayload.
+ *
+ * Return Value:
+ *   Length of the frame.
+ *
+ * Notes:
+ *   Payloads that do not fit into FW_UPLOAD_MAX_FRAME_LEN are truncated.
+ *
+ *****************************************************************************/
+uint32 fw_upload_BuildFrame(uint8* pFrame, uint8 ucHeader,
+                            const uint8* pPayload, uint32 uiPayloadLen) {
+  if (uiPayloadLen > FW_UPLOAD_MAX_FRAME_LEN - 2) {
+    VND_LOGE("Frame payload %d too long", uiPayloadLen);
+    uiPayloadLen = FW_UPLOAD_MAX_FRAME_LEN - 2;
+  }
+  pFrame[0] = ucHeader;
+  if (uiPayloadLen != 0) {
+    memcpy(&pFrame[1], pPayload, uiPayloadLen);
+  }
+  pFrame[uiPayloadLen + 1] = fw_upload_crc8(pFrame, uiPayloadLen + 1);
+  return uiPayloadLen + 2;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComWriteFrame
+ *
+ * Description:
+ *   Sends a frame built by fw_upload_BuildFrame() and the data block that
+ *   follows it with a single writev() call.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd         : Port ID.
+ *   pFrame     : The frame.
+ *   uiFrameLen : Length of pFrame.
+ *   pData      : Data block sent right after the frame, may be NULL.
+ *   uiDataLen  : Length of pData.
+ *
+ * Return Value:
+ *   Returns true, if write is Successful.
+ *   Returns false if write is a failure.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+bool fw_upload_ComWriteFrame(int32 fd, const uint8* pFrame, uint32 uiFrameLen,
+                             const uint8* pData, uint32 uiDataLen) {
+  return fw_upload_WriteV(fd, pFrame, uiFrameLen, pData, uiDataLen);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComQueueChars
+ *
+ * Description:
+ *   Queues uiLen characters to be sent ahead of the next write on fd, so a
+ *   response and the data block answering the same request leave in one
+ *   system call.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd      : Port ID.
+ *   pBuffer : Characters to queue.
+ *   uiLen   : Number of characters.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The queue is sent before anything is read from or waited for on fd, so
+ *   the peer never waits for a queued response. Use
+ *   fw_upload_ComSendQueued() before handing the port to other code.
+ *
+ *****************************************************************************/
+void fw_upload_ComQueueChars(int32 fd, const uint8* pBuffer, uint32 uiLen) {
+  if ((tx_pending.fd != fd) ||
+      (tx_pending.uiLen + uiLen > sizeof(tx_pending.ucBuf))) {
+    fw_upload_ComSendQueued(tx_pending.fd);
+  }
+  if (uiLen > sizeof(tx_pending.ucBuf)) {
+    fw_upload_WriteV(fd, pBuffer, uiLen, NULL, 0);
+    return;
+  }
+  tx_pending.fd = fd;
+  memcpy(&tx_pending.ucBuf[tx_pending.uiLen], pBuffer, uiLen);
+  tx_pending.uiLen += uiLen;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComSendQueued
+ *
+ * Description:
+ *   Sends the characters queued on fd by fw_upload_ComQueueChars().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void fw_upload_ComSendQueued(int32 fd) {
+  if ((tx_pending.uiLen != 0) && (tx_pending.fd == fd)) {
+    fw_upload_WriteV(fd, NULL, 0, NULL, 0);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComGetCTS
+ *
+ * Description:
+ *   Check CTS status
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *
+ * Return Value:
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+int32 fw_upload_ComGetCTS(int32 fd) {
+  int32 status = transport->pfnModemLines(fd);
+  if ((status > 0) && (status & TIOCM_CTS)) {
+    return 0;
+  } else {
+    return 1;
+  }
+}
+/******************************************************************************
+ *
+ * Name: fw_upload_ComGetBufferSize
+ *
+ * Description:
+ *   Check buffer size
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd
+ *
+ * Return Value:
+ *   size in buffer
+ *
+ * Notes:
+ *   Includes the characters already pulled into the RX ring.
+ *
+ *****************************************************************************/
+uint32 fw_upload_GetBufferSize(int32 fd) {
+  int32 bytes;
+  rx_stats.ulIoctlCalls++;
+  bytes = transport->pfnBytesAvailable(fd);
+  return ((bytes > 0) ? (uint32)bytes : 0U) + fw_upload_RxCount(fd);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetTime
+ *
+ * Description:
+ *   Get the current time
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *
+ * Return Value:
+ *   return the current time in milliseconds
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+
+uint64 fw_upload_GetTime(void) {
+  struct timespec time;
+  clockid_t clk_id;
+  uint64 millisectime = -1;
+
+  clk_id = CLOCK_MONOTONIC;
+  if (!clock_gettime(clk_id, &time)) {
+    millisectime =
+        (((uint64)time.tv_sec) * 1000) + (((uint64)time.tv_nsec) / 1000000);
+  } else {
+    VND_LOGE("clock_gettime error:%s (%d)", strerror(errno), errno);
+  }
+  return millisectime;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetTimeNs
+ *
+ * Description:
+ *   Get the current time
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *
+ * Return Value:
+ *   return the current CLOCK_MONOTONIC time in nanoseconds
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+uint64 fw_upload_GetTimeNs(void) {
+  struct timespec time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &time)) {
+    VND_LOGE("clock_gettime error:%s (%d)", strerror(errno), errno);
+    return 0;
+  }
+  return (((uint64)time.tv_sec) * NSEC_PER_SEC) + (uint64)time.tv_nsec;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetCpuTimeNs
+ *
+ * Description:
+ *   Get the CPU time consumed by the calling thread
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *
+ * Return Value:
+ *   return the CLOCK_THREAD_CPUTIME_ID time in nanoseconds
+ *
+ * Notes:
+ *   Used to measure the cost of the send paths.
+ *
+ *****************************************************************************/
+uint64 fw_upload_GetCpuTimeNs(void) {
+  struct timespec time;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time)) {
+    return 0;
+  }
+  return (((uint64)time.tv_sec) * NSEC_PER_SEC) + (uint64)time.tv_nsec;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineInit
+ *
+ * Description:
+ *   Starts a deadline uiTimeoutMs from now. When pParent is given the
+ *   deadline never extends past it, which lets a per-step budget be
+ *   combined with the budget of a whole operation.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pDeadline   : Deadline to initialise.
+ *   uiTimeoutMs : Budget in milliseconds, FW_UPLOAD_WAIT_FOREVER for none.
+ *   pParent     : Enclosing deadline, may be NULL.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void fw_upload_DeadlineInit(fw_upload_deadline_t* pDeadline,
+                            uint32 uiTimeoutMs,
+                            const fw_upload_deadline_t* pParent) {
+  pDeadline->ullStartNs = fw_upload_GetTimeNs();
+  if (uiTimeoutMs == FW_UPLOAD_WAIT_FOREVER) {
+    pDeadline->ullExpiryNs = FW_UPLOAD_NO_DEADLINE;
+  } else {
+    pDeadline->ullExpiryNs =
+        pDeadline->ullStartNs + (uint64)uiTimeoutMs * NSEC_PER_MSEC;
+  }
+  if ((pParent != NULL) && (pParent->ullExpiryNs < pDeadline->ullExpiryNs)) {
+    pDeadline->ullExpiryNs = pParent->ullExpiryNs;
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineRemainingNs
+ *
+ * Description:
+ *   Returns the time left until the deadline expires.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pDeadline : The deadline.
+ *
+ * Return Value:
+ *   Nanoseconds left, 0 once expired, FW_UPLOAD_NO_DEADLINE if the deadline
+ *   never expires.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+uint64 fw_upload_DeadlineRemainingNs(const fw_upload_deadline_t* pDeadline) {
+  uint64 now;
+
+  if (pDeadline->ullExpiryNs == FW_UPLOAD_NO_DEADLINE) {
+    return FW_UPLOAD_NO_DEADLINE;
+  }
+  now = fw_upload_GetTimeNs();
+  return (now < pDeadline->ullExpiryNs) ? (pDeadline->ullExpiryNs - now) : 0;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineRemainingMs
+ *
+ * Description:
+ *   Returns the time left until the deadline expires, for interfaces that
+ *   take milliseconds.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pDeadline : The deadline.
+ *
+ * Return Value:
+ *   Milliseconds left rounded up, 0 once expired, FW_UPLOAD_WAIT_FOREVER if
+ *   the deadline never expires.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+uint32 fw_upload_DeadlineRemainingMs(const fw_upload_deadline_t* pDeadline) {
+  uint64 remaining = fw_upload_DeadlineRemainingNs(pDeadline);
+
+  if (remaining == FW_UPLOAD_NO_DEADLINE) {
+    return FW_UPLOAD_WAIT_FOREVER;
+  }
+  remaining = (remaining + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+  return (remaining >= FW_UPLOAD_WAIT_FOREVER) ? (FW_UPLOAD_WAIT_FOREVER - 1)
+                                               : (uint32)remaining;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineExpired
+ *
+ * Description:
+ *   Checks whether the deadline has passed.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pDeadline : The deadline.
+ *
+ * Return Value:
+ *   true if the deadline has expired.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+bool fw_upload_DeadlineExpired(const fw_upload_deadline_t* pDeadline) {
+  return fw_upload_DeadlineRemainingNs(pDeadline) == 0;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineElapsedMs
+ *
+ * Description:
+ *   Returns the time spent since the deadline was started.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pDeadline : The deadline.
+ *
+ * Return Value:
+ *   Elapsed time in milliseconds.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+uint64 fw_upload_DeadlineElapsedMs(const fw_upload_deadline_t* pDeadline) {
+  return (fw_upload_GetTimeNs() - pDeadline->ullStartNs) / NSEC_PER_MSEC;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_CtsPulseDone
+ *
+ * Description:
+ *   Checks whether CTS has gone high and then low again since the
+ *   fw_upload_cts_pulse_t was set up.
+ *
+ * Conditions For Use:
+ *   Called by fw_upload_ComGetCTS_after_fw_dwnl().
+ *
+ * Arguments:
+ *   fd   : Port ID.
+ *   pArg : the fw_upload_cts_pulse_t of the wait.
+ *
+ * Return Value:
+ *   true if CTS is low after having been high.
+ *
+ * Notes:
+ *   The counter is read ahead of the line, so a transition seen here
+ *   happened before the state sampled below. CTS cannot have moved without
+ *   being high at some point.
+ *
+ *****************************************************************************/
+static bool fw_upload_CtsPulseDone(int32 fd, void* pArg) {
+  fw_upload_cts_pulse_t* pPulse = (fw_upload_cts_pulse_t*)pArg;
+  uint32 ctsCount = 0;
+  int32 cts_status;
+
+  if (pPulse->bUseIcount && !pPulse->bHigh &&
+      (transport->pfnCtsTransitions(fd, &ctsCount) == 0) &&
+      (ctsCount != pPulse->uiStartCount)) {
+    pPulse->bHigh = true;
+  }
+  cts_status = fw_upload_ComGetCTS(fd);
+  if (!pPulse->bHigh) {
+    pPulse->bHigh = (cts_status == 1) ? true : false;
+  }
+  return !cts_status && pPulse->bHigh;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ComGetCTS_after_fw_dwnl
+ *
+ * Description:
+ *   Waits up to cts_timeout for the CTS line to go high and then low again
+ *   after FW download
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd          : Port ID.
+ *   cts_timeout : Deadline in milliseconds.
+ *   pCtsLowMs   : If not NULL, receives the time in milliseconds from the
+ *                 call until CTS went low.
+ *
+ * Return Value:
+ *   return true, if cts is low
+ *
+ * Notes:
+ *   The loader sleeps in TIOCMIWAIT where the transport can wait for its
+ *   modem lines. Otherwise, e.g. if the driver answers ENOTTY or EINVAL,
+ *   the line is sampled every MODEM_POLL_INTERVAL_MS. Where the transport
+ *   counts CTS transitions (TIOCGICOUNT) the counter is compared with its
+ *   value at the call as well, so that a high pulse between two looks at
+ *   the line is not missed.
+ *
+ *****************************************************************************/
+
+bool fw_upload_ComGetCTS_after_fw_dwnl(int32 fd, int32 cts_timeout,
+                                       uint64* pCtsLowMs) {
+  fw_upload_cts_pulse_t pulse;
+  fw_upload_deadline_t deadline;
+  uint32 uiRemainingMs;
+  bool bLow = false;
+  int32 iRet = -1;
+
+  memset(&pulse, 0, sizeof(pulse));
+  fw_upload_DeadlineInit(&deadline, (uint32)cts_timeout, NULL);
+  if ((transport->pfnCtsTransitions != NULL) &&
+      (transport->pfnCtsTransitions(fd, &pulse.uiStartCount) == 0)) {
+    pulse.bUseIcount = true;
+  }
+  if (transport->pfnWaitModemLines != NULL) {
+    iRet = transport->pfnWaitModemLines(fd, TIOCM_CTS, &deadline,
+                                        fw_upload_CtsPulseDone, &pulse);
+    if (iRet < 0) {
+      VND_LOGD("Cannot wait for CTS: %s (%d), sampling it every %d ms",
+               strerror(errno), errno, MODEM_POLL_INTERVAL_MS);
+    }
+  }
+  if (iRet >= 0) {
+    bLow = (iRet == 1);
+  } else {
+    if (!pulse.bUseIcount) {
+      VND_LOGD("No CTS transition counter, CTS is only sampled every %d ms",
+               MODEM_POLL_INTERVAL_MS);
+    }
+    while (!(bLow = fw_upload_CtsPulseDone(fd, &pulse)) &&
+           !fw_upload_DeadlineExpired(&deadline)) {
+      uiRemainingMs = fw_upload_DeadlineRemainingMs(&deadline);
+      fw_upload_DelayInMs((uiRemainingMs < MODEM_POLL_INTERVAL_MS)
+                              ? uiRemainingMs
+                              : MODEM_POLL_INTERVAL_MS);
+    }
+  }
+  if (bLow && (pCtsLowMs != NULL)) {
+    *pCtsLowMs = fw_upload_DeadlineElapsedMs(&deadline);
+  }
+  return bLow;
+}
+/******************************************************************************
+ *
+ * Name: fw_upload_WaitForBytes
+ *
+ * Description:
+ *   Blocks until at least uiCount bytes can be read from fd or until
+ *   uiTimeoutMs has elapsed.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd          : Port ID.
+ *   uiCount     : Number of bytes to wait for.
+ *   uiTimeoutMs : Deadline in milliseconds, relative to the call.
+ *
+ * Return Value:
+ *   true if uiCount bytes are available.
+ *   false on timeout or if the port cannot be waited on.
+ *
+ * Notes:
+ *   See fw_upload_WaitForBytesUntil.
+ *
+ *****************************************************************************/
+bool fw_upload_WaitForBytes(int32 fd, uint32 uiCount, uint32 uiTimeoutMs) {
+  fw_upload_deadline_t deadline;
+
+  if (fw_upload_RxCount(fd) >= uiCount) {
+    return true;
+  }
+  fw_upload_DeadlineInit(&deadline, uiTimeoutMs, NULL);
+  return fw_upload_WaitForBytesUntil(fd, uiCount, &deadline);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_WaitForBytesUntil
+ *
+ * Description:
+ *   Blocks until at least uiCount bytes can be read from fd or until
+ *   pDeadline expires. Received data is drained into the RX ring and the
+ *   caller sleeps in the wait of the transport until more is reported,
+ *   instead of sampling FIONREAD on a fixed interval.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd        : Port ID.
+ *   uiCount   : Number of bytes to wait for.
+ *   pDeadline : When to give up.
+ *
+ * Return Value:
+ *   true if uiCount bytes are available.
+ *   false on timeout or if the port cannot be waited on.
+ *
+ * Notes:
+ *   uiCount must not exceed the size of the RX ring.
+ *
+ *****************************************************************************/
+bool fw_upload_WaitForBytesUntil(int32 fd, uint32 uiCount,
+                                 const fw_upload_deadline_t* pDeadline) {
+  int32 iEvents;
+
+  if (fw_upload_RxCount(fd) >= uiCount) {
+    return true;
+  }
+  do {
+    if (fw_upload_DeadlineExpired(pDeadline)) {
+      // Last look at the port in case the data raced the deadline
+      return fw_upload_RxFill(fd) >= uiCount;
+    }
+    rx_stats.ulPollCalls++;
+    iEvents = transport->pfnWait(fd, POLLIN, pDeadline);
+    if ((iEvents < 0) || (iEvents & (POLLERR | POLLHUP | POLLNVAL))) {
+      VND_LOGE("poll error: revents 0x%x", iEvents);
+      return false;
+    }
+  } while (((iEvents & POLLIN) == 0) || (fw_upload_RxFill(fd) < uiCount));
+  return true;
+}
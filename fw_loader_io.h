@@ -29,35 +29,272 @@
 /*============================== Include Files ===============================*/
 
 #include <fcntl.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "bt_vendor_nxp.h"
 /*================================== Macros ==================================*/
+/* Largest frame fw_upload_BuildFrame() assembles, header and CRC included */
+#define FW_UPLOAD_MAX_FRAME_LEN 16
+/* V1 block header command sent without data, see fw_upload_GetBlockDataLen */
+#define FW_BLOCK_CMD_CHANGE_TIMEOUT 0x7U
+/* Timeout value meaning no timeout at all */
+#define FW_UPLOAD_WAIT_FOREVER 0xFFFFFFFFU
+/* Expiry of a deadline that never expires */
+#define FW_UPLOAD_NO_DEADLINE 0xFFFFFFFFFFFFFFFFULL
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ULL
+#endif
+#ifndef NSEC_PER_MSEC
+#define NSEC_PER_MSEC 1000000ULL
+#endif
+/* fw_upload_ComProbeHci() result when running firmware answered */
+#define FW_UPLOAD_PROBE_HCI_EVENT (-2)
+/* Buckets of a fw_upload_hist_t. Bucket 0 counts zero samples, bucket i
+ * samples in [2^(i-1), 2^i) and the last one everything above. */
+#define FW_UPLOAD_HIST_BUCKETS 20
 
 /*================================== Typedefs=================================*/
+/* Point in CLOCK_MONOTONIC time after which a wait gives up, see
+ * fw_upload_DeadlineInit() */
+typedef struct {
+  uint64 ullStartNs;   /* when the budget started */
+  uint64 ullExpiryNs;  /* absolute expiry, FW_UPLOAD_NO_DEADLINE if none */
+} fw_upload_deadline_t;
+
+/* Compressed firmware container, see fw_upload_LzOpen() */
+typedef struct fw_upload_lz fw_upload_lz_t;
+
+/* Firmware image the loaders send from, see fw_upload_ImageOpen() */
+typedef struct {
+  const uint8* pData;     /* image contents, NULL if compressed */
+  uint32 uiSize;          /* image size in bytes, decompressed */
+  const uint8* pFileData; /* file contents */
+  uint32 uiFileSize;      /* file size in bytes */
+  bool bMapped;           /* pFileData maps the file, otherwise a heap copy */
+  bool bBundled;          /* pFileData belongs to a fw_upload_bundle_t */
+  fw_upload_lz_t* pLz;    /* decoder of a compressed image, otherwise NULL */
+  uint64 ullDev;          /* device, inode, mtime of the file and position */
+  uint64 ullIno;          /* in it identify the image for */
+  uint64 ullMtimeNs;      /* fw_upload_ImageIndex() */
+  uint32 ulFileOffset;
+} fw_upload_image_t;
+
+/* Images for several chips in one file, see fw_upload_BundleOpen() */
+typedef struct {
+  const uint8* pData;  /* bundle file as mapped, NULL if none is open */
+  uint32 uiSize;       /* file size in bytes */
+  uint32 uiEntries;    /* images in the bundle */
+  uint64 ullDev;
+  uint64 ullIno;
+  uint64 ullMtimeNs;
+} fw_upload_bundle_t;
+
+/* Block of a V1 firmware image, see fw_upload_ImageIndex() */
+typedef struct {
+  uint32 ulOffset;   /* image position of the block header */
+  uint16 uiHdrLen;   /* header bytes */
+  uint16 uiDataLen;  /* data bytes sent after the header */
+  uint32 ulCmd;      /* bootloader command of the header */
+} fw_upload_block_t;
+
+/* Checks the modem lines for fw_upload_transport_t.pfnWaitModemLines,
+ * returns true once they are where the caller waits for them */
+typedef bool (*fw_upload_modem_check_cb_t)(int32 fd, void* pCbCtx);
+
+/* Byte transport under the loader I/O functions, see fw_upload_SetTransport().
+ * Every function gets the port handle the loaders pass around as fd. */
+typedef struct {
+  const char* pName;
+  /* Non-blocking read, returns the bytes read, 0 if none, -1 on error */
+  int32 (*pfnRead)(int32 fd, uint8* pBuf, uint32 uiLen);
+  /* Non-blocking gather write, returns the bytes accepted, -1 on error */
+  int32 (*pfnWritev)(int32 fd, const struct iovec* pIov, int32 iCount);
+  /* Sleeps until fd is ready for iEvents (POLLIN or POLLOUT) or pDeadline
+   * expires, returns the ready events, 0 on timeout, -1 on error */
+  int32 (*pfnWait)(int32 fd, int16 iEvents,
+                   const fw_upload_deadline_t* pDeadline);
+  /* Bytes that can be read without blocking, -1 on error */
+  int32 (*pfnBytesAvailable)(int32 fd);
+  /* TIOCM_* state of the modem lines, -1 on error */
+  int32 (*pfnModemLines)(int32 fd);
+  /* Number of CTS transitions seen on the port like the cts counter of
+   * TIOCGICOUNT, returns 0 or -1 if the port does not count them */
+  int32 (*pfnCtsTransitions)(int32 fd, uint32* puiCount);
+  /* Sleeps until pfnDone returns true, calling it again whenever one of
+   * the iMask modem lines changes, or until pDeadline expires. Returns 1,
+   * 0 on timeout, -1 with errno set if the port cannot wait for its lines.
+   * NULL if it cannot at all, the lines are then sampled. */
+  int32 (*pfnWaitModemLines)(int32 fd, int32 iMask,
+                             const fw_upload_deadline_t* pDeadline,
+                             fw_upload_modem_check_cb_t pfnDone,
+                             void* pCbCtx);
+  /* Switches the port to uiBaud, returns the handle to use from now on or
+   * -1 on error */
+  int32 (*pfnSetBaud)(int32 fd, int8* pPortName, uint32 uiBaud,
+                      uint8 ucFlowCtrl);
+  /* Discards queued data like tcflush() */
+  int32 (*pfnFlush)(int32 fd, int32 iQueue);
+  /* Waits until written data has left the port like tcdrain() */
+  int32 (*pfnDrain)(int32 fd);
+} fw_upload_transport_t;
+
+/* Called with everything the loader writes to a port of the loopback
+ * transport, and with uiLen 0 whenever the loader waits for data that is
+ * not there yet. Answers are delivered with fw_upload_LoopbackPush(). */
+typedef void (*fw_upload_loopback_peer_t)(void* pCtx, const uint8* pData,
+                                          uint32 uiLen);
+
+/* Receive path counters, see fw_upload_GetRxStats() */
+typedef struct {
+  uint64 ulReadCalls;   /* read() calls issued on the port */
+  uint64 ulIoctlCalls;  /* FIONREAD queries */
+  uint64 ulPollCalls;   /* poll() calls while waiting for data */
+  uint64 ulBytesRead;   /* bytes pulled from the port */
+} fw_upload_rx_stats_t;
+
+/* Transmit path counters, see fw_upload_GetTxStats() */
+typedef struct {
+  uint64 ulWriteCalls;    /* write()/writev() calls issued on the port */
+  uint64 ulBytesWritten;  /* bytes accepted by the port */
+  uint64 ulShortWrites;   /* writes that left data behind (full TX buffer) */
+  uint64 ulBlockedUs;     /* time spent waiting for the TX buffer to drain */
+} fw_upload_tx_stats_t;
+
+/* Power of two histogram, see fw_upload_HistAdd() */
+typedef struct {
+  uint32 uiCount;                          /* samples */
+  uint32 uiMin;                            /* smallest sample */
+  uint32 uiMax;                            /* largest sample */
+  uint64 ullTotal;                         /* sum of all samples */
+  uint32 uiBucket[FW_UPLOAD_HIST_BUCKETS]; /* samples per bucket */
+} fw_upload_hist_t;
+
+/* V3 data request counters, see bt_vnd_mrvl_get_download_stats() */
+typedef struct {
+  uint32 uiRequests;          /* 0xA7 requests answered */
+  uint32 uiBlocks;            /* data blocks sent, retransmits included */
+  uint32 uiRetransmits;       /* blocks sent again for the same offset */
+  uint32 uiErrRequests;       /* requests reporting an error */
+  uint32 uiCrcErrors;         /* requests dropped for a bad CRC */
+  uint32 uiErrBitCnt[16];     /* requests with each error bit set */
+  uint64 ullBytes;            /* data bytes sent */
+  fw_upload_hist_t reqToAck;  /* us from request received to ack issued */
+  fw_upload_hist_t ackToData; /* us from ack issued to block written */
+  fw_upload_hist_t blockLen;  /* bytes per data block */
+} fw_upload_block_stats_t;
 
 /*================================ Global Vars================================*/
+extern const fw_upload_transport_t fw_upload_uart_transport;
+extern const fw_upload_transport_t fw_upload_pty_transport;
+extern const fw_upload_transport_t fw_upload_loopback_transport;
 
 /*============================ Function Prototypes ===========================*/
 
+extern uint8 fw_upload_crc8(const uint8* pArray, uint32 uiLen);
+extern uint32 fw_upload_crc32(uint32 uiCrc, const uint8* pData, uint32 uiLen);
+extern uint32 fw_upload_ImageVerify(const fw_upload_image_t* pImage,
+                                    bool bBlockFormat);
+extern const fw_upload_block_t* fw_upload_ImageIndex(
+    const fw_upload_image_t* pImage, uint32* puiBlocks, uint32* pulResult);
+extern void fw_upload_ImageIndexRelease(const fw_upload_block_t* pBlocks);
+#ifdef TEST_CODE
+extern void fw_upload_CrcBenchmark(const uint8* pData, uint32 uiLen);
+extern void fw_upload_DeadlineBenchmark(void);
+#endif
 extern bool fw_upload_lenValid(uint16* uiLenToSend, uint8* ucArray);
-extern uint16 fw_upload_GetDataLen(uint8* buf);
+extern uint16 fw_upload_GetDataLen(const uint8* buf);
+extern uint16 fw_upload_GetBlockDataLen(const uint8* buf, uint32* pulCmd);
 extern uint8 fw_upload_ComReadChar(int32 mchar_fd);
-extern void fw_upload_ComWriteChar(int32 mchar_fd, uint8 iChar);
-extern void fw_upload_ComWriteChars(int32 mchar_fd, uint8* pChBuffer,
+extern bool fw_upload_ComWriteChar(int32 mchar_fd, uint8 iChar);
+extern bool fw_upload_ComWriteChars(int32 mchar_fd, const uint8* pChBuffer,
                                     uint32 uiLen);
 extern void fw_upload_ComReadChars(int32 mchar_fd, uint8* pChBuffer,
                                    uint32 uiCount);
+extern uint32 fw_upload_BuildFrame(uint8* pFrame, uint8 ucHeader,
+                                   const uint8* pPayload, uint32 uiPayloadLen);
+extern bool fw_upload_ComWriteFrame(int32 mchar_fd, const uint8* pFrame,
+                                    uint32 uiFrameLen, const uint8* pData,
+                                    uint32 uiDataLen);
+extern void fw_upload_ComQueueChars(int32 mchar_fd, const uint8* pChBuffer,
+                                    uint32 uiLen);
+extern void fw_upload_ComSendQueued(int32 mchar_fd);
 extern void fw_upload_DelayInMs(uint32 uiMs);
 extern int32 fw_upload_ComGetCTS(int32 mchar_fd);
 extern uint64 fw_upload_GetTime(void);
 extern bool fw_upload_ComGetCTS_after_fw_dwnl(int32 mchar_fd,
-                                              int32 cts_timeout);
+                                              int32 cts_timeout,
+                                              uint64* pCtsLowMs);
 extern uint32 fw_upload_GetBufferSize(int32 mchar_fd);
+extern bool fw_upload_WaitForBytes(int32 mchar_fd, uint32 uiCount,
+                                   uint32 uiTimeoutMs);
+extern bool fw_upload_WaitForBytesUntil(int32 mchar_fd, uint32 uiCount,
+                                        const fw_upload_deadline_t* pDeadline);
+extern uint64 fw_upload_GetTimeNs(void);
+extern uint64 fw_upload_GetCpuTimeNs(void);
+extern void fw_upload_DeadlineInit(fw_upload_deadline_t* pDeadline,
+                                   uint32 uiTimeoutMs,
+                                   const fw_upload_deadline_t* pParent);
+extern uint64 fw_upload_DeadlineRemainingNs(
+    const fw_upload_deadline_t* pDeadline);
+extern uint32 fw_upload_DeadlineRemainingMs(
+    const fw_upload_deadline_t* pDeadline);
+extern bool fw_upload_DeadlineExpired(const fw_upload_deadline_t* pDeadline);
+extern uint64 fw_upload_DeadlineElapsedMs(
+    const fw_upload_deadline_t* pDeadline);
+extern uint32 fw_upload_ComPeekChars(int32 mchar_fd, uint8* pChBuffer,
+                                     uint32 uiCount);
+extern void fw_upload_ComSkipChars(int32 mchar_fd, uint32 uiCount);
+extern int32 fw_upload_ComReadSignature(int32 mchar_fd,
+                                        const uint8* pSignatures,
+                                        uint32 uiSigCount);
+extern int32 fw_upload_ComProbeHci(int32 mchar_fd, uint16 uiOpcode,
+                                   const uint8* pSignatures,
+                                   uint32 uiSigCount,
+                                   const fw_upload_deadline_t* pDeadline);
+extern int32 fw_upload_ComFlush(int32 mchar_fd, int32 iQueue);
+extern int32 fw_upload_ComDrain(int32 mchar_fd);
+extern void fw_upload_GetRxStats(fw_upload_rx_stats_t* pStats);
+extern void fw_upload_ResetRxStats(void);
+extern void fw_upload_GetTxStats(fw_upload_tx_stats_t* pStats);
+extern void fw_upload_ResetTxStats(void);
+extern void fw_upload_HistAdd(fw_upload_hist_t* pHist, uint32 uiValue);
+extern void fw_upload_HistLog(const char* pName, const char* pUnit,
+                              const fw_upload_hist_t* pHist);
+extern uint32 fw_upload_ImageOpen(fw_upload_image_t* pImage, FILE* pFile);
+extern void fw_upload_ImageClose(fw_upload_image_t* pImage);
+extern const uint8* fw_upload_ImageRead(const fw_upload_image_t* pImage,
+                                        uint32 ulPos, uint32 uiLen,
+                                        uint8* pScratch);
+extern uint32 fw_upload_ImageCopy(const fw_upload_image_t* pImage,
+                                  uint32 ulPos, uint32 uiLen, uint8* pDst);
+extern uint32 fw_upload_BundleOpen(fw_upload_bundle_t* pBundle, FILE* pFile);
+extern int32 fw_upload_BundleFind(const fw_upload_bundle_t* pBundle,
+                                  uint16 uiChipId);
+extern uint32 fw_upload_BundleImage(const fw_upload_bundle_t* pBundle,
+                                    uint32 uiEntry, fw_upload_image_t* pImage);
+extern void fw_upload_BundleClose(fw_upload_bundle_t* pBundle);
+extern uint32 fw_upload_LzOpen(const uint8* pFile, uint32 uiFileSize,
+                               fw_upload_lz_t** ppLz, uint32* puiSize);
+extern const uint8* fw_upload_LzRead(fw_upload_lz_t* pLz, uint32 ulPos,
+                                     uint32 uiLen, uint8* pScratch);
+extern void fw_upload_LzClose(fw_upload_lz_t* pLz);
+extern void fw_upload_SetTransport(const fw_upload_transport_t* pTransport);
+extern const fw_upload_transport_t* fw_upload_GetTransport(void);
+extern int32 fw_upload_ComSetBaud(int32 mchar_fd, int8* pPortName,
+                                  uint32 uiBaud, uint8 ucFlowCtrl);
+extern void fw_upload_TransportSetModemLines(int32 fd, int32 iStatus);
+extern bool fw_upload_LoopbackAttach(int32 fd,
+                                     fw_upload_loopback_peer_t pfnPeer,
+                                     void* pCtx);
+extern void fw_upload_LoopbackDetach(int32 fd);
+extern uint32 fw_upload_LoopbackPush(int32 fd, const uint8* pData,
+                                     uint32 uiLen);
 #endif  // FW_LOADER_IO_LINUX_H
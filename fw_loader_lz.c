@@ -0,0 +1,497 @@
+/******************************************************************************
+ *
+ *  Copyright 2023 NXP
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:      fw_loader_lz.c
+ *
+ *  Description:   Compressed firmware container, decoded chunk by chunk
+ *                 while the image is sent
+ *
+ ******************************************************************************/
+
+#define LOG_TAG "fw_loader_linux"
+
+/*============================== Include Files ===============================*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "bt_vendor_log.h"
+#include "fw_loader_io.h"
+/*================================== Macros ==================================*/
+/* Container header, all fields little endian:
+ *   0  magic "NXLZ"
+ *   4  format version, FW_LZ_VERSION
+ *   8  size of the decompressed image
+ *   12 chunk size, every chunk but the last decompresses to this size
+ *   16 number of chunks
+ * followed by one table entry per chunk:
+ *   0  file offset of the chunk
+ *   4  stored length, equal to the decompressed length for a stored chunk
+ *   8  CRC32 of the decompressed chunk, see fw_upload_crc32()
+ * Compressed chunks are LZ4 blocks. */
+#define FW_LZ_MAGIC "NXLZ"
+#define FW_LZ_VERSION 1U
+#define FW_LZ_HDR_LEN 20U
+#define FW_LZ_ENTRY_LEN 12U
+/* Largest chunk accepted, bounds the memory of the chunk cache */
+#define FW_LZ_MAX_CHUNK (64U * 1024U)
+/* Decompressed chunks kept, a retransmitted block is sent from here */
+#define FW_LZ_CACHE_SLOTS 4U
+#define FW_LZ_NO_CHUNK 0xFFFFFFFFU
+/* LZ4 sequences: literal and match length nibbles of the token, the match
+ * length is stored less the minimum match */
+#define FW_LZ_RUN_MASK 0xFU
+#define FW_LZ_MIN_MATCH 4U
+
+/*================================== Typedefs=================================*/
+/* Decompressed chunk of the cache */
+typedef struct {
+  uint32 uiChunk;  /* chunk held, FW_LZ_NO_CHUNK if none */
+  uint64 ullUsed;  /* fw_upload_lz_t.ullTick of the last use */
+  uint8* pBuf;     /* chunk size bytes, allocated on first use */
+} fw_upload_lz_slot_t;
+
+struct fw_upload_lz {
+  const uint8* pFile;  /* container as mapped or read */
+  uint32 uiSize;       /* decompressed image size */
+  uint32 uiChunkSize;
+  uint32 uiChunks;
+  uint8* pChecked;     /* per chunk, the CRC32 of the chunk was checked */
+  fw_upload_lz_slot_t slot[FW_LZ_CACHE_SLOTS];
+  uint64 ullTick;
+  uint32 uiDecodes;    /* chunks decompressed */
+  uint32 uiHits;       /* chunk lookups answered by the cache */
+  uint64 ullDecodeNs;  /* time spent decompressing */
+};
+
+/*============================== Coded Procedures ============================*/
+/******************************************************************************
+ *
+ * Name: fw_upload_LzGet32
+ *
+ * Description:
+ *   Reads a little endian 32 bit field of the container.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pBuf: the field.
+ *
+ * Return Value:
+ *   The field value.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_LzGet32(const uint8* pBuf) {
+  return pBuf[0] | ((uint32)pBuf[1] << 8) | ((uint32)pBuf[2] << 16) |
+         ((uint32)pBuf[3] << 24);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LzDecode
+ *
+ * Description:
+ *   Decompresses an LZ4 block.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pSrc:      the block.
+ *   uiSrcLen:  block length.
+ *   pDst:      receives the decompressed data.
+ *   uiDstLen:  expected decompressed length.
+ *
+ * Return Value:
+ *   true if the block decompresses to exactly uiDstLen bytes.
+ *
+ * Notes:
+ *   Every length and match offset is checked against both buffers, a
+ *   corrupt block fails instead of reading or writing out of bounds.
+ *
+ *****************************************************************************/
+static bool fw_upload_LzDecode(const uint8* pSrc, uint32 uiSrcLen, uint8* pDst,
+                               uint32 uiDstLen) {
+  const uint8* ip = pSrc;
+  const uint8* iend = pSrc + uiSrcLen;
+  uint8* op = pDst;
+  uint8* oend = pDst + uiDstLen;
+  const uint8* pMatch;
+  uint32 uiToken;
+  uint32 uiLen;
+  uint32 uiOffset;
+  uint8 ucByte;
+
+  while (ip < iend) {
+    uiToken = *ip++;
+    uiLen = uiToken >> 4;
+    if (uiLen == FW_LZ_RUN_MASK) {
+      do {
+        if (ip >= iend) {
+          return false;
+        }
+        ucByte = *ip++;
+        uiLen += ucByte;
+      } while ((ucByte == 0xFF) && (uiLen < uiDstLen));
+    }
+    if ((uiLen > (uint32)(iend - ip)) || (uiLen > (uint32)(oend - op))) {
+      return false;
+    }
+    memcpy(op, ip, uiLen);
+    ip += uiLen;
+    op += uiLen;
+    // The last sequence has literals only
+    if (ip == iend) {
+      break;
+    }
+
+    if ((uint32)(iend - ip) < 2) {
+      return false;
+    }
+    uiOffset = ip[0] | ((uint32)ip[1] << 8);
+    ip += 2;
+    if ((uiOffset == 0) || (uiOffset > (uint32)(op - pDst))) {
+      return false;
+    }
+    uiLen = uiToken & FW_LZ_RUN_MASK;
+    if (uiLen == FW_LZ_RUN_MASK) {
+      do {
+        if (ip >= iend) {
+          return false;
+        }
+        ucByte = *ip++;
+        uiLen += ucByte;
+      } while ((ucByte == 0xFF) && (uiLen < uiDstLen));
+    }
+    uiLen += FW_LZ_MIN_MATCH;
+    if (uiLen > (uint32)(oend - op)) {
+      return false;
+    }
+    pMatch = op - uiOffset;
+    if (uiOffset >= uiLen) {
+      memcpy(op, pMatch, uiLen);
+      op += uiLen;
+    } else {
+      // Overlapping match repeats the last uiOffset bytes
+      while (uiLen-- != 0) {
+        *op++ = *pMatch++;
+      }
+    }
+  }
+  return op == oend;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LzChunkLen
+ *
+ * Description:
+ *   Decompressed length of a chunk.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pLz:     the container.
+ *   uiChunk: chunk number.
+ *
+ * Return Value:
+ *   Chunk size, less for the last chunk.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_LzChunkLen(const fw_upload_lz_t* pLz, uint32 uiChunk) {
+  uint32 ulPos = uiChunk * pLz->uiChunkSize;
+
+  return (pLz->uiSize - ulPos < pLz->uiChunkSize) ? (pLz->uiSize - ulPos)
+                                                   : pLz->uiChunkSize;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LzChunk
+ *
+ * Description:
+ *   Returns a chunk decompressed, from the cache if it is there.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pLz:     the container.
+ *   uiChunk: chunk number, less than the number of chunks.
+ *
+ * Return Value:
+ *   The decompressed chunk, NULL if it is corrupt or there is no memory.
+ *
+ * Notes:
+ *   Stored chunks are returned from the container itself. Otherwise the
+ *   least recently used slot is decompressed into, which invalidates what
+ *   was returned for the chunk held before. The CRC32 of a chunk is checked
+ *   the first time it is decompressed.
+ *
+ *****************************************************************************/
+static const uint8* fw_upload_LzChunk(fw_upload_lz_t* pLz, uint32 uiChunk) {
+  const uint8* pEntry = pLz->pFile + FW_LZ_HDR_LEN + uiChunk * FW_LZ_ENTRY_LEN;
+  const uint8* pSrc = pLz->pFile + fw_upload_LzGet32(pEntry);
+  uint32 uiSrcLen = fw_upload_LzGet32(pEntry + 4);
+  uint32 uiLen = fw_upload_LzChunkLen(pLz, uiChunk);
+  fw_upload_lz_slot_t* pSlot = &pLz->slot[0];
+  const uint8* pChunk;
+  uint64 start;
+  uint32 i;
+
+  pLz->ullTick++;
+  if (uiSrcLen == uiLen) {
+    pChunk = pSrc;
+  } else {
+    for (i = 0; i < FW_LZ_CACHE_SLOTS; i++) {
+      if (pLz->slot[i].uiChunk == uiChunk) {
+        pLz->slot[i].ullUsed = pLz->ullTick;
+        pLz->uiHits++;
+        return pLz->slot[i].pBuf;
+      }
+      if (pLz->slot[i].ullUsed < pSlot->ullUsed) {
+        pSlot = &pLz->slot[i];
+      }
+    }
+    if (pSlot->pBuf == NULL) {
+      pSlot->pBuf = (uint8*)malloc(pLz->uiChunkSize);
+      if (pSlot->pBuf == NULL) {
+        VND_LOGE("No memory to decompress chunk %u", uiChunk);
+        return NULL;
+      }
+    }
+    start = fw_upload_GetTimeNs();
+    pSlot->uiChunk = FW_LZ_NO_CHUNK;
+    pSlot->ullUsed = 0;
+    if (!fw_upload_LzDecode(pSrc, uiSrcLen, pSlot->pBuf, uiLen)) {
+      VND_LOGE("Chunk %u does not decompress", uiChunk);
+      return NULL;
+    }
+    pLz->ullDecodeNs += fw_upload_GetTimeNs() - start;
+    pLz->uiDecodes++;
+    pChunk = pSlot->pBuf;
+  }
+
+  if (!pLz->pChecked[uiChunk]) {
+    if (fw_upload_crc32(0, pChunk, uiLen) != fw_upload_LzGet32(pEntry + 8)) {
+      VND_LOGE("Chunk %u CRC mismatch", uiChunk);
+      return NULL;
+    }
+    pLz->pChecked[uiChunk] = 1;
+  }
+  if (pChunk != pSrc) {
+    pSlot->uiChunk = uiChunk;
+    pSlot->ullUsed = pLz->ullTick;
+  }
+  return pChunk;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LzOpen
+ *
+ * Description:
+ *   Recognizes a compressed firmware container and checks its chunk table.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pFile:      file contents, must stay valid until fw_upload_LzClose().
+ *   uiFileSize: file size.
+ *   ppLz:       receives the container, NULL if the file is not one.
+ *   puiSize:    receives the decompressed image size.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS, IMAGE_MALFORMED or MALLOC_RETURNED_NULL.
+ *
+ * Notes:
+ *   Nothing is decompressed here, chunks are decompressed when read.
+ *
+ *****************************************************************************/
+uint32 fw_upload_LzOpen(const uint8* pFile, uint32 uiFileSize,
+                        fw_upload_lz_t** ppLz, uint32* puiSize) {
+  fw_upload_lz_t* pLz;
+  const uint8* pEntry;
+  uint32 uiSize;
+  uint32 uiChunkSize;
+  uint32 uiChunks;
+  uint32 uiLen;
+  uint32 i;
+
+  *ppLz = NULL;
+  if ((uiFileSize < FW_LZ_HDR_LEN) ||
+      (memcmp(pFile, FW_LZ_MAGIC, strlen(FW_LZ_MAGIC)) != 0)) {
+    return DOWNLOAD_SUCCESS;
+  }
+  if (fw_upload_LzGet32(pFile + 4) != FW_LZ_VERSION) {
+    VND_LOGE("Compressed image version %u not supported",
+             fw_upload_LzGet32(pFile + 4));
+    return IMAGE_MALFORMED;
+  }
+  uiSize = fw_upload_LzGet32(pFile + 8);
+  uiChunkSize = fw_upload_LzGet32(pFile + 12);
+  uiChunks = fw_upload_LzGet32(pFile + 16);
+  if ((uiSize == 0) || (uiChunkSize == 0) || (uiChunkSize > FW_LZ_MAX_CHUNK) ||
+      (uiChunks != (uiSize - 1) / uiChunkSize + 1) ||
+      ((uint64)uiChunks * FW_LZ_ENTRY_LEN > uiFileSize - FW_LZ_HDR_LEN)) {
+    VND_LOGE("Compressed image header is corrupt");
+    return IMAGE_MALFORMED;
+  }
+  for (i = 0; i < uiChunks; i++) {
+    pEntry = pFile + FW_LZ_HDR_LEN + i * FW_LZ_ENTRY_LEN;
+    uiLen = uiSize - i * uiChunkSize;
+    if (uiLen > uiChunkSize) {
+      uiLen = uiChunkSize;
+    }
+    if ((fw_upload_LzGet32(pEntry + 4) > uiLen) ||
+        ((uint64)fw_upload_LzGet32(pEntry) + fw_upload_LzGet32(pEntry + 4) >
+         uiFileSize)) {
+      VND_LOGE("Compressed image chunk %u is out of bounds", i);
+      return IMAGE_MALFORMED;
+    }
+  }
+
+  pLz = (fw_upload_lz_t*)calloc(1, sizeof(fw_upload_lz_t));
+  if (pLz != NULL) {
+    pLz->pChecked = (uint8*)calloc(uiChunks, 1);
+  }
+  if ((pLz == NULL) || (pLz->pChecked == NULL)) {
+    VND_LOGE("malloc() returned NULL while allocating the chunk table");
+    free(pLz);
+    return MALLOC_RETURNED_NULL;
+  }
+  pLz->pFile = pFile;
+  pLz->uiSize = uiSize;
+  pLz->uiChunkSize = uiChunkSize;
+  pLz->uiChunks = uiChunks;
+  for (i = 0; i < FW_LZ_CACHE_SLOTS; i++) {
+    pLz->slot[i].uiChunk = FW_LZ_NO_CHUNK;
+  }
+  VND_LOGD("Compressed image: %u bytes in %u chunks of %u", uiSize, uiChunks,
+           uiChunkSize);
+  *ppLz = pLz;
+  *puiSize = uiSize;
+  return DOWNLOAD_SUCCESS;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LzRead
+ *
+ * Description:
+ *   Returns uiLen bytes of the decompressed image at ulPos.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pLz:      the container.
+ *   ulPos:    image position.
+ *   uiLen:    bytes wanted.
+ *   pScratch: at least uiLen bytes, used when the bytes span chunks.
+ *
+ * Return Value:
+ *   The bytes, NULL if they are not all in the image or a chunk is corrupt.
+ *
+ * Notes:
+ *   The bytes stay valid until the next read.
+ *
+ *****************************************************************************/
+const uint8* fw_upload_LzRead(fw_upload_lz_t* pLz, uint32 ulPos, uint32 uiLen,
+                              uint8* pScratch) {
+  uint32 uiChunk = ulPos / pLz->uiChunkSize;
+  uint32 uiOffset = ulPos % pLz->uiChunkSize;
+  uint32 uiCopied = 0;
+  uint32 uiPart;
+  const uint8* pChunk;
+
+  if ((ulPos > pLz->uiSize) || (uiLen > pLz->uiSize - ulPos)) {
+    return NULL;
+  }
+  if (uiLen == 0) {
+    return pScratch;
+  }
+  pChunk = fw_upload_LzChunk(pLz, uiChunk);
+  if (pChunk == NULL) {
+    return NULL;
+  }
+  if (uiOffset + uiLen <= fw_upload_LzChunkLen(pLz, uiChunk)) {
+    return pChunk + uiOffset;
+  }
+  while (uiCopied < uiLen) {
+    uiPart = fw_upload_LzChunkLen(pLz, uiChunk) - uiOffset;
+    if (uiPart > uiLen - uiCopied) {
+      uiPart = uiLen - uiCopied;
+    }
+    memcpy(pScratch + uiCopied, pChunk + uiOffset, uiPart);
+    uiCopied += uiPart;
+    uiOffset = 0;
+    if (uiCopied < uiLen) {
+      pChunk = fw_upload_LzChunk(pLz, ++uiChunk);
+      if (pChunk == NULL) {
+        return NULL;
+      }
+    }
+  }
+  return pScratch;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LzClose
+ *
+ * Description:
+ *   Releases a container opened with fw_upload_LzOpen().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pLz: the container, may be NULL.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The decompression work is logged.
+ *
+ *****************************************************************************/
+void fw_upload_LzClose(fw_upload_lz_t* pLz) {
+  uint32 i;
+
+  if (pLz == NULL) {
+    return;
+  }
+  VND_LOGD("Compressed image: %u chunk decodes in %llu us, %u cache hits",
+           pLz->uiDecodes, pLz->ullDecodeNs / 1000, pLz->uiHits);
+  for (i = 0; i < FW_LZ_CACHE_SLOTS; i++) {
+    free(pLz->slot[i].pBuf);
+  }
+  free(pLz->pChecked);
+  free(pLz);
+}
@@ -0,0 +1,1465 @@
+/******************************************************************************
+ *
+ *  Copyright 2009-2023 NXP
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:      fw_loader_transport.c
+ *
+ *  Description:   Byte transports used by the firmware loader: the UART,
+ *                 a pseudo terminal and an in-memory loopback
+ *
+ ******************************************************************************/
+
+#define LOG_TAG "fw_loader_linux"
+
+/*============================== Include Files ===============================*/
+#include <errno.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef FW_LOADER_TIMERFD
+#include <sys/timerfd.h>
+#endif
+
+#include "bt_vendor_log.h"
+#include "fw_loader_io.h"
+/*================================== Macros ==================================*/
+/* Size of the loopback receive buffer, must be a power of 2 */
+#define LOOPBACK_BUF_SIZE 4096
+#define LOOPBACK_BUF_MASK (LOOPBACK_BUF_SIZE - 1)
+/* Longest sleep of fw_upload_LoopbackWait() before the peer is called
+ * again, the clock of a simulated controller */
+#define LOOPBACK_TICK_MS 1
+/* Ports fw_upload_TransportSetModemLines() makes room for at first, the
+ * table grows as more are set */
+#define EMULATED_MODEM_PORTS 16
+/* Signal that breaks the TIOCMIWAIT of fw_upload_UartWaitModemLines() once
+ * the wait is over */
+#define MODEM_WAIT_SIGNAL SIGUSR2
+/* Longest time fw_upload_UartWaitModemLines() goes without checking the
+ * lines, bounds the cost of a change that slips in between two TIOCMIWAIT */
+#define MODEM_WAIT_CHECK_MS 50
+#ifdef TEST_CODE
+/* Waits of each timeout timed by fw_upload_DeadlineBenchmark */
+#define DEADLINE_BENCHMARK_ROUNDS 8
+#endif
+
+/*================================== Typedefs=================================*/
+/* Loopback of one port, bytes sent by the peer towards the loader */
+typedef struct fw_upload_loopback {
+  struct fw_upload_loopback* pNext;
+  int32 fd;
+  fw_upload_loopback_peer_t pfnPeer;
+  void* pCtx;
+  pthread_mutex_t lock;
+  pthread_cond_t pushed;  /* signalled by fw_upload_LoopbackPush() */
+  uint32 uiHead;          /* free running read index */
+  uint32 uiTail;          /* free running write index */
+  uint8 ucBuf[LOOPBACK_BUF_SIZE];
+} fw_upload_loopback_t;
+
+/* Modem lines of a port without any */
+typedef struct {
+  int32 fd;
+  int32 iStatus;
+  uint32 uiCtsCount;  /* CTS transitions, like the cts counter of TIOCGICOUNT */
+} fw_upload_emulated_lines_t;
+
+/* State shared with the thread blocked in TIOCMIWAIT */
+typedef struct {
+  int32 fd;
+  int32 iMask;
+  uint32 uiChanges;  /* line changes TIOCMIWAIT returned for */
+  int32 iErrno;      /* errno of the TIOCMIWAIT that failed, 0 if none */
+  bool bStop;        /* the wait is over, the thread is to exit */
+  bool bExited;      /* the thread no longer waits */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} fw_upload_modem_wait_t;
+
+/*================================ Variables =================================*/
+#ifdef FW_LOADER_TIMERFD
+/* timerfd armed with the deadline of fw_upload_UartWait, one per thread and
+ * closed by the destructor of deadline_timer_key when the thread exits */
+static __thread int32 deadline_timer_fd = -1;
+static pthread_key_t deadline_timer_key;
+static pthread_once_t deadline_timer_once = PTHREAD_ONCE_INIT;
+#endif
+/* Modem lines reported by the transports that have none */
+static pthread_mutex_t emulated_modem_lock = PTHREAD_MUTEX_INITIALIZER;
+static fw_upload_emulated_lines_t* emulated_modem_lines = NULL;
+static uint32 emulated_modem_ports = 0;
+static uint32 emulated_modem_room = 0;
+/* Loopbacks of the ports attached with fw_upload_LoopbackAttach() */
+static pthread_mutex_t loopback_lock = PTHREAD_MUTEX_INITIALIZER;
+static fw_upload_loopback_t* loopbacks = NULL;
+
+/*============================ Function Prototypes ===========================*/
+
+/*============================== Coded Procedures ============================*/
+
+#ifdef FW_LOADER_TIMERFD
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineTimerClose
+ *
+ * Description:
+ *   Closes the deadline timerfd of a thread that exits.
+ *
+ * Conditions For Use:
+ *   Destructor of deadline_timer_key.
+ *
+ * Arguments:
+ *   pValue : The timerfd plus one.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_DeadlineTimerClose(void* pValue) {
+  close((int32)((intptr_t)pValue - 1));
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineTimerKeyInit
+ *
+ * Description:
+ *   Creates deadline_timer_key.
+ *
+ * Conditions For Use:
+ *   Called once through deadline_timer_once.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_DeadlineTimerKeyInit(void) {
+  pthread_key_create(&deadline_timer_key, fw_upload_DeadlineTimerClose);
+}
+#endif
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartRead
+ *
+ * Description:
+ *   Reads up to uiLen bytes that the kernel has received on the port.
+ *
+ * Conditions For Use:
+ *   The port must be opened in non-blocking mode.
+ *
+ * Arguments:
+ *   fd    : Port ID.
+ *   pBuf  : Destination buffer.
+ *   uiLen : Size of pBuf.
+ *
+ * Return Value:
+ *   Number of bytes read, 0 if there are none, -1 on error.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartRead(int32 fd, uint8* pBuf, uint32 uiLen) {
+  ssize_t iRead = read(fd, pBuf, uiLen);
+
+  if (iRead < 0) {
+    if ((errno == EAGAIN) || (errno == EINTR)) {
+      return 0;
+    }
+    VND_LOGV("Read error: %s (%d)", strerror(errno), errno);
+    return -1;
+  }
+  return (int32)iRead;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartWritev
+ *
+ * Description:
+ *   Hands the buffers in pIov to the kernel with one writev() call.
+ *
+ * Conditions For Use:
+ *   The port must be opened in non-blocking mode.
+ *
+ * Arguments:
+ *   fd     : Port ID.
+ *   pIov   : Buffers to write.
+ *   iCount : Number of entries in pIov.
+ *
+ * Return Value:
+ *   Number of bytes accepted, 0 if the TX buffer is full, -1 on error.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartWritev(int32 fd, const struct iovec* pIov,
+                                  int32 iCount) {
+  ssize_t written;
+
+  do {
+    written = writev(fd, pIov, iCount);
+  } while ((written < 0) && (errno == EINTR));
+  if (written < 0) {
+    if (errno == EAGAIN) {
+      return 0;
+    }
+    VND_LOGE("Write error: %s (%d)", strerror(errno), errno);
+    return -1;
+  }
+  return (int32)written;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartWait
+ *
+ * Description:
+ *   Sleeps until the port is ready for iEvents or pDeadline expires.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd        : Port ID.
+ *   iEvents   : POLLIN and/or POLLOUT.
+ *   pDeadline : When to give up.
+ *
+ * Return Value:
+ *   The poll() events reported for the port, 0 on timeout or interruption,
+ *   -1 on error.
+ *
+ * Notes:
+ *   The sleep is bounded by the nanosecond remainder of the deadline; builds
+ *   with FW_LOADER_TIMERFD sleep on a timerfd armed with the absolute
+ *   expiry instead.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartWait(int32 fd, int16 iEvents,
+                                const fw_upload_deadline_t* pDeadline) {
+  struct pollfd pfd[2];
+  struct timespec ts;
+  struct timespec* pTs = NULL;
+  nfds_t nfds = 1;
+  uint64 remaining = fw_upload_DeadlineRemainingNs(pDeadline);
+
+  if (remaining == 0) {
+    return 0;
+  }
+  pfd[0].fd = fd;
+  pfd[0].events = iEvents;
+  pfd[0].revents = 0;
+#ifdef FW_LOADER_TIMERFD
+  if (remaining != FW_UPLOAD_NO_DEADLINE) {
+    struct itimerspec its;
+
+    if (deadline_timer_fd < 0) {
+      deadline_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+      if (deadline_timer_fd >= 0) {
+        pthread_once(&deadline_timer_once, fw_upload_DeadlineTimerKeyInit);
+        pthread_setspecific(deadline_timer_key,
+                            (void*)((intptr_t)deadline_timer_fd + 1));
+      }
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(pDeadline->ullExpiryNs / NSEC_PER_SEC);
+    its.it_value.tv_nsec = (long)(pDeadline->ullExpiryNs % NSEC_PER_SEC);
+    if ((deadline_timer_fd >= 0) &&
+        (timerfd_settime(deadline_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) ==
+         0)) {
+      pfd[1].fd = deadline_timer_fd;
+      pfd[1].events = POLLIN;
+      pfd[1].revents = 0;
+      nfds = 2;
+    }
+  }
+#endif
+  if ((nfds == 1) && (remaining != FW_UPLOAD_NO_DEADLINE)) {
+    ts.tv_sec = (time_t)(remaining / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(remaining % NSEC_PER_SEC);
+    pTs = &ts;
+  }
+  if (ppoll(pfd, nfds, pTs, NULL) < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    VND_LOGE("poll error: %s (%d)", strerror(errno), errno);
+    return -1;
+  }
+  return pfd[0].revents;
+}
+
+#ifdef TEST_CODE
+/******************************************************************************
+ *
+ * Name: fw_upload_DeadlineBenchmark
+ *
+ * Description:
+ *   Logs how far waits end from their timeout, for the millisecond polling
+ *   loops the loaders used before fw_upload_deadline_t and for
+ *   fw_upload_UartWait() on a deadline.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The waits are done on a pipe nothing is written to, so they always run
+ *   into their timeout. Each timeout is waited DEADLINE_BENCHMARK_ROUNDS
+ *   times both ways. A negative error is a wait that ended early, which the
+ *   millisecond loops do when they start late in a millisecond.
+ *
+ *****************************************************************************/
+void fw_upload_DeadlineBenchmark(void) {
+  static const uint32 uiTimeoutsMs[] = {1, 4, 16};
+  fw_upload_deadline_t deadline;
+  int32 iPipe[2];
+  uint64 startMs;
+  uint64 startNs;
+  int64_t errNs;
+  int64_t pollSumNs;
+  int64_t pollWorstNs;
+  int64_t waitSumNs;
+  int64_t waitWorstNs;
+  uint32 uiSleeps;
+  uint32 uiWakeups;
+  uint32 i;
+  uint32 j;
+
+  if (pipe(iPipe) < 0) {
+    VND_LOGE("No pipe for the deadline benchmark: %s (%d)", strerror(errno),
+             errno);
+    return;
+  }
+  for (i = 0; i < sizeof(uiTimeoutsMs) / sizeof(uiTimeoutsMs[0]); i++) {
+    pollSumNs = 0;
+    pollWorstNs = 0;
+    waitSumNs = 0;
+    waitWorstNs = 0;
+    uiSleeps = 0;
+    uiWakeups = 0;
+    for (j = 0; j < DEADLINE_BENCHMARK_ROUNDS; j++) {
+      startNs = fw_upload_GetTimeNs();
+      startMs = fw_upload_GetTime();
+      while ((fw_upload_GetTime() - startMs) < uiTimeoutsMs[i]) {
+        usleep(1000);
+        uiSleeps++;
+      }
+      errNs = (int64_t)(fw_upload_GetTimeNs() - startNs -
+                        (uint64)uiTimeoutsMs[i] * NSEC_PER_MSEC);
+      pollSumNs += errNs;
+      if (llabs(errNs) > llabs(pollWorstNs)) {
+        pollWorstNs = errNs;
+      }
+
+      fw_upload_DeadlineInit(&deadline, uiTimeoutsMs[i], NULL);
+      while (!fw_upload_DeadlineExpired(&deadline)) {
+        (void)fw_upload_UartWait(iPipe[0], POLLIN, &deadline);
+        uiWakeups++;
+      }
+      errNs = (int64_t)(fw_upload_GetTimeNs() - deadline.ullExpiryNs);
+      waitSumNs += errNs;
+      if (llabs(errNs) > llabs(waitWorstNs)) {
+        waitWorstNs = errNs;
+      }
+    }
+    VND_LOGD("%u ms timeout: ms polling off by %lld us (worst %lld) in %u "
+             "sleeps, deadline off by %lld us (worst %lld) in %u wakeups",
+             uiTimeoutsMs[i],
+             (long long)(pollSumNs / DEADLINE_BENCHMARK_ROUNDS / 1000),
+             (long long)(pollWorstNs / 1000), uiSleeps,
+             (long long)(waitSumNs / DEADLINE_BENCHMARK_ROUNDS / 1000),
+             (long long)(waitWorstNs / 1000), uiWakeups);
+  }
+  close(iPipe[0]);
+  close(iPipe[1]);
+}
+#endif
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartBytesAvailable
+ *
+ * Description:
+ *   Returns the number of bytes the kernel has received on the port.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   Number of bytes, -1 on error.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartBytesAvailable(int32 fd) {
+  int32 bytes = 0;
+
+  if (ioctl(fd, FIONREAD, &bytes) < 0) {
+    VND_LOGE("ioctl error: %s (%d)", strerror(errno), errno);
+    return -1;
+  }
+  return bytes;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartModemLines
+ *
+ * Description:
+ *   Returns the state of the modem lines.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   TIOCM_* bits, -1 on error.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartModemLines(int32 fd) {
+  int32 status = 0;
+
+  if (ioctl(fd, TIOCMGET, &status) < 0) {
+    VND_LOGE("ioctl error: %s (%d)", strerror(errno), errno);
+    return -1;
+  }
+  return status;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartCtsTransitions
+ *
+ * Description:
+ *   Reads the number of CTS transitions the driver has counted.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd       : Port ID.
+ *   puiCount : Receives the cts counter of TIOCGICOUNT.
+ *
+ * Return Value:
+ *   0 on success, -1 if the driver does not support TIOCGICOUNT.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartCtsTransitions(int32 fd, uint32* puiCount) {
+  struct serial_icounter_struct icount;
+
+  memset(&icount, 0, sizeof(icount));
+  if (ioctl(fd, TIOCGICOUNT, &icount) < 0) {
+    return -1;
+  }
+  *puiCount = (uint32)icount.cts;
+  return 0;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ModemWaitSignal
+ *
+ * Description:
+ *   Handler of MODEM_WAIT_SIGNAL. It does nothing, the signal only makes a
+ *   pending TIOCMIWAIT return with EINTR.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   sig: the signal number.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_ModemWaitSignal(int sig) { (void)sig; }
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ModemWaitThread
+ *
+ * Description:
+ *   Blocks in TIOCMIWAIT again and again, counting the changes of the
+ *   watched modem lines, until the wait is over.
+ *
+ * Conditions For Use:
+ *   Started by fw_upload_UartWaitModemLines().
+ *
+ * Arguments:
+ *   pArg: the fw_upload_modem_wait_t of the wait.
+ *
+ * Return Value:
+ *   NULL.
+ *
+ * Notes:
+ *   Exits on the first error other than EINTR, leaving it in iErrno.
+ *
+ *****************************************************************************/
+static void* fw_upload_ModemWaitThread(void* pArg) {
+  fw_upload_modem_wait_t* pWait = (fw_upload_modem_wait_t*)pArg;
+  int32 iResult;
+  int32 iErrno;
+
+  pthread_mutex_lock(&pWait->lock);
+  while (!pWait->bStop) {
+    pthread_mutex_unlock(&pWait->lock);
+    iResult = ioctl(pWait->fd, TIOCMIWAIT, pWait->iMask);
+    iErrno = errno;
+    pthread_mutex_lock(&pWait->lock);
+    if (iResult == 0) {
+      pWait->uiChanges++;
+      pthread_cond_signal(&pWait->cond);
+    } else if (iErrno != EINTR) {
+      pWait->iErrno = iErrno;
+      break;
+    }
+  }
+  pWait->bExited = true;
+  pthread_cond_signal(&pWait->cond);
+  pthread_mutex_unlock(&pWait->lock);
+  return NULL;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartWaitModemLines
+ *
+ * Description:
+ *   Sleeps in TIOCMIWAIT until pfnDone reports that the modem lines are
+ *   where the caller wants them, or pDeadline expires.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd        : Port ID.
+ *   iMask     : TIOCM_* lines whose changes wake the wait.
+ *   pDeadline : When to give up.
+ *   pfnDone   : Checks the lines, called at the start, after every change
+ *               and at least every MODEM_WAIT_CHECK_MS.
+ *   pCbCtx    : Passed to pfnDone.
+ *
+ * Return Value:
+ *   1 once pfnDone returned true, 0 on timeout, -1 with errno set if the
+ *   driver cannot wait for its lines (ENOTTY or EINVAL without TIOCMIWAIT).
+ *
+ * Notes:
+ *   TIOCMIWAIT has no timeout of its own. It runs on one thread for the
+ *   whole wait, which is interrupted with MODEM_WAIT_SIGNAL when the wait
+ *   is over. The previous disposition of that signal is restored before
+ *   returning. A change that falls between two TIOCMIWAIT is caught by the
+ *   next periodic check.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartWaitModemLines(
+    int32 fd, int32 iMask, const fw_upload_deadline_t* pDeadline,
+    fw_upload_modem_check_cb_t pfnDone, void* pCbCtx) {
+  fw_upload_modem_wait_t wait;
+  pthread_condattr_t attr;
+  struct sigaction sa;
+  struct sigaction saOld;
+  struct timespec ts;
+  pthread_t thread;
+  uint32 uiSeen;
+  uint64 wakeNs;
+  int32 iRet;
+
+  if (pfnDone(fd, pCbCtx)) {
+    return 1;
+  }
+  memset(&wait, 0, sizeof(wait));
+  wait.fd = fd;
+  wait.iMask = iMask;
+  pthread_mutex_init(&wait.lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wait.cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // No SA_RESTART, the interrupted ioctl must return
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = fw_upload_ModemWaitSignal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(MODEM_WAIT_SIGNAL, &sa, &saOld);
+
+  iRet = pthread_create(&thread, NULL, fw_upload_ModemWaitThread, &wait);
+  if (iRet != 0) {
+    VND_LOGE("pthread_create error: %s (%d)", strerror(iRet), iRet);
+    sigaction(MODEM_WAIT_SIGNAL, &saOld, NULL);
+    pthread_cond_destroy(&wait.cond);
+    pthread_mutex_destroy(&wait.lock);
+    errno = iRet;
+    return -1;
+  }
+
+  pthread_mutex_lock(&wait.lock);
+  while (true) {
+    uiSeen = wait.uiChanges;
+    pthread_mutex_unlock(&wait.lock);
+    iRet = pfnDone(fd, pCbCtx) ? 1 : 0;
+    pthread_mutex_lock(&wait.lock);
+    if ((iRet == 1) || fw_upload_DeadlineExpired(pDeadline)) {
+      break;
+    }
+    if (wait.bExited) {
+      iRet = -1;
+      break;
+    }
+    if (wait.uiChanges == uiSeen) {
+      wakeNs = fw_upload_GetTimeNs() + MODEM_WAIT_CHECK_MS * NSEC_PER_MSEC;
+      if (pDeadline->ullExpiryNs < wakeNs) {
+        wakeNs = pDeadline->ullExpiryNs;
+      }
+      ts.tv_sec = (time_t)(wakeNs / NSEC_PER_SEC);
+      ts.tv_nsec = (long)(wakeNs % NSEC_PER_SEC);
+      (void)pthread_cond_timedwait(&wait.cond, &wait.lock, &ts);
+    }
+  }
+
+  // The signal is lost if it arrives before the thread is back in the
+  // ioctl, it is sent again until the thread has left
+  wait.bStop = true;
+  while (!wait.bExited) {
+    pthread_kill(thread, MODEM_WAIT_SIGNAL);
+    wakeNs = fw_upload_GetTimeNs() + NSEC_PER_MSEC;
+    ts.tv_sec = (time_t)(wakeNs / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(wakeNs % NSEC_PER_SEC);
+    (void)pthread_cond_timedwait(&wait.cond, &wait.lock, &ts);
+  }
+  pthread_mutex_unlock(&wait.lock);
+  pthread_join(thread, NULL);
+
+  sigaction(MODEM_WAIT_SIGNAL, &saOld, NULL);
+  pthread_cond_destroy(&wait.cond);
+  pthread_mutex_destroy(&wait.lock);
+  if (iRet == -1) {
+    errno = wait.iErrno;
+  }
+  return iRet;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartSetBaud
+ *
+ * Description:
+ *   Reopens the port at the requested baud rate.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd         : Port ID.
+ *   pPortName  : Device path of the port.
+ *   uiBaud     : New baud rate.
+ *   ucFlowCtrl : Enable hardware flow control.
+ *
+ * Return Value:
+ *   The new port ID, -1 on error.
+ *
+ * Notes:
+ *   init_uart() works on settings of its own for any port but mchar_port,
+ *   so the ports of bt_vnd_mrvl_download_parallel() can be reopened at the
+ *   same time.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartSetBaud(int32 fd, int8* pPortName, uint32 uiBaud,
+                                   uint8 ucFlowCtrl) {
+  close(fd);
+  return init_uart(pPortName, uiBaud, ucFlowCtrl);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartFlush
+ *
+ * Description:
+ *   Discards data queued in the kernel.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd     : Port ID.
+ *   iQueue : TCIFLUSH, TCOFLUSH or TCIOFLUSH.
+ *
+ * Return Value:
+ *   Return value of tcflush().
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartFlush(int32 fd, int32 iQueue) {
+  return tcflush(fd, iQueue);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_UartDrain
+ *
+ * Description:
+ *   Waits until the kernel has transmitted everything written to the port.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   Return value of tcdrain().
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_UartDrain(int32 fd) { return tcdrain(fd); }
+
+/******************************************************************************
+ *
+ * Name: fw_upload_EmulatedModemLines
+ *
+ * Description:
+ *   Returns the modem lines set with fw_upload_TransportSetModemLines().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   TIOCM_* bits, 0 if none were set for the port.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_EmulatedModemLines(int32 fd) {
+  int32 iStatus = 0;
+  uint32 i;
+
+  pthread_mutex_lock(&emulated_modem_lock);
+  for (i = 0; i < emulated_modem_ports; i++) {
+    if (emulated_modem_lines[i].fd == fd) {
+      iStatus = emulated_modem_lines[i].iStatus;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&emulated_modem_lock);
+  return iStatus;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_EmulatedCtsTransitions
+ *
+ * Description:
+ *   Returns the number of CTS transitions set with
+ *   fw_upload_TransportSetModemLines().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd       : Port ID.
+ *   puiCount : Receives the number of transitions.
+ *
+ * Return Value:
+ *   0, a port without lines has no transitions.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_EmulatedCtsTransitions(int32 fd, uint32* puiCount) {
+  uint32 i;
+
+  *puiCount = 0;
+  pthread_mutex_lock(&emulated_modem_lock);
+  for (i = 0; i < emulated_modem_ports; i++) {
+    if (emulated_modem_lines[i].fd == fd) {
+      *puiCount = emulated_modem_lines[i].uiCtsCount;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&emulated_modem_lock);
+  return 0;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_TransportSetModemLines
+ *
+ * Description:
+ *   Sets the modem lines the pty and loopback transports report for a
+ *   port, which lets a simulated controller drive CTS.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd      : Port ID.
+ *   iStatus : TIOCM_* bits.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The lines can be set from the thread of the simulator while the loader
+ *   reads them. The table of ports grows as needed, the lines of a port
+ *   are kept until the process exits.
+ *
+ *****************************************************************************/
+void fw_upload_TransportSetModemLines(int32 fd, int32 iStatus) {
+  fw_upload_emulated_lines_t* pLines;
+  uint32 uiRoom;
+  uint32 i;
+
+  pthread_mutex_lock(&emulated_modem_lock);
+  for (i = 0; i < emulated_modem_ports; i++) {
+    if (emulated_modem_lines[i].fd == fd) {
+      break;
+    }
+  }
+  if (i == emulated_modem_ports) {
+    if (i == emulated_modem_room) {
+      uiRoom = (emulated_modem_room == 0) ? EMULATED_MODEM_PORTS
+                                          : (emulated_modem_room * 2);
+      pLines = (fw_upload_emulated_lines_t*)realloc(
+          emulated_modem_lines, uiRoom * sizeof(*pLines));
+      if (pLines == NULL) {
+        VND_LOGE("No memory for the modem lines of fd %d", fd);
+        pthread_mutex_unlock(&emulated_modem_lock);
+        return;
+      }
+      emulated_modem_lines = pLines;
+      emulated_modem_room = uiRoom;
+    }
+    emulated_modem_lines[i].fd = fd;
+    emulated_modem_lines[i].iStatus = 0;
+    emulated_modem_lines[i].uiCtsCount = 0;
+    emulated_modem_ports++;
+  }
+  if ((emulated_modem_lines[i].iStatus ^ iStatus) & TIOCM_CTS) {
+    emulated_modem_lines[i].uiCtsCount++;
+  }
+  emulated_modem_lines[i].iStatus = iStatus;
+  pthread_mutex_unlock(&emulated_modem_lock);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_PtySetBaud
+ *
+ * Description:
+ *   Applies the baud rate to the pseudo terminal without reopening it.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd         : Port ID.
+ *   pPortName  : Device path, unused.
+ *   uiBaud     : New baud rate.
+ *   ucFlowCtrl : Unused, a pseudo terminal has no flow control lines.
+ *
+ * Return Value:
+ *   fd, or -1 if the rate is not one init_uart() supports or the terminal
+ *   settings cannot be changed.
+ *
+ * Notes:
+ *   The rate only has an effect on the termios settings, data always moves
+ *   at memory speed. The port is closed on failure, as a UART that cannot
+ *   be reopened is.
+ *
+ *****************************************************************************/
+static int32 fw_upload_PtySetBaud(int32 fd, int8* pPortName, uint32 uiBaud,
+                                  uint8 ucFlowCtrl) {
+  struct termios ti;
+  speed_t speed = uart_speed(uiBaud);
+
+  (void)pPortName;
+  (void)ucFlowCtrl;
+  if (speed == B0) {
+    VND_LOGE("pty baud rate %u not supported", uiBaud);
+    close(fd);
+    return -1;
+  }
+  if ((tcgetattr(fd, &ti) < 0) || (cfsetspeed(&ti, speed) < 0) ||
+      (tcsetattr(fd, TCSANOW, &ti) < 0)) {
+    VND_LOGE("pty baud rate %u: %s (%d)", uiBaud, strerror(errno), errno);
+    close(fd);
+    return -1;
+  }
+  VND_LOGD("pty baud rate %u", uiBaud);
+  return fd;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackFind
+ *
+ * Description:
+ *   Returns the loopback attached to a port.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   The loopback, NULL if none is attached to fd.
+ *
+ * Notes:
+ *   The loopback stays valid until fw_upload_LoopbackDetach().
+ *
+ *****************************************************************************/
+static fw_upload_loopback_t* fw_upload_LoopbackFind(int32 fd) {
+  fw_upload_loopback_t* pLoop;
+
+  pthread_mutex_lock(&loopback_lock);
+  for (pLoop = loopbacks; pLoop != NULL; pLoop = pLoop->pNext) {
+    if (pLoop->fd == fd) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&loopback_lock);
+  return pLoop;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackAttach
+ *
+ * Description:
+ *   Connects the loopback transport of a port to a simulated controller
+ *   and empties its receive buffer.
+ *
+ * Conditions For Use:
+ *   Call before the loopback transport is selected.
+ *
+ * Arguments:
+ *   fd      : Port ID the loader is given for the controller.
+ *   pfnPeer : Receives what the loader writes to fd.
+ *   pCtx    : Passed back to pfnPeer.
+ *
+ * Return Value:
+ *   true if attached, false if out of memory.
+ *
+ * Notes:
+ *   Each port has a loopback of its own, so several controllers can be
+ *   simulated at once. Attaching a port again replaces its peer.
+ *
+ *****************************************************************************/
+bool fw_upload_LoopbackAttach(int32 fd, fw_upload_loopback_peer_t pfnPeer,
+                              void* pCtx) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+  pthread_condattr_t attr;
+
+  if (pLoop != NULL) {
+    pthread_mutex_lock(&pLoop->lock);
+    pLoop->pfnPeer = pfnPeer;
+    pLoop->pCtx = pCtx;
+    pLoop->uiHead = pLoop->uiTail;
+    pthread_mutex_unlock(&pLoop->lock);
+    return true;
+  }
+  pLoop = (fw_upload_loopback_t*)malloc(sizeof(*pLoop));
+  if (pLoop == NULL) {
+    VND_LOGE("No memory for the loopback of fd %d", fd);
+    return false;
+  }
+  pLoop->fd = fd;
+  pLoop->pfnPeer = pfnPeer;
+  pLoop->pCtx = pCtx;
+  pLoop->uiHead = 0;
+  pLoop->uiTail = 0;
+  pthread_mutex_init(&pLoop->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pLoop->pushed, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_mutex_lock(&loopback_lock);
+  pLoop->pNext = loopbacks;
+  loopbacks = pLoop;
+  pthread_mutex_unlock(&loopback_lock);
+  return true;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackDetach
+ *
+ * Description:
+ *   Disconnects the loopback of a port and frees it.
+ *
+ * Conditions For Use:
+ *   The loader and the peer are done with fd.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Nothing is done if no loopback is attached to fd.
+ *
+ *****************************************************************************/
+void fw_upload_LoopbackDetach(int32 fd) {
+  fw_upload_loopback_t** ppLoop;
+  fw_upload_loopback_t* pLoop = NULL;
+
+  pthread_mutex_lock(&loopback_lock);
+  for (ppLoop = &loopbacks; *ppLoop != NULL; ppLoop = &(*ppLoop)->pNext) {
+    if ((*ppLoop)->fd == fd) {
+      pLoop = *ppLoop;
+      *ppLoop = pLoop->pNext;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&loopback_lock);
+  if (pLoop != NULL) {
+    pthread_cond_destroy(&pLoop->pushed);
+    pthread_mutex_destroy(&pLoop->lock);
+    free(pLoop);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackPush
+ *
+ * Description:
+ *   Queues bytes for the loader to read from the loopback of a port.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd    : Port ID.
+ *   pData : Bytes sent by the simulated controller.
+ *   uiLen : Number of bytes.
+ *
+ * Return Value:
+ *   Number of bytes queued, less than uiLen when the buffer is full, 0 if
+ *   no loopback is attached to fd.
+ *
+ * Notes:
+ *   May be called from any thread, a loader waiting for data wakes up.
+ *
+ *****************************************************************************/
+uint32 fw_upload_LoopbackPush(int32 fd, const uint8* pData, uint32 uiLen) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+  uint32 uiFree;
+  uint32 i;
+
+  if (pLoop == NULL) {
+    VND_LOGE("No loopback attached to fd %d", fd);
+    return 0;
+  }
+  pthread_mutex_lock(&pLoop->lock);
+  uiFree = LOOPBACK_BUF_SIZE - (pLoop->uiTail - pLoop->uiHead);
+  if (uiLen > uiFree) {
+    uiLen = uiFree;
+  }
+  for (i = 0; i < uiLen; i++) {
+    pLoop->ucBuf[(pLoop->uiTail + i) & LOOPBACK_BUF_MASK] = pData[i];
+  }
+  pLoop->uiTail += uiLen;
+  if (uiLen != 0) {
+    pthread_cond_broadcast(&pLoop->pushed);
+  }
+  pthread_mutex_unlock(&pLoop->lock);
+  return uiLen;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackRead
+ *
+ * Description:
+ *   Reads bytes queued with fw_upload_LoopbackPush().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd    : Port ID.
+ *   pBuf  : Destination buffer.
+ *   uiLen : Size of pBuf.
+ *
+ * Return Value:
+ *   Number of bytes read, -1 with errno EBADF if no loopback is attached
+ *   to fd.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackRead(int32 fd, uint8* pBuf, uint32 uiLen) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+  uint32 uiCount;
+  uint32 uiPos;
+  uint32 uiChunk;
+
+  if (pLoop == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  pthread_mutex_lock(&pLoop->lock);
+  uiCount = pLoop->uiTail - pLoop->uiHead;
+  uiPos = pLoop->uiHead & LOOPBACK_BUF_MASK;
+  if (uiLen > uiCount) {
+    uiLen = uiCount;
+  }
+  uiChunk = LOOPBACK_BUF_SIZE - uiPos;
+  if (uiChunk > uiLen) {
+    uiChunk = uiLen;
+  }
+  memcpy(pBuf, &pLoop->ucBuf[uiPos], uiChunk);
+  memcpy(pBuf + uiChunk, pLoop->ucBuf, uiLen - uiChunk);
+  pLoop->uiHead += uiLen;
+  pthread_mutex_unlock(&pLoop->lock);
+  return (int32)uiLen;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackWritev
+ *
+ * Description:
+ *   Hands every buffer to the peer attached to the port.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd     : Port ID.
+ *   pIov   : Buffers to write.
+ *   iCount : Number of entries in pIov.
+ *
+ * Return Value:
+ *   Number of bytes written, the loopback never blocks. -1 with errno
+ *   EBADF if no loopback is attached to fd.
+ *
+ * Notes:
+ *   Without a peer the data is dropped. The peer is called without any
+ *   lock held, it may push its answer right away.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackWritev(int32 fd, const struct iovec* pIov,
+                                      int32 iCount) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+  int32 written = 0;
+  int32 i;
+
+  if (pLoop == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  for (i = 0; i < iCount; i++) {
+    if ((pLoop->pfnPeer != NULL) && (pIov[i].iov_len != 0)) {
+      pLoop->pfnPeer(pLoop->pCtx, (const uint8*)pIov[i].iov_base,
+                     (uint32)pIov[i].iov_len);
+    }
+    written += (int32)pIov[i].iov_len;
+  }
+  return written;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackWait
+ *
+ * Description:
+ *   Sleeps until the loopback of the port is ready for iEvents, pDeadline
+ *   expires or a tick of LOOPBACK_TICK_MS has passed.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd        : Port ID.
+ *   iEvents   : POLLIN and/or POLLOUT.
+ *   pDeadline : When to give up.
+ *
+ * Return Value:
+ *   The ready events, 0 if none, POLLNVAL if no loopback is attached to
+ *   fd.
+ *
+ * Notes:
+ *   When the loader waits for data the peer is called with an empty buffer
+ *   first, so that it can send whatever a controller would send on its own
+ *   (start indications, retransmitted requests). If that sends nothing the
+ *   wait blocks until fw_upload_LoopbackPush() is called from another
+ *   thread or the tick ends, and the caller's next wait calls the peer
+ *   again.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackWait(int32 fd, int16 iEvents,
+                                    const fw_upload_deadline_t* pDeadline) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+  int32 iReady = iEvents & POLLOUT;
+  uint64 wakeNs;
+  struct timespec ts;
+  bool bEmpty;
+
+  if (pLoop == NULL) {
+    return POLLNVAL;
+  }
+  if ((iEvents & POLLIN) == 0) {
+    return iReady;
+  }
+  pthread_mutex_lock(&pLoop->lock);
+  bEmpty = (pLoop->uiTail == pLoop->uiHead);
+  pthread_mutex_unlock(&pLoop->lock);
+  if (bEmpty && (pLoop->pfnPeer != NULL)) {
+    pLoop->pfnPeer(pLoop->pCtx, NULL, 0);
+  }
+  wakeNs = fw_upload_GetTimeNs() + LOOPBACK_TICK_MS * NSEC_PER_MSEC;
+  if (pDeadline->ullExpiryNs < wakeNs) {
+    wakeNs = pDeadline->ullExpiryNs;
+  }
+  ts.tv_sec = (time_t)(wakeNs / NSEC_PER_SEC);
+  ts.tv_nsec = (long)(wakeNs % NSEC_PER_SEC);
+
+  pthread_mutex_lock(&pLoop->lock);
+  while ((pLoop->uiTail == pLoop->uiHead) && (iReady == 0)) {
+    if (pthread_cond_timedwait(&pLoop->pushed, &pLoop->lock, &ts) != 0) {
+      break;
+    }
+  }
+  if (pLoop->uiTail != pLoop->uiHead) {
+    iReady |= POLLIN;
+  }
+  pthread_mutex_unlock(&pLoop->lock);
+  return iReady;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackBytesAvailable
+ *
+ * Description:
+ *   Returns the number of bytes queued by the peer of the port.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID.
+ *
+ * Return Value:
+ *   Number of bytes, -1 if no loopback is attached to fd.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackBytesAvailable(int32 fd) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+  int32 iCount;
+
+  if (pLoop == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&pLoop->lock);
+  iCount = (int32)(pLoop->uiTail - pLoop->uiHead);
+  pthread_mutex_unlock(&pLoop->lock);
+  return iCount;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackSetBaud
+ *
+ * Description:
+ *   Accepts any baud rate, the loopback has no line speed.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd         : Port ID.
+ *   pPortName  : Unused.
+ *   uiBaud     : New baud rate.
+ *   ucFlowCtrl : Unused.
+ *
+ * Return Value:
+ *   fd.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackSetBaud(int32 fd, int8* pPortName,
+                                       uint32 uiBaud, uint8 ucFlowCtrl) {
+  (void)pPortName;
+  (void)ucFlowCtrl;
+  VND_LOGD("loopback baud rate %d", uiBaud);
+  return fd;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackDrain
+ *
+ * Description:
+ *   Nothing to wait for, the peer has seen every write already.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd : Port ID, unused.
+ *
+ * Return Value:
+ *   0.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackDrain(int32 fd) {
+  (void)fd;
+  return 0;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LoopbackFlush
+ *
+ * Description:
+ *   Drops the bytes queued by the peer when the receive queue is flushed.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   fd     : Port ID.
+ *   iQueue : TCIFLUSH, TCOFLUSH or TCIOFLUSH.
+ *
+ * Return Value:
+ *   0, -1 with errno EBADF if no loopback is attached to fd.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_upload_LoopbackFlush(int32 fd, int32 iQueue) {
+  fw_upload_loopback_t* pLoop = fw_upload_LoopbackFind(fd);
+
+  if (pLoop == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  if (iQueue != TCOFLUSH) {
+    pthread_mutex_lock(&pLoop->lock);
+    pLoop->uiHead = pLoop->uiTail;
+    pthread_mutex_unlock(&pLoop->lock);
+  }
+  return 0;
+}
+
+/* Real UART, the default */
+const fw_upload_transport_t fw_upload_uart_transport = {
+    .pName = "uart",
+    .pfnRead = fw_upload_UartRead,
+    .pfnWritev = fw_upload_UartWritev,
+    .pfnWait = fw_upload_UartWait,
+    .pfnBytesAvailable = fw_upload_UartBytesAvailable,
+    .pfnModemLines = fw_upload_UartModemLines,
+    .pfnCtsTransitions = fw_upload_UartCtsTransitions,
+    .pfnWaitModemLines = fw_upload_UartWaitModemLines,
+    .pfnSetBaud = fw_upload_UartSetBaud,
+    .pfnFlush = fw_upload_UartFlush,
+    .pfnDrain = fw_upload_UartDrain,
+};
+
+/* Pseudo terminal, e.g. towards a controller simulator on the master side.
+ * A pty has no modem lines, they are emulated and sampled. */
+const fw_upload_transport_t fw_upload_pty_transport = {
+    .pName = "pty",
+    .pfnRead = fw_upload_UartRead,
+    .pfnWritev = fw_upload_UartWritev,
+    .pfnWait = fw_upload_UartWait,
+    .pfnBytesAvailable = fw_upload_UartBytesAvailable,
+    .pfnModemLines = fw_upload_EmulatedModemLines,
+    .pfnCtsTransitions = fw_upload_EmulatedCtsTransitions,
+    .pfnSetBaud = fw_upload_PtySetBaud,
+    .pfnFlush = fw_upload_UartFlush,
+    .pfnDrain = fw_upload_UartDrain,
+};
+
+/* In-memory connection to a peer, see fw_upload_LoopbackAttach() */
+const fw_upload_transport_t fw_upload_loopback_transport = {
+    .pName = "loopback",
+    .pfnRead = fw_upload_LoopbackRead,
+    .pfnWritev = fw_upload_LoopbackWritev,
+    .pfnWait = fw_upload_LoopbackWait,
+    .pfnBytesAvailable = fw_upload_LoopbackBytesAvailable,
+    .pfnModemLines = fw_upload_EmulatedModemLines,
+    .pfnCtsTransitions = fw_upload_EmulatedCtsTransitions,
+    .pfnSetBaud = fw_upload_LoopbackSetBaud,
+    .pfnFlush = fw_upload_LoopbackFlush,
+    .pfnDrain = fw_upload_LoopbackDrain,
+};
@@ -20,7 +20,8 @@
  *
  *  Filename:      fw_loader_uart.c
  *
- *  Description:   Firmware loader version 1 and 3 functions
+ *  Description:   Firmware loader functions for the version 1, 2 (helper)
+ *                 and 3 bootloaders
  *
  ******************************************************************************/
 
@@ -31,6 +32,7 @@
 
 #include <errno.h>
 #include <memory.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,7 +49,6 @@
 
 /*================================== Macros ==================================*/
 #define VERSION "M322"
-#define MAX_LENGTH 0xFFFF  // Maximum 2 byte value
 #define END_SIG_TIMEOUT 2500
 #define MAX_CTS_TIMEOUT 500  // 500ms
 #define STRING_SIZE 6U
@@ -59,12 +60,34 @@
 #define V1_REQUEST_ACK 0x5aU
 #define V1_START_INDICATION 0xaaU
 
+#define V2_HEADER_DATA_REQ 0xa6U
+#define V2_REQUEST_ACK 0x6aU
+#define V2_TIMEOUT_ACK 0x6bU
+/* Answer to a length, offset or error code that fails its complement */
+#define REQUEST_NAK 0xbfU
+/* CTS wait after a helper download */
+#define V2_MAX_CTS_TIMEOUT 5000
+/* Time the helper is given to ask again before a step counts as done */
+#define V2_RETRY_DELAY 20
+/* Time the helper is given to start over after the download */
+#define V2_RESTART_TIMEOUT 200
+/* Time the V1 bootloader is given to repeat requests after the timeout
+ * patch, see fw_upload_SendRomTimeoutPatch() */
+#define V1_ROM_PATCH_DELAY 250
+/* Quiet time that ends a burst of requests, see fw_upload_PaceWait() */
+#define PACE_QUIET_MS 5
+/* Room for the download baud rate properties and the port name they are
+ * suffixed with by bt_vnd_mrvl_download_parallel() */
+#define DL_BAUD_PROP_LEN 96
+
 #define V3_START_INDICATION 0xabU
 #define V3_HEADER_DATA_REQ 0xa7U
 #define V3_REQUEST_ACK 0x7aU
 #define V3_TIMEOUT_ACK 0x7bU
 #define V3_CRC_ERROR 0x7cU
 
+// Bytes of V1 request backlog scanned at a time
+#define FW_V1_SCAN_LEN 256U
 #define FW_INIT_CONFIG_LEN 64
 #define REQ_HEADER_LEN 1
 #define A6REQ_PAYLOAD_LEN 8
@@ -73,7 +96,6 @@
 #define END_SIG 0x435000
 
 #define GP 0x107 /* x^8 + x^2 + x + 1 */
-#define DI 0x07
 
 #define CRC_ERR_BIT 1 << 0
 #define NAK_REC_BIT 1 << 1
@@ -88,8 +110,6 @@
   (((x >> 24) & 0xff) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000L) | \
    ((x << 24) & 0xff000000L))
 
-#define POLYNOMIAL 0x04c11db7L
-
 #define CLKDIVAddr 0x7f00008f
 #define UARTDIVAddr 0x7f000090
 #define UARTMCRAddr 0x7f000091
@@ -103,33 +123,56 @@
 #define FCR 0x000000c7  // TODO: why same as ICR
 /* Timeout for getting 0xa5 or 0xab or 0xaa or 0xa7 */
 #define TIMEOUT_VAL_MILLISEC 510
-
-static unsigned char crc8_table[256]; /* 8-bit table */
-static int made_table = 0;
-
-static unsigned long crc_table[256];
-static bool cmd7_Req = false;
-static bool EntryPoint_Req = false;
-static uint32 change_baudrate_buffer_len = 0;
-static uint32 cmd7_change_timeout_len = 0;
-static uint32 cmd5_len = 0;
-static bool send_poke = true;
-static uint16 chip_id = 0;
-static uint8 m_Buffer_Poke[2] = {0xdc, 0xe9};
+/* Overall budget for fw_Change_Baudrate, retries and fallback included */
+#define CHANGE_BAUDRATE_BUDGET_MS 10000
+/* Overall budget for fw_Change_Timeout, retries included */
+#define CHANGE_TIMEOUT_BUDGET_MS 5000
+/* Time bt_vnd_mrvl_probe_fw_status() waits for the controller to show up */
+#define FW_STATUS_PROBE_MS 1000
+/* Part of it spent waiting for an answer to the HCI reset probe when the
+ * bootloader has to be poked, firmware answers within a few ms */
+#define FW_STATUS_HCI_PROBE_MS 20
+/* CMD5 divisors: the bootloader UART samples 16 times per bit from a
+ * fractional clock of CLKDIV * 16 MHz / 2^22, divided by UARTDIV. The
+ * divider is kept as large as possible below 48 MHz, which gives the
+ * 115200 (16, 0x0075F6FD) and 3000000 (1, 0x00C00000) settings of the
+ * bootloader. */
+#define UART_OVERSAMPLING 16U
+#define UART_REF_CLK_HZ 16000000ULL
+#define UART_CLKDIV_SHIFT 22
+#define UART_MAX_FRAC_CLK_HZ 48000000ULL
+#define UART_MAX_UARTDIV 16U
+
+static const uint8 m_Buffer_Poke[2] = {0xdc, 0xe9};
 // CMD5 Header to change bootloader baud rate
-static uint8 m_Buffer_CMD5_Header[16] = {0x05, 0x00, 0x00, 0x00, 0x00, 0x00,
-                                         0x00, 0x00, 0x2c, 0x00, 0x00, 0x00,
-                                         0x77, 0xdb, 0xfd, 0xe0};
-static uint8 m_Buffer_CMD7_ChangeTimeoutValue[16] = {
+static const uint8 m_Buffer_CMD5_Header[16] = {
+    0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x2c, 0x00, 0x00, 0x00, 0x77, 0xdb, 0xfd, 0xe0};
+static const uint8 m_Buffer_CMD7_ChangeTimeoutValue[16] = {
     0x07, 0x00, 0x00, 0x00, 0x70, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x5b, 0x88, 0xf8, 0xba};
-#if (UART_DOWNLOAD_FW == true)
-static uint8 fw_init_config_bin[FW_INIT_CONFIG_LEN];
-#endif
+// CMD5 patch that raises the timeout of the 8887 boot ROM to 2 seconds, see
+// bt_vnd_mrvl_set_rom_timeout_patch()
+static const uint8 m_Buffer_CMD5_RomTimeout[28] = {
+    0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x00,
+    0x00, 0x00, 0x9D, 0x32, 0xBB, 0x11, 0x2C, 0x94, 0x00, 0xA8,
+    0xEC, 0x70, 0x02, 0x00, 0xB4, 0xD9, 0x9D, 0x26};
+
+/* Firmware image prepared by fw_upload_PrepareImage() while the bootloader
+ * is being set up */
+typedef struct {
+  char szFileName[MAX_PATH_LEN];
+  int32 iBundleEntry; /* image of fwBundle named szFileName, -1 if a file */
+  bool bStarted;   /* preparation of szFileName was started */
+  bool bThread;    /* thread is still to be joined */
+  pthread_t thread;
+  FILE* pFile;
+  fw_upload_image_t image;
+  uint32 ulResult;   /* result of opening and checking the image */
+  uint64 ullStartNs; /* when the preparation was started */
+  uint64 ullReadyNs; /* when the image was ready */
+} fw_upload_prep_t;
 
-static const UART_BAUDRATE UartCfgTbl[] = {
-    {115200, 16, 0x0075F6FD}, {3000000, 1, 0x00C00000},
-};
 #if defined(__CWCC__) || defined(_WIN32) || defined(_WIN64)
 #pragma pack(push, 1)
 #else
@@ -154,42 +197,31 @@ typedef struct {
 
 /*================================== Typedefs=================================*/
 
-/*================================ Global Vars================================*/
-// Maximum Length that could be asked by the Helper = 2 bytes
-static uint8 ucByteBuffer[MAX_LENGTH];
-
-// Size of the File to be downloaded
-static uint32 uiTotalFileSize = 0;
-
-// Current size of the Download
-static uint32 ulCurrFileSize = 0;
-static uint32 ulLastOffsetToSend = 0xFFFF;
-static bool uiErrCase = false;
-// Received Header
-static uint8 ucRcvdHeader = 0xFF;
-static uint8 ucString[STRING_SIZE];
-static bool b16BytesData = false;
-
-static uint16 uiNewLen;
-static uint32 ulNewOffset;
-static uint16 uiNewError;
-static uint8 uiNewCrc;
-static bool bVerChecked = false;
-static uint8 ucCalCrc[10];
-
 typedef enum {
   Ver1,
   Ver2,
   Ver3,
 } Version;
 
-Version uiProVer;
-
 typedef struct {
   uint16_t soc_id;
   char default_fw_name[MAX_FILE_LEN];
 } soc_fw_name_dict_t;
 
+/* How the protocol core serves the requests of one bootloader version */
+typedef struct {
+  const char* pName;
+  // Answers the request whose header signature was received last. The
+  // request is read first unless bReadRequest is false, the bootloader then
+  // asked for a header when the setup before the download ended. *pbDone is
+  // set once the image has been sent. Returns DOWNLOAD_SUCCESS or the error
+  // that ends the download.
+  uint32 (*pfnServe)(fw_upload_ctx_t* pCtx, const fw_upload_image_t* pImage,
+                     bool bReadRequest, bool* pbDone);
+  // Time the firmware is given to lower CTS after the download
+  uint32 uiCtsTimeoutMs;
+} fw_upload_protocol_t;
+
 typedef enum {
   NXP_CHIPID_9098_A1 = 0x5C02,
   NXP_CHIPID_9098_A2 = 0x5C03,
@@ -197,13 +229,136 @@ typedef enum {
   NXP_CHIPID_9177_A1 = 0x7601
 } NXP_CHIPID;
 
-static soc_fw_name_dict_t soc_fw_name_dict[] = {
+/* Everything a download to one controller works with, see
+ * bt_vnd_mrvl_loader_create() */
+struct fw_upload_ctx {
+  int32 iFd;  // port of the controller
+  // Blocks that cannot be sent straight from the image are staged here,
+  // see fw_upload_ByteBuffer()
+  uint8* pByteBuffer;
+  uint32 uiByteBufferSize;
+  bool bNoMemory;
+  // A request could not be answered, see fw_upload_CtxWrite()
+  bool bWriteFailed;
+  // A chunk of a compressed image is corrupt, see fw_upload_CtxImageCopy()
+  bool bImageCorrupt;
+  uint8 fw_init_config_bin[FW_INIT_CONFIG_LEN];
+  /*FW config CMD5 needs to be sent before Helper and Firmware only once*/
+  bool send_fw_config_cmd5;
+
+  // Download baud rates, fastest first, see bt_vnd_mrvl_set_baud_ladder()
+  uint32 uiBaudLadder[FW_UPLOAD_MAX_BAUD_LADDER + 1];
+  uint32 uiBaudLadderLen;
+  uint32 uiBaudLadderCrcThreshold;
+  // Properties the download baud rate is stored in, see
+  // fw_upload_RememberBaudRate()
+  char szDlBaudProp[DL_BAUD_PROP_LEN];
+  char szDlClimbProp[DL_BAUD_PROP_LEN];
+  // Intervals between repeated pokes, see bt_vnd_mrvl_set_poke_backoff()
+  uint32 uiPokeBackoff[FW_UPLOAD_MAX_POKE_BACKOFF];
+  uint32 uiPokeBackoffLen;
+  // Timeout patch for the boot ROM, see bt_vnd_mrvl_set_rom_timeout_patch()
+  bool bRomTimeoutPatch;
+  // Progress reporting, see bt_vnd_mrvl_set_progress()
+  fw_upload_progress_cb_t pfnProgress;
+  void* pProgressCtx;
+  uint32 uiProgressIntervalMs;
+  char szProgressFile[MAX_PATH_LEN];
+  // When the port was opened, 0 once the bootloader has been heard from
+  uint64 ullPortOpenNs;
+  // Pokes sent since the port was opened
+  uint32 uiPokesSent;
+
+  // Image of the next download, see bt_vnd_mrvl_prepare_fw()
+  fw_upload_prep_t imagePrep;
+  // Name of the bundle image selected for the chip, empty if none
+  char szBundleImage[MAX_PATH_LEN];
+  int32 iBundleEntry;
+
+  // Bootloader found by the header signature wait, see fw_upload_CtxReset()
+  // and fwProtocols[]
+  Version uiProVer;
+  uint16 chip_id;
+  bool send_poke;
+  bool bVerChecked;
+  // Received Header
+  uint8 ucRcvdHeader;
+  // When the header of the request being answered was received
+  uint64 ullReqRcvdNs;
+  // Last 0xA7 request
+  uint16 uiNewLen;
+  uint32 ulNewOffset;
+  uint16 uiNewError;
+  uint8 uiNewCrc;
+
+  // State of the download in progress, see fw_upload_DownloadFw()
+  // Size of the File to be downloaded
+  uint32 uiTotalFileSize;
+  // Current size of the Download
+  uint32 ulCurrFileSize;
+  uint32 ulLastOffsetToSend;
+  // Image position of the block sent for ulLastOffsetToSend
+  uint32 ulLastBlockPos;
+  uint32 change_baudrate_buffer_len;
+  uint32 cmd7_change_timeout_len;
+  uint32 cmd5_len;
+  bool cmd7_Req;
+  bool EntryPoint_Req;
+  bool uiErrCase;
+  bool b16BytesData;
+  uint8 ucString[STRING_SIZE];
+  // Blocks of the V1 image and the one the bootloader asks for next
+  const fw_upload_block_t* pV1Blocks;
+  uint32 uiV1Blocks;
+  uint32 uiV1NextBlock;
+  // Baud rate the bootloader was switched to for this download, 0 if none
+  uint32 uiDlBaudRate;
+  // Rate the previous download stored, see fw_Change_Baudrate_Ladder()
+  uint32 uiDlBaudStored;
+  uint64 ullProgressStartNs;
+  uint64 ullProgressNextNs;
+  uint32 uiProgressBaud;
+
+  // Counters of the last download
+  // Number of blocks sent, reported with the RX counters
+  uint32 uiBlocksSent;
+  // CPU time spent in fw_upload_V3SendLenBytes
+  uint64 ullSendCpuNs;
+  // Per request latency and error counters of the V3 download
+  fw_upload_block_stats_t blockStats;
+  // Chunks the V1 bootloader asked for again
+  uint32 uiV1Resends;
+  // Outdated V1 requests skipped and the CPU time spent recovering
+  uint32 uiV1StaleRequests;
+  uint64 ullV1ResyncNs;
+  // Time spent waiting for the V2 helper and what fixed delays would take
+  uint64 ullPaceWaitNs;
+  uint32 uiPaceFixedMs;
+};
+
+/*================================ Global Vars================================*/
+// Context of the bt_vnd_mrvl_*() functions that do not take one, it uses
+// mchar_fd
+static fw_upload_ctx_t defaultCtx;
+static pthread_once_t defaultCtxOnce = PTHREAD_ONCE_INIT;
+// Bundle opened by bt_vnd_mrvl_open_fw_bundle(), mapped until exit
+static fw_upload_bundle_t fwBundle;
+static char szBundlePath[MAX_PATH_LEN];
+static const uint8 ucV1Ack = V1_REQUEST_ACK;
+// Header signatures the bootloaders start their messages with
+static const uint8 ucBootSignatures[] = {
+    V1_HEADER_DATA_REQ, V1_START_INDICATION, V2_HEADER_DATA_REQ,
+    V3_START_INDICATION, V3_HEADER_DATA_REQ};
+
+static const soc_fw_name_dict_t soc_fw_name_dict[] = {
     {NXP_CHIPID_9098_A1, "uart9098_bt_v1.bin"},
     {NXP_CHIPID_9098_A2, "uart9098_bt_v1.bin"},
     {NXP_CHIPID_9177_A0, "uartspi_n61x.bin"},
     {NXP_CHIPID_9177_A1, "uartspi_n61x_v1.bin"}};
 
-static uint8 uiErrCnt[16] = {0};
+/*============================ Function Prototypes ===========================*/
+static void fw_upload_PrepareFw(fw_upload_ctx_t* pCtx, int8* pFileName);
+static void fw_upload_ReleaseFw(fw_upload_ctx_t* pCtx);
 
 /*============================== Coded Procedures ============================*/
 #ifdef TEST_CODE
@@ -214,6 +369,7 @@ static uint8 ucTestDone = 0;
 static uint16 uiCurrLenToSend = 0;
 uint8 myCrcCorrByte, myChangeCrc = 0;
 static bool uiBaudRateDone = false;
+static uint8 ucCalCrc[10];
 
 char* get_time() {
   static char finalbuff[1000];
@@ -234,245 +390,232 @@ char* get_time() {
 
 #endif
 /******************************************************************************
-
  *
- * Name: gen_crc_table
+ * Name: fw_upload_SelectBundleImage
  *
  * Description:
- *   Generate crc table
+ *   This function picks the image of the chip from the firmware bundle and
+ *   starts preparing it.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   None.
+ *   uiChipId: chip ID of the V3 start indication.
  *
  * Return Value:
  *   None.
  *
  * Notes:
- *   None.
+ *   The image is named szBundleImage, which fw_loader_get_default_fw_name()
+ *   returns from now on. It is only prepared here if no other image is
+ *   being prepared; a helper is downloaded first.
  *
  *****************************************************************************/
-static void fw_upload_gen_crc_table() {
-  int i, j;
-  unsigned long crc_accum;
+static void fw_upload_SelectBundleImage(fw_upload_ctx_t* pCtx,
+                                        uint16 uiChipId) {
+  int32 iEntry;
 
-  for (i = 0; i < 256; i++) {
-    crc_accum = ((unsigned long)i << 24);
-    for (j = 0; j < 8; j++) {
-      if (crc_accum & 0x80000000L) {
-        crc_accum = (crc_accum << 1) ^ POLYNOMIAL;
-      } else {
-        crc_accum = (crc_accum << 1);
-      }
-    }
-    crc_table[i] = crc_accum;
+  if (fwBundle.pData == NULL) {
+    return;
   }
-
-  return;
-}
-
-/******************************************************************************
-
- *
- * Name: update_crc
- *
- * Description:
- *   update the CRC on the data block one byte at a time
- *
- * Conditions For Use:
- *   None.
- *
- * Arguments:
- *   ata_blk_ptr:   the buffer pointer for updating crc.
- *   data_blk_size: the size of buffer
- *
- * Return Value:
- *   CRC value.
- *
- * Notes:
- *   None.
- *
- *****************************************************************************/
-static unsigned long fw_upload_update_crc(unsigned long crc_accum,
-                                          uint8* data_blk_ptr,
-                                          uint32 data_blk_size) {
-  int i;
-  uint32 j;
-
-  for (j = 0; j < data_blk_size; j++) {
-    i = ((int)(crc_accum >> 24) ^ *data_blk_ptr++) & 0xff;
-    crc_accum = (crc_accum << 8) ^ crc_table[i];
+  iEntry = fw_upload_BundleFind(&fwBundle, uiChipId);
+  if (iEntry < 0) {
+    VND_LOGW("%s has no image for chip 0x%04x", szBundlePath, uiChipId);
+    pCtx->szBundleImage[0] = '\0';
+    pCtx->iBundleEntry = -1;
+    return;
   }
-  return crc_accum;
-}
-
-/******************************************************************************
- *
- * Name: init_crc8
- *
- * Description:
- *   This function init crc.
- *
- * Conditions For Use:
- *   None.
- *
- * Arguments:
- *   None.
- *
- * Return Value:
- *   None.
- *
- * Notes:
- *   None.
- *
- *****************************************************************************/
-void init_crc8(void) {
-  int i, j;
-  int crc;
-
-  if (!made_table) {
-    for (i = 0; i < 256; i++) {
-      crc = i;
-      for (j = 0; j < 8; j++) {
-        crc = (crc << 1) ^ ((crc & 0x80) ? DI : 0);
-      }
-      crc8_table[i] = (uint8)(crc & 0xFF);
-      /* VND_LOGV("table[%d] = %d (0x%X)", i, crc, crc); */
+  if ((iEntry != pCtx->iBundleEntry) || (pCtx->szBundleImage[0] == '\0')) {
+    // The name is passed on as a firmware file name, it must not be cut
+    if (snprintf(pCtx->szBundleImage, sizeof(pCtx->szBundleImage), "%s#%04x",
+                 szBundlePath, uiChipId) >= (int)sizeof(pCtx->szBundleImage)) {
+      VND_LOGE("Bundle path %s is too long to name its images",
+               szBundlePath);
+      pCtx->szBundleImage[0] = '\0';
+      pCtx->iBundleEntry = -1;
+      return;
     }
-    made_table = 1;
+    pCtx->iBundleEntry = iEntry;
+    VND_LOGI("Selected %s, image %d of the bundle", pCtx->szBundleImage,
+             iEntry);
   }
-}
-/******************************************************************************
- *
- * Name: crc8
- *
- * Description:
- *   This function calculate crc.
- *
- * Conditions For Use:
- *   None.
- *
- * Arguments:
- *   array: array to be calculated.
- *   len :  len of array.
- *
- * Return Value:
- *   None.
- *
- * Notes:
- *   None.
- *
- *****************************************************************************/
-static unsigned char crc8(unsigned char* array, unsigned char len) {
-  unsigned char CRC = 0xff;
-  for (; len > 0; len--) {
-    CRC = crc8_table[CRC ^ *array];
-    array++;
+  if (!pCtx->imagePrep.bStarted) {
+    fw_upload_PrepareFw(pCtx, pCtx->szBundleImage);
   }
-  return CRC;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_WaitForHeaderSignature(uint32 uiMs)
+ * Name: fw_upload_WaitForHeaderSignatureUntil
  *
  * Description:
  *   This function basically waits for reception
  *   of character 0xa5 on UART Rx. If no 0xa5 is
- *   received, it will kind of busy wait checking for
- *   0xa5.
+ *   received, it will sleep until more data arrives
+ *   or pDeadline expires.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   uiMs:   the expired time.
+ *   pDeadline:   when to give up waiting.
  *
  * Return Value:
- *   true:   0xa5 or 0xab is received.
- *   false:  0xa5 or 0xab is not received.
+ *   true:   0xa5, 0xaa, 0xa6, 0xab or 0xa7 is received.
+ *   false:  none of them is received.
  *
  * Notes:
- *   None.
+ *   The first signature after fw_upload_CtxReset() picks the protocol:
+ *   0xa5 the V1 bootloader, 0xa6 the V2 helper, 0xab and 0xa7 the V3
+ *   bootloader. 0xaa is sent by the V1 bootloader and the V2 helper alike,
+ *   the signature after it decides.
+ *   While the controller is to be poked, the poke is sent once, or again
+ *   after every interval of the backoff set with
+ *   bt_vnd_mrvl_set_poke_backoff(), the last interval repeating.
  *
  *****************************************************************************/
-static bool fw_upload_WaitForHeaderSignature(uint32 uiMs) {
+static bool fw_upload_WaitForHeaderSignatureUntil(
+    fw_upload_ctx_t* pCtx, const fw_upload_deadline_t* pDeadline) {
   uint8 ucDone = 0, payload_size;  // signature not Received Yet.
-  uint64 startTime = 0;
-  uint64 currTime = 0;
+  uint8 ucPayload[sizeof(uint32)];
+  int32 iSignature;
+  fw_upload_deadline_t stepDeadline;
   bool bResult = true;
   V3_START_IND v3_start_ind;
-  ucRcvdHeader = 0xFF;
-  startTime = fw_upload_GetTime();
+  uint64 ullNow;
+  uint64 ullNextPokeNs = 0;
+  uint32 uiPokeStep = 0;
+  uint32 uiStepMs;
+  pCtx->ucRcvdHeader = 0xFF;
   while (!ucDone) {
-    ucRcvdHeader = fw_upload_ComReadChar(mchar_fd);
-    if ((ucRcvdHeader == V1_HEADER_DATA_REQ) ||
-        (ucRcvdHeader == V1_START_INDICATION) ||
-        (ucRcvdHeader == V3_START_INDICATION) ||
-        (ucRcvdHeader == V3_HEADER_DATA_REQ)) {
+    // Skip anything in front of the next signature in one pass over the
+    // received data
+    iSignature = fw_upload_ComReadSignature(pCtx->iFd, ucBootSignatures,
+                                            sizeof(ucBootSignatures));
+    if (iSignature >= 0) {
+      pCtx->ullReqRcvdNs = fw_upload_GetTimeNs();
+      pCtx->ucRcvdHeader = (uint8)iSignature;
       ucDone = 1;
-      VND_LOGV("Received 0x%x ", ucRcvdHeader);
-      if (!bVerChecked) {
-        bVerChecked = true;
-        if ((ucRcvdHeader == V1_HEADER_DATA_REQ) ||
-            (ucRcvdHeader == V1_START_INDICATION)) {
-          uiProVer = Ver1;
+      VND_LOGV("Received 0x%x ", pCtx->ucRcvdHeader);
+      if (pCtx->ullPortOpenNs != 0) {
+        VND_LOGD("Bootloader contact %llu us after port open, %u pokes",
+                 (pCtx->ullReqRcvdNs - pCtx->ullPortOpenNs) / 1000,
+                 pCtx->uiPokesSent);
+        pCtx->ullPortOpenNs = 0;
+      }
+      if (!pCtx->bVerChecked &&
+          (pCtx->ucRcvdHeader != V1_START_INDICATION)) {
+        pCtx->bVerChecked = true;
+        if (pCtx->ucRcvdHeader == V1_HEADER_DATA_REQ) {
+          pCtx->uiProVer = Ver1;
+        } else if (pCtx->ucRcvdHeader == V2_HEADER_DATA_REQ) {
+          pCtx->uiProVer = Ver2;
         } else {
-          uiProVer = Ver3;
+          pCtx->uiProVer = Ver3;
           if (V3_START_INDICATION) {
             memset(&v3_start_ind, 0, sizeof(v3_start_ind));
             v3_start_ind.pkt_hdr = V3_START_INDICATION;
-            while (fw_upload_GetBufferSize(mchar_fd) <
-                   sizeof(v3_start_ind.pyld_buff)) {
-              usleep(1000);
-            };
-            VND_LOGD("Buffer size=%d", fw_upload_GetBufferSize(mchar_fd));
+            fw_upload_DeadlineInit(&stepDeadline, TIMEOUT_FOR_READ, NULL);
+            if (!fw_upload_WaitForBytesUntil(pCtx->iFd,
+                                             sizeof(v3_start_ind.pyld_buff),
+                                             &stepDeadline)) {
+              VND_LOGE("Timeout waiting for start indication payload");
+            }
+            VND_LOGD("Buffer size=%d", fw_upload_GetBufferSize(pCtx->iFd));
             payload_size = (uint8)(sizeof(v3_start_ind.pyld_buff & 0xFFU));
+            fw_upload_ComReadChars(pCtx->iFd, ucPayload, payload_size);
             for (uint8 i = 0; i < payload_size; i++) {
-              v3_start_ind.pyld_buff |=
-                  (uint32)((fw_upload_ComReadChar(mchar_fd) & 0xFF) << i * 8);
+              v3_start_ind.pyld_buff |= (uint32)ucPayload[i] << i * 8;
             }
             VND_LOGD("Payload data=%x", v3_start_ind.pyld_buff);
             if (v3_start_ind.uiCrc !=
-                crc8((uint8*)&v3_start_ind, sizeof(v3_start_ind) - 1)) {
+                fw_upload_crc8((uint8*)&v3_start_ind,
+                               sizeof(v3_start_ind) - 1)) {
               ucDone = 0;
-              bVerChecked = false;
-              send_poke = true;
-              tcflush(mchar_fd, TCIFLUSH);
+              pCtx->bVerChecked = false;
+              pCtx->send_poke = true;
+              fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
               VND_LOGE("CRC Check failed");
             } else {
-              chip_id = v3_start_ind.uiChipId;
-              VND_LOGD("Chip ID: 0x%x ", chip_id);
+              pCtx->chip_id = v3_start_ind.uiChipId;
+              VND_LOGD("Chip ID: 0x%x ", pCtx->chip_id);
+              fw_upload_SelectBundleImage(pCtx, pCtx->chip_id);
             }
           }
         }
       }
     } else {
-      if (uiMs) {
-        currTime = fw_upload_GetTime();
-        if ((currTime - startTime) > uiMs) {
-          VND_LOGE(
-              "fw_upload_WaitForHeaderSignature Timeout, Header Received: "
-              "0x%x, timeout %d, elapsed time %llu",
-              ucRcvdHeader, uiMs, (currTime - startTime));
-          bResult = false;
-          break;
-        }
+      if (fw_upload_DeadlineExpired(pDeadline)) {
+        VND_LOGE(
+            "fw_upload_WaitForHeaderSignature Timeout, Header Received: "
+            "0x%x, elapsed time %llu",
+            pCtx->ucRcvdHeader, fw_upload_DeadlineElapsedMs(pDeadline));
+        bResult = false;
+        break;
       }
-      if (enable_poke_controller && send_poke) {
-        fw_upload_ComWriteChars(mchar_fd, m_Buffer_Poke, 2);
-        VND_LOGD("Poke Sent");
-        send_poke = false;
+      uiStepMs = TIMEOUT_FOR_READ;
+      if (enable_poke_controller && pCtx->send_poke) {
+        ullNow = fw_upload_GetTimeNs();
+        if (ullNow >= ullNextPokeNs) {
+          fw_upload_ComWriteChars(pCtx->iFd, m_Buffer_Poke, 2);
+          pCtx->uiPokesSent++;
+          VND_LOGD("Poke Sent");
+          if (pCtx->uiPokeBackoffLen == 0) {
+            pCtx->send_poke = false;
+          } else {
+            ullNextPokeNs = ullNow + (uint64)pCtx->uiPokeBackoff[uiPokeStep] *
+                                         NSEC_PER_MSEC;
+            if (uiPokeStep + 1 < pCtx->uiPokeBackoffLen) {
+              uiPokeStep++;
+            }
+          }
+        }
+        if (pCtx->send_poke) {
+          uiStepMs = (uint32)((ullNextPokeNs - ullNow + NSEC_PER_MSEC - 1) /
+                              NSEC_PER_MSEC);
+        }
       }
-      fw_upload_DelayInMs(1);
+      // Sleep until the next byte arrives, the next poke is due or the
+      // budget runs out
+      fw_upload_DeadlineInit(&stepDeadline, uiStepMs, pDeadline);
+      fw_upload_WaitForBytesUntil(pCtx->iFd, 1, &stepDeadline);
     }
   }
-  send_poke = false;
+  pCtx->send_poke = false;
   return bResult;
 }
 
+/******************************************************************************
+ *
+ * Name: fw_upload_WaitForHeaderSignature(uint32 uiMs)
+ *
+ * Description:
+ *   Waits for a bootloader header for at most uiMs.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   uiMs:   the expired time, 0 to wait forever.
+ *
+ * Return Value:
+ *   true:   0xa5, 0xaa, 0xa6, 0xab or 0xa7 is received.
+ *   false:  none of them is received.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static bool fw_upload_WaitForHeaderSignature(fw_upload_ctx_t* pCtx,
+                                             uint32 uiMs) {
+  fw_upload_deadline_t deadline;
+
+  fw_upload_DeadlineInit(&deadline, uiMs ? uiMs : FW_UPLOAD_WAIT_FOREVER,
+                         NULL);
+  return fw_upload_WaitForHeaderSignatureUntil(pCtx, &deadline);
+}
+
 /******************************************************************************
  *
  * Name: fw_upload_WaitFor_Len
@@ -484,16 +627,20 @@ static bool fw_upload_WaitForHeaderSignature(uint32 uiMs) {
  *   None.
  *
  * Arguments:
- *   pFile: The handler of file
+ *   None.
  *
  * Return Value:
  *   2 Byte Length to send back to the Helper.
+ *   1 to start all over again: nothing arrived, the length failed its
+ *   complement or an 0xaa was acked.
  *
  * Notes:
- *   None.
+ *   0xa5 and 0xaa are acked, an 0xa6 request is acked by
+ *   fw_upload_WaitFor_ErrCode(). An 0xaa from the V2 helper means it
+ *   started over, the image is then sent again from its start.
  *
  *****************************************************************************/
-static uint16 fw_upload_WaitFor_Len(FILE* pFile) {
+static uint16 fw_upload_WaitFor_Len(fw_upload_ctx_t* pCtx) {
   // Length Variables
   uint16 uiLen = 0x0;
   uint16 uiLenComp = 0x0;
@@ -502,23 +649,31 @@ static uint16 fw_upload_WaitFor_Len(FILE* pFile) {
   // i.e 0xffff.
   uint16 uiXorOfLen = 0xFFFF;
 
-  while (fw_upload_GetBufferSize(mchar_fd) < 4) {
-    usleep(1000);
-  };
+  if (!fw_upload_WaitForBytes(pCtx->iFd, 4, TIMEOUT_FOR_READ)) {
+    VND_LOGE("Timeout waiting for bootloader length");
+    // Start all over again.
+    return 1;
+  }
   // Read the Lengths.
-  fw_upload_ComReadChars(mchar_fd, (uint8*)&uiLen, 2);
-  fw_upload_ComReadChars(mchar_fd, (uint8*)&uiLenComp, 2);
+  fw_upload_ComReadChars(pCtx->iFd, (uint8*)&uiLen, 2);
+  fw_upload_ComReadChars(pCtx->iFd, (uint8*)&uiLenComp, 2);
 
   // Check if the length is valid.
   if ((uiLen ^ uiLenComp) == uiXorOfLen)  // All 1's
   {
     VND_LOGV("bootloader asks for %d bytes", uiLen);
     // Successful. Send back the ack.
-    if ((ucRcvdHeader == V1_HEADER_DATA_REQ) ||
-        (ucRcvdHeader == V1_START_INDICATION)) {
-      fw_upload_ComWriteChar(mchar_fd, V1_REQUEST_ACK);
+    if ((pCtx->ucRcvdHeader == V1_HEADER_DATA_REQ) ||
+        (pCtx->ucRcvdHeader == V1_START_INDICATION)) {
+      // Sent together with the data block that answers the request
+      fw_upload_ComQueueChars(pCtx->iFd, &ucV1Ack, 1);
       VND_LOGV("BOOT_HEADER_ACK 0x5a is sent");
-      if (ucRcvdHeader == V1_START_INDICATION) {
+      if (pCtx->ucRcvdHeader == V1_START_INDICATION) {
+        if (pCtx->bVerChecked && (pCtx->uiProVer == Ver2)) {
+          VND_LOGV("Helper version %u started over", (uiLen >> 12) & 0xFU);
+          pCtx->ulCurrFileSize = 0;
+          pCtx->ulLastOffsetToSend = 0xFFFF;
+        }
         uiLen = 1;
       }
     }
@@ -526,13 +681,9 @@ static uint16 fw_upload_WaitFor_Len(FILE* pFile) {
     VND_LOGV("NAK case: bootloader LEN = %x bytes", uiLen);
     VND_LOGV("NAK case: bootloader LENComp = %x bytes", uiLenComp);
     // Failure due to mismatch.
-    fw_upload_ComWriteChar(mchar_fd, (int8)0xbf);
+    fw_upload_ComWriteChar(pCtx->iFd, (int8)REQUEST_NAK);
     // Start all over again.
-    if (pFile != NULL) {
-      uiLen = 1;
-    } else {
-      uiLen = 0;
-    }
+    uiLen = 1;
   }
   return uiLen;
 }
@@ -578,6 +729,8 @@ static void fw_upload_StoreBytes(uint32 ulVal, uint8 uiSize, uint8* uiStored) {
  *
  * Arguments:
  *   uiAck: the ack type.
+ *   pData: data block to send right after the ack, may be NULL.
+ *   uiDataLen: length of pData.
  *
  * Return Value:
  *   None.
@@ -586,216 +739,225 @@ static void fw_upload_StoreBytes(uint32 ulVal, uint8 uiSize, uint8* uiStored) {
  *   None.
  *
  *****************************************************************************/
-static void fw_upload_Send_Ack(uint8 uiAck) {
+static void fw_upload_Send_Ack(fw_upload_ctx_t* pCtx, uint8 uiAck,
+                               const uint8* pData, uint16 uiDataLen) {
   uint8 uiAckCrc = 0;
+  uint8 ucFrame[FW_UPLOAD_MAX_FRAME_LEN];
+  uint8 ucOffset[sizeof(pCtx->ulNewOffset)];
+  uint32 uiFrameLen = 0;
   if ((uiAck == V3_REQUEST_ACK) || (uiAck == V3_CRC_ERROR)) {
 #ifdef TEST_CODE
-    if (ucRcvdHeader == V3_START_INDICATION) {
+    if (pCtx->ucRcvdHeader == V3_START_INDICATION) {
       // prepare crc for 0x7A or 0x7C
       ucCalCrc[0] = uiAck;
-      uiAckCrc = crc8(ucCalCrc, 1);
+      uiAckCrc = fw_upload_crc8(ucCalCrc, 1);
 
       if (ucTestCase == 301 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, NOT send V3_REQUEST_ACK for Header Signature "
             "%02X, NOT send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 302 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, NOT send V3_REQUEST_ACK for Header Signature "
             "%02X, send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 303 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, send V3_REQUEST_ACK for Header Signature "
             "%02X, NOT send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         ucTestDone = 1;
       } else if (ucTestCase == 304 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, send V3_REQUEST_ACK for Header Signature "
             "%02X, send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 305 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  NOT send V3_REQUEST_ACK for Header Signature %02X, sleep "
             "%dms, send CRC byte",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 306 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, sleep "
             "%dms, NOT send CRC byte",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 307 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, sleep "
             "%dms, send CRC byte",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 308 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  NOT send V3_REQUEST_ACK for Header Signature %02X, send "
             "CRC byte, sleep %dms",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 309 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, NOT send "
             "CRC byte, sleep %dms",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 310 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, send CRC "
             "byte, sleep %dms",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else {
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
       }
 
     }
 
-    else if (ucRcvdHeader == V3_HEADER_DATA_REQ) {
+    else if (pCtx->ucRcvdHeader == V3_HEADER_DATA_REQ) {
       // prepare crc for 0x7A or 0x7C
       ucCalCrc[0] = uiAck;
-      uiAckCrc = crc8(ucCalCrc, 1);
+      uiAckCrc = fw_upload_crc8(ucCalCrc, 1);
 
       if (ucTestCase == 311 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, NOT send V3_REQUEST_ACK for Header Signature "
             "%02X, NOT send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 312 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, NOT send V3_REQUEST_ACK for Header Signature "
             "%02X, send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 313 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, send V3_REQUEST_ACK for Header Signature "
             "%02X, NOT send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         ucTestDone = 1;
       } else if (ucTestCase == 314 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Sleep %dms, send V3_REQUEST_ACK for Header Signature "
             "%02X, send CRC byte",
-            ucTestCase, ucSleepTimeMs, ucRcvdHeader);
+            ucTestCase, ucSleepTimeMs, pCtx->ucRcvdHeader);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 315 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  NOT send V3_REQUEST_ACK for Header Signature %02X, sleep "
             "%dms, send CRC byte",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 316 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, sleep "
             "%dms, NOT send CRC byte",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 317 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, sleep "
             "%dms, send CRC byte",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         ucTestDone = 1;
       } else if (ucTestCase == 318 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  NOT send V3_REQUEST_ACK for Header Signature %02X, send "
             "CRC byte, sleep %dms",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 319 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, NOT send "
             "CRC byte, sleep %dms",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 320 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send V3_REQUEST_ACK for Header Signature %02X, send CRC "
             "byte, sleep %dms",
-            ucTestCase, ucRcvdHeader, ucSleepTimeMs);
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+            ucTestCase, pCtx->ucRcvdHeader, ucSleepTimeMs);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else {
-        fw_upload_ComWriteChar(mchar_fd, uiAck);
-        fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAck);
+        fw_upload_ComWriteChar(pCtx->iFd, uiAckCrc);
       }
     }
+    if (uiDataLen != 0) {
+      fw_upload_ComWriteChars(pCtx->iFd, pData, uiDataLen);
+    }
 #else
-    fw_upload_ComWriteChar(mchar_fd, uiAck);
-
-    // prepare crc for 0x7A or 0x7C
-    ucCalCrc[0] = uiAck;
-    uiAckCrc = crc8(ucCalCrc, 1);
-    fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+    // 0x7A or 0x7C followed by its crc
+    uiFrameLen = fw_upload_BuildFrame(ucFrame, uiAck, NULL, 0);
 #endif
   } else if (uiAck == V3_TIMEOUT_ACK) {
-    fw_upload_ComWriteChar(mchar_fd, uiAck);
-
-    // prepare crc for 0x7B
-    ucCalCrc[0] = uiAck;
-    fw_upload_StoreBytes(ulNewOffset, sizeof(ulNewOffset), &ucCalCrc[1]);
-    fw_upload_ComWriteChars(mchar_fd, (uint8*)&ulNewOffset, 4);
-    uiAckCrc = crc8(ucCalCrc, 5);
-    fw_upload_ComWriteChar(mchar_fd, uiAckCrc);
+    // 0x7B, the offset and the crc over both
+    fw_upload_StoreBytes(pCtx->ulNewOffset, sizeof(pCtx->ulNewOffset),
+                         ucOffset);
+    uiFrameLen =
+        fw_upload_BuildFrame(ucFrame, uiAck, ucOffset, sizeof(ucOffset));
   } else {
     VND_LOGV("Non-empty else statement");
   }
+  if (uiFrameLen != 0) {
+    // The response and the data answering the request leave in one write
+    if (!fw_upload_ComWriteFrame(pCtx->iFd, ucFrame, uiFrameLen, pData,
+                                 uiDataLen)) {
+      VND_LOGE("Ack 0x%x with %u bytes not sent", uiAck, (uint32)uiDataLen);
+      pCtx->bWriteFailed = true;
+    }
+    uiAckCrc = ucFrame[uiFrameLen - 1];
+  }
   VND_LOGV(" ===> ACK = %x, CRC = %x ", uiAck, uiAckCrc);
 }
 /******************************************************************************
@@ -823,13 +985,13 @@ static bool fw_upload_Check_ReqCrc(uint8* uiStr, uint8 uiReq) {
   uint8 uiCalCrc;
 
   if (uiReq == V3_HEADER_DATA_REQ) {
-    uiCalCrc = crc8(uiStr, A6REQ_PAYLOAD_LEN + REQ_HEADER_LEN);
+    uiCalCrc = fw_upload_crc8(uiStr, A6REQ_PAYLOAD_LEN + REQ_HEADER_LEN);
     if (uiCalCrc != uiStr[A6REQ_PAYLOAD_LEN + REQ_HEADER_LEN]) {
       return false;
     }
 
   } else if (uiReq == V3_START_INDICATION) {
-    uiCalCrc = crc8(uiStr, AbREQ_PAYLOAD_LEN + REQ_HEADER_LEN);
+    uiCalCrc = fw_upload_crc8(uiStr, AbREQ_PAYLOAD_LEN + REQ_HEADER_LEN);
     if (uiCalCrc != uiStr[AbREQ_PAYLOAD_LEN + REQ_HEADER_LEN]) {
       return false;
     }
@@ -860,36 +1022,42 @@ static bool fw_upload_Check_ReqCrc(uint8* uiStr, uint8 uiReq) {
  *   None.
  *
  *****************************************************************************/
-static bool fw_upload_WaitFor_Req(uint32 iSecondBaudRate) {
+static bool fw_upload_WaitFor_Req(fw_upload_ctx_t* pCtx,
+                                  uint32 iSecondBaudRate) {
   uint16 uiChipId = 0;
   uint8 uiVersion = 0, uiReqCrc = 0, uiTmp[20] = {0};
   bool bCrcMatch = false;
   bool status = true;
 
-  if (ucRcvdHeader == V3_HEADER_DATA_REQ) {
-    while (fw_upload_GetBufferSize(mchar_fd) < 9) {
-      usleep(1000);
+  if (pCtx->ucRcvdHeader == V3_HEADER_DATA_REQ) {
+    if (!fw_upload_WaitForBytes(pCtx->iFd, A6REQ_PAYLOAD_LEN + 1,
+                                TIMEOUT_FOR_READ)) {
+      VND_LOGE("Timeout waiting for 0xA7 request payload");
+      return false;
     }
     // 0xA7 <LEN><Offset><ERR><CRC8>
-    fw_upload_ComReadChars(mchar_fd, (uint8*)&uiNewLen, 2);
-    fw_upload_ComReadChars(mchar_fd, (uint8*)&ulNewOffset, 4);
-    fw_upload_ComReadChars(mchar_fd, (uint8*)&uiNewError, 2);
-    fw_upload_ComReadChars(mchar_fd, (uint8*)&uiNewCrc, 1);
-    VND_LOGV(" <=== REQ = 0xA7, Len = %x,Off = %x,Err = %x,CRC = %x ", uiNewLen,
-             ulNewOffset, uiNewError, uiNewCrc);
+    fw_upload_ComReadChars(pCtx->iFd, (uint8*)&pCtx->uiNewLen, 2);
+    fw_upload_ComReadChars(pCtx->iFd, (uint8*)&pCtx->ulNewOffset, 4);
+    fw_upload_ComReadChars(pCtx->iFd, (uint8*)&pCtx->uiNewError, 2);
+    fw_upload_ComReadChars(pCtx->iFd, (uint8*)&pCtx->uiNewCrc, 1);
+    VND_LOGV(
+        " <=== REQ = 0xA7, Len = %x,Off = %x,Err = %x,CRC = %x ",
+        pCtx->uiNewLen, pCtx->ulNewOffset, pCtx->uiNewError, pCtx->uiNewCrc);
     // check crc
     uiTmp[0] = V3_HEADER_DATA_REQ;
-    fw_upload_StoreBytes((uint32)uiNewLen, sizeof(uiNewLen), &uiTmp[1]);
-    fw_upload_StoreBytes(ulNewOffset, sizeof(ulNewOffset), &uiTmp[3]);
-    fw_upload_StoreBytes(uiNewError, sizeof(uiNewError), &uiTmp[7]);
-    uiTmp[9] = uiNewCrc;
+    fw_upload_StoreBytes((uint32)pCtx->uiNewLen, sizeof(pCtx->uiNewLen),
+                         &uiTmp[1]);
+    fw_upload_StoreBytes(pCtx->ulNewOffset, sizeof(pCtx->ulNewOffset),
+                         &uiTmp[3]);
+    fw_upload_StoreBytes(pCtx->uiNewError, sizeof(pCtx->uiNewError), &uiTmp[7]);
+    uiTmp[9] = pCtx->uiNewCrc;
     bCrcMatch = fw_upload_Check_ReqCrc(uiTmp, V3_HEADER_DATA_REQ);
 
 #ifdef TEST_CODE
 
     if (ucTestCase == 331 && !ucTestDone) {
       VND_LOGV("TC-%d:  Simulate Device CRC error on Header Signature 0x%X",
-               ucTestCase, ucRcvdHeader);
+               ucTestCase, pCtx->ucRcvdHeader);
       bCrcMatch = 0;
       ucTestDone = 1;
     }
@@ -898,14 +1066,20 @@ static bool fw_upload_WaitFor_Req(uint32 iSecondBaudRate) {
 
     if (!bCrcMatch) {
       VND_LOGV(" === REQ = 0xA7, CRC Mismatched === ");
-      fw_upload_Send_Ack(V3_CRC_ERROR);
+      pCtx->blockStats.uiCrcErrors++;
+      fw_upload_Send_Ack(pCtx, V3_CRC_ERROR, NULL, 0);
       status = false;
     }
-  } else if (ucRcvdHeader == V3_START_INDICATION) {
+  } else if (pCtx->ucRcvdHeader == V3_START_INDICATION) {
+    if (!fw_upload_WaitForBytes(pCtx->iFd, AbREQ_PAYLOAD_LEN + 1,
+                                TIMEOUT_FOR_READ)) {
+      VND_LOGE("Timeout waiting for 0xAB request payload");
+      return false;
+    }
     // 0xAB <CHIP ID> <SW loader REV 1 byte> <CRC8>
-    fw_upload_ComReadChars(mchar_fd, (uint8*)&uiChipId, 2);
-    uiVersion = fw_upload_ComReadChar(mchar_fd);
-    uiReqCrc = fw_upload_ComReadChar(mchar_fd);
+    fw_upload_ComReadChars(pCtx->iFd, (uint8*)&uiChipId, 2);
+    uiVersion = fw_upload_ComReadChar(pCtx->iFd);
+    uiReqCrc = fw_upload_ComReadChar(pCtx->iFd);
     VND_LOGV("ChipID is : %x, Version is : %x", uiChipId, uiVersion);
 
     // check crc
@@ -919,7 +1093,7 @@ static bool fw_upload_WaitFor_Req(uint32 iSecondBaudRate) {
 
     if (ucTestCase == 330 && !ucTestDone) {
       VND_LOGV("TC-%d:  Simulate Device CRC error on Header Signature 0x%X",
-               ucTestCase, ucRcvdHeader);
+               ucTestCase, pCtx->ucRcvdHeader);
       bCrcMatch = 0;
       ucTestDone = 1;
     }
@@ -928,13 +1102,13 @@ static bool fw_upload_WaitFor_Req(uint32 iSecondBaudRate) {
 
     if (bCrcMatch) {
       VND_LOGV(" === REQ = 0xAB, CRC Matched === ");
-      fw_upload_Send_Ack(V3_REQUEST_ACK);
+      fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, NULL, 0);
       if (iSecondBaudRate == 0) {
         status = false;
       }
     } else {
       VND_LOGV(" === REQ = 0xAB, CRC Mismatched === ");
-      fw_upload_Send_Ack(V3_CRC_ERROR);
+      fw_upload_Send_Ack(pCtx, V3_CRC_ERROR, NULL, 0);
       status = false;
     }
   } else {
@@ -945,164 +1119,157 @@ static bool fw_upload_WaitFor_Req(uint32 iSecondBaudRate) {
 
 /******************************************************************************
  *
- * Name: fw_upload_GetCmd
+ * Name: fw_upload_ScanRequests
  *
  * Description:
- *   This function gets CMD value in the header.
+ *   Scans uiLen received bytes for V1 data requests, that is an 0xa5
+ *   followed by a length and its complement.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   *buf: buffer that stores header and following data.
+ *   pData   : Received bytes.
+ *   uiLen   : Number of bytes in pData.
+ *   pLast   : Offset of the last request found, untouched if there is none.
+ *   pCount  : Incremented for every request found.
  *
  * Return Value:
- *   CMD value part in the buffer.
+ *   Number of leading bytes that can be consumed: everything up to the end
+ *   of the last request, or up to the last 4 bytes if no request was found
+ *   since those may begin one whose tail has not arrived yet.
  *
  * Notes:
- *   None.
+ *   A request found is skipped as a whole, so length bytes equal to 0xa5
+ *   are never mistaken for the start of the next one.
  *
  *****************************************************************************/
-static uint32 fw_upload_GetCmd(uint8* buf) {
-  return (uint32)(buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24));
+static uint32 fw_upload_ScanRequests(const uint8* pData, uint32 uiLen,
+                                     uint32* pLast, uint32* pCount) {
+  uint32 uiPos = 0;
+  uint32 uiEnd = 0;
+  uint16 uiReqLen;
+  uint16 uiReqComp;
+
+  while (uiPos + 5 <= uiLen) {
+    if (pData[uiPos] == V1_HEADER_DATA_REQ) {
+      uiReqLen = (uint16)(pData[uiPos + 1] | (pData[uiPos + 2] << 8));
+      uiReqComp = (uint16)(pData[uiPos + 3] | (pData[uiPos + 4] << 8));
+      if ((uiReqLen ^ uiReqComp) == 0xFFFF) {
+        *pLast = uiPos;
+        (*pCount)++;
+        uiPos += 5;
+        uiEnd = uiPos;
+        continue;
+      }
+    }
+    uiPos++;
+  }
+  if ((uiEnd == 0) && (uiLen > 4)) {
+    uiEnd = uiLen - 4;
+  }
+  return uiEnd;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_GetHeaderStartBytes
+ * Name: fw_upload_GetLastRequest
  *
  * Description:
- *   This function gets 0xa5 and it's following 4 bytes length.
+ *   This function gets the last valid request into ucString and drops the
+ *   stale ones the bootloader sent before it.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   None.
+ *   *buf: buffer that stores header and following data.
  *
  * Return Value:
  *   None.
  *
  * Notes:
- *   None.
+ *   Blocks until a request has been received. The whole backlog is then
+ *   scanned in FW_V1_SCAN_LEN byte windows peeked from the RX ring and
+ *   consumed up to the end of the last request, a partial request behind
+ *   it is left for the next call. uiErrCase is cleared only when the
+ *   backlog held exactly one request asking for the header or the data
+ *   of buf.
  *
-
-*****************************************************************************/
-static void fw_upload_GetHeaderStartBytes(uint8* ucStr) {
-  bool ucDone = false;
-  uint8 ucStringCnt = 0, i;
-  while (!ucDone) {
-    ucRcvdHeader = fw_upload_ComReadChar(mchar_fd);
-
-    if (ucRcvdHeader == V1_HEADER_DATA_REQ) {
-      ucStr[ucStringCnt++] = ucRcvdHeader;
-      ucDone = true;
-      VND_LOGV("Received 0x%x ", ucRcvdHeader);
-    } else {
-      fw_upload_DelayInMs(1);
+ *****************************************************************************/
+static void fw_upload_GetLastRequest(fw_upload_ctx_t* pCtx, const uint8* buf) {
+  uint8 ucScan[FW_V1_SCAN_LEN];
+  uint32 uiAvail;
+  uint32 uiUsed;
+  uint32 uiLast = 0;
+  uint32 uiFound = 0;
+  uint32 uiCount;
+  uint32 uiDropped = 0;
+  uint16 uiReqLen = 0;
+  uint64 ullStartNs = fw_upload_GetCpuTimeNs();
+
+  do {
+    while (!fw_upload_WaitForBytes(pCtx->iFd, 5, TIMEOUT_FOR_READ)) {
+      VND_LOGE("Still waiting for 0xa5 after %d ms", TIMEOUT_FOR_READ);
     }
-  }
-  while (fw_upload_GetBufferSize(mchar_fd) < 4) {
-    usleep(1000);
-  };
-  for (i = 0; i < 4; i++) {
-    ucRcvdHeader = fw_upload_ComReadChar(mchar_fd);
-    ucStr[ucStringCnt++] = ucRcvdHeader;
+    do {
+      uiAvail = fw_upload_ComPeekChars(pCtx->iFd, ucScan, FW_V1_SCAN_LEN);
+      uiCount = uiFound;
+      uiUsed = fw_upload_ScanRequests(ucScan, uiAvail, &uiLast, &uiFound);
+      if (uiFound > uiCount) {
+        memcpy(pCtx->ucString, &ucScan[uiLast], 5);
+      }
+      fw_upload_ComSkipChars(pCtx->iFd, uiUsed);
+      uiDropped += uiUsed;
+    } while (uiAvail == FW_V1_SCAN_LEN);
+  } while (uiFound == 0);
+  pCtx->ucRcvdHeader = V1_HEADER_DATA_REQ;
+  uiDropped -= 5;
+
+  fw_upload_lenValid(&uiReqLen, pCtx->ucString);
+  if ((uiFound == 1) && (uiDropped == 0) &&
+      ((uiReqLen == HDR_LEN) || (uiReqLen == fw_upload_GetDataLen(buf)))) {
+    pCtx->uiErrCase = false;
+  } else {
+    pCtx->uiErrCase = true;
+    pCtx->uiV1StaleRequests += uiFound - 1;
+    pCtx->ullV1ResyncNs += fw_upload_GetCpuTimeNs() - ullStartNs;
+    VND_LOGD("Resync: %u stale requests in %u bytes dropped, length %u",
+             uiFound - 1, uiDropped, uiReqLen);
   }
 }
+
 /******************************************************************************
  *
- * Name: fw_upload_GetLast5Bytes
+ * Name: fw_upload_CtxWrite
  *
  * Description:
- *   This function gets last valid request.
+ *   Writes uiLen bytes answering a request to the port of the download.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   *buf: buffer that stores header and following data.
+ *   pCtx:  the loader context of the download.
+ *   pBuf:  bytes to write.
+ *   uiLen: number of bytes.
  *
  * Return Value:
- *   None.
+ *   true if the bytes were written.
  *
  * Notes:
- *   None.
+ *   A failed write sets bWriteFailed, which ends the download instead of
+ *   waiting for an answer to bytes that were never sent.
  *
-
-*****************************************************************************/
-static void fw_upload_GetLast5Bytes(uint8* buf) {
-  uint8 a5cnt, i;
-  uint8 ucTemp[STRING_SIZE];
-  uint16 uiTempLen = 0;
-  uint32 fifosize;
-  bool alla5times = false;
-  bool uiTempLenCheck = false;
-  // initialise
-  memset(ucString, 0x00, STRING_SIZE);
-
-  fifosize = fw_upload_GetBufferSize(mchar_fd);
-
-  fw_upload_GetHeaderStartBytes(ucString);
-  if (fw_upload_lenValid(&uiTempLen, ucString) == true) {
-    // Valid length received
-    VND_LOGV(" Valid length = %d ", uiTempLen);
-  }
-  if (fifosize < 6) {
-    if (uiTempLen != HDR_LEN) {
-      uint16 req_datalen = fw_upload_GetDataLen(buf);
-      if (uiTempLen == req_datalen) {
-        uiTempLenCheck = true;
-      }
-    } else {
-      uiTempLenCheck = true;
-    }
-  }
-
-  if (uiTempLenCheck == true) {
-    VND_LOGV("=========>success case fifo size= %d", fifosize);
-    uiErrCase = false;
-  } else  // start to get last valid 5 bytes
-  {
-    VND_LOGV("=========>fail case fifo size= %d ", fifosize);
-    while (fw_upload_lenValid(&uiTempLen, ucString) == false) {
-      fw_upload_GetHeaderStartBytes(ucString);
-      fifosize -= 5;
-    }
-    VND_LOGV("Error cases 1, 2, 3, 4, 5...");
-    if (fifosize > 5) {
-      fifosize -= 5;
-      do {
-        do {
-          a5cnt = 0;
-          do {
-            fw_upload_GetHeaderStartBytes(ucTemp);
-            fifosize -= 5;
-          } while ((fw_upload_lenValid(&uiTempLen, ucTemp) == true) &&
-                   (!alla5times) && (fifosize > 5));
-          // if 5bytes are all 0xa5, continue to clear 0xa5
-          for (i = 0; i < 5; i++) {
-            if (ucTemp[i] == V1_HEADER_DATA_REQ) {
-              a5cnt++;
-            }
-          }
-          alla5times = true;
-        } while (a5cnt == 5);
-        VND_LOGV("a5 count in last 5 bytes: %d", a5cnt);
-        if (fw_upload_lenValid(&uiTempLen, ucTemp) == false) {
-          for (i = 0; i < (5 - a5cnt); i++) {
-            ucTemp[i + a5cnt] = fw_upload_ComReadChar(mchar_fd);
-          }
-          if (a5cnt > 0) {
-            memcpy(ucString, &ucTemp[a5cnt - 1], (5 - a5cnt) * sizeof(uint8));
-          }
-        } else {
-          memcpy(ucString, ucTemp, 5 * sizeof(uint8));
-        }
-      } while (fw_upload_lenValid(&uiTempLen, ucTemp) == false);
-    }
-    uiErrCase = true;
+ *****************************************************************************/
+static bool fw_upload_CtxWrite(fw_upload_ctx_t* pCtx, const uint8* pBuf,
+                               uint32 uiLen) {
+  if (!fw_upload_ComWriteChars(pCtx->iFd, pBuf, uiLen)) {
+    VND_LOGE("Write of %u bytes to the bootloader failed", uiLen);
+    pCtx->bWriteFailed = true;
+    return false;
   }
+  return true;
 }
 
 /******************************************************************************
@@ -1120,14 +1287,15 @@ static void fw_upload_GetLast5Bytes(uint8* buf) {
  *            ucBuf: the buf to be sent.
  *   uiHighBaudrate: send the buffer for high baud rate change.
  * Return Value:
- *   Returns the len of next header request.
+ *   Returns the len of next header request, 0 with bWriteFailed set if the
+ *   buffer could not be written.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-static uint16 fw_upload_SendBuffer(uint16 uiLenToSend, uint8* ucBuf,
-                                   bool uiHighBaudrate) {
+static uint16 fw_upload_SendBuffer(fw_upload_ctx_t* pCtx, uint16 uiLenToSend,
+                                   const uint8* ucBuf, bool uiHighBaudrate) {
   uint16 uiBytesToSend = HDR_LEN, uiFirstChunkSent = 0;
   uint16 uiDataLen = 0;
   uint8 ucSentDone = 0;
@@ -1138,21 +1306,23 @@ static uint16 fw_upload_SendBuffer(uint16 uiLenToSend, uint8* ucBuf,
   while (!ucSentDone) {
     if (uiBytesToSend == uiLenToSend) {
       // All good
-      if ((uiBytesToSend == HDR_LEN) && (!b16BytesData)) {
+      if ((uiBytesToSend == HDR_LEN) && (!pCtx->b16BytesData)) {
         if ((uiFirstChunkSent == 0) ||
-            ((uiFirstChunkSent == 1) && (uiErrCase == true))) {
+            ((uiFirstChunkSent == 1) && (pCtx->uiErrCase == true))) {
           // Write first 16 bytes of buffer
           VND_LOGV("====>  Sending first chunk...");
           VND_LOGV("====>  Sending %d bytes...", uiBytesToSend);
-          fw_upload_ComWriteChars(mchar_fd, (uint8*)ucBuf, uiBytesToSend);
-          if (cmd7_Req == true || EntryPoint_Req == true) {
+          if (!fw_upload_CtxWrite(pCtx, ucBuf, uiBytesToSend)) {
+            return 0;
+          }
+          if (pCtx->cmd7_Req == true || pCtx->EntryPoint_Req == true) {
             uiBytesToSend = HDR_LEN;
             uiFirstChunkSent = 1;
           } else {
             uiBytesToSend = uiDataLen;
             uiFirstChunkSent = 0;
             if (uiBytesToSend == HDR_LEN) {
-              b16BytesData = true;
+              pCtx->b16BytesData = true;
             }
           }
         } else {
@@ -1164,12 +1334,13 @@ static uint16 fw_upload_SendBuffer(uint16 uiLenToSend, uint8* ucBuf,
         // Write remaining bytes
         VND_LOGV("====>  Sending %d bytes...", uiBytesToSend);
         if (uiBytesToSend != 0) {
-          fw_upload_ComWriteChars(mchar_fd, (uint8*)&ucBuf[HDR_LEN],
-                                  uiBytesToSend);
+          if (!fw_upload_CtxWrite(pCtx, &ucBuf[HDR_LEN], uiBytesToSend)) {
+            return 0;
+          }
           uiFirstChunkSent = 1;
           // We should expect 16, then next block will start
           uiBytesToSend = HDR_LEN;
-          b16BytesData = false;
+          pCtx->b16BytesData = false;
           if (uiHighBaudrate) {
             return 0;
           }
@@ -1186,14 +1357,19 @@ static uint16 fw_upload_SendBuffer(uint16 uiLenToSend, uint8* ucBuf,
         if (uiLenToSend == (HDR_LEN + 1)) {
           // Send first chunk again
           VND_LOGV("1. Resending first chunk...");
-          fw_upload_ComWriteChars(mchar_fd, (uint8*)ucBuf, (uiLenToSend - 1));
+          pCtx->uiV1Resends++;
+          if (!fw_upload_CtxWrite(pCtx, ucBuf, (uiLenToSend - 1))) {
+            return 0;
+          }
           uiBytesToSend = uiDataLen;
           uiFirstChunkSent = 0;
         } else if (uiLenToSend == (uiDataLen + 1)) {
           // Send second chunk again
           VND_LOGV("2. Resending second chunk...");
-          fw_upload_ComWriteChars(mchar_fd, (uint8*)&ucBuf[HDR_LEN],
-                                  (uiLenToSend - 1));
+          pCtx->uiV1Resends++;
+          if (!fw_upload_CtxWrite(pCtx, &ucBuf[HDR_LEN], (uiLenToSend - 1))) {
+            return 0;
+          }
           uiBytesToSend = HDR_LEN;
           uiFirstChunkSent = 1;
         } else {
@@ -1203,29 +1379,33 @@ static uint16 fw_upload_SendBuffer(uint16 uiLenToSend, uint8* ucBuf,
       } else if (uiLenToSend == HDR_LEN) {
         // Out of sync. Restart sending buffer
         VND_LOGV("Restart sending the 1st chunk...");
-        fw_upload_ComWriteChars(mchar_fd, (uint8*)ucBuf, uiLenToSend);
+        if (!fw_upload_CtxWrite(pCtx, ucBuf, uiLenToSend)) {
+          return 0;
+        }
         uiBytesToSend = uiDataLen;
         uiFirstChunkSent = 0;
       } else if (uiLenToSend == uiDataLen) {
         VND_LOGV("Restart sending 2nd chunk...");
-        fw_upload_ComWriteChars(mchar_fd, (uint8*)&ucBuf[HDR_LEN], uiLenToSend);
+        if (!fw_upload_CtxWrite(pCtx, &ucBuf[HDR_LEN], uiLenToSend)) {
+          return 0;
+        }
         uiBytesToSend = HDR_LEN;
         uiFirstChunkSent = 1;
       } else {
         VND_LOGV("Non-empty else statement uiLenToSend = %d", uiLenToSend);
       }
     }
-    // Get last 5 bytes now
-    fw_upload_GetLast5Bytes(ucBuf);
+    // Get the last request, dropping stale ones
+    fw_upload_GetLastRequest(pCtx, ucBuf);
     // Get next length
     uiValidLen = false;
     do {
-      if (fw_upload_lenValid(&uiLenToSend, ucString) == true) {
+      if (fw_upload_lenValid(&uiLenToSend, pCtx->ucString) == true) {
         // Valid length received
         uiValidLen = true;
         VND_LOGV(" Valid length = %d ", uiLenToSend);
-        // ACK the bootloader
-        fw_upload_ComWriteChar(mchar_fd, V1_REQUEST_ACK);
+        // ACK the bootloader along with the next chunk
+        fw_upload_ComQueueChars(pCtx->iFd, &ucV1Ack, 1);
         VND_LOGV("  BOOT_HEADER_ACK 0x5a sent ");
       }
     } while (!uiValidLen);
@@ -1236,123 +1416,513 @@ static uint16 fw_upload_SendBuffer(uint16 uiLenToSend, uint8* ucBuf,
 
 /******************************************************************************
  *
- * Name: fw_upload_V1SendLenBytes
+ * Name: fw_upload_ByteBuffer
  *
  * Description:
- *   This function sends Len bytes(header+data) to the boot code.
+ *   Returns the staging buffer of the download, with room for uiLen bytes.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   pFile: bin file being sent.
- *   uiLenTosend: the length will be sent.
+ *   pCtx:  the loader context of the download.
+ *   uiLen: bytes needed.
  *
  * Return Value:
- *   the 'len' of next header request.
+ *   The buffer, NULL if there is no memory for it.
  *
  * Notes:
- *   None.
+ *   The buffer only grows to the largest block staged so far and is freed
+ *   by fw_upload_ReleaseFw() once the download is over. Bytes already in it
+ *   are kept when it grows. Running out of memory sets bNoMemory, which
+ *   ends the download.
  *
  *****************************************************************************/
-static uint16 fw_upload_V1SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend) {
-  uint16 ucDataLen, uiLen;
-  uint32 ulCmd;
-  memset(ucByteBuffer, 0, sizeof(ucByteBuffer));
+static uint8* fw_upload_ByteBuffer(fw_upload_ctx_t* pCtx, uint32 uiLen) {
+  uint8* pGrown;
 
-  cmd7_Req = false;
-  EntryPoint_Req = false;
+  if (uiLen <= pCtx->uiByteBufferSize) {
+    return pCtx->pByteBuffer;
+  }
+  pGrown = (uint8*)realloc(pCtx->pByteBuffer, uiLen);
+  if (pGrown == NULL) {
+    VND_LOGE("No memory to stage a block of %u bytes", uiLen);
+    pCtx->bNoMemory = true;
+    return NULL;
+  }
+  pCtx->pByteBuffer = pGrown;
+  pCtx->uiByteBufferSize = uiLen;
+  return pGrown;
+}
 
-  if (ulCurrFileSize + uiLenToSend > uiTotalFileSize)
-    uiLenToSend = (uint16)(uiTotalFileSize - ulCurrFileSize);
+/******************************************************************************
+ *
+ * Name: fw_upload_CtxImageCopy
+ *
+ * Description:
+ *   Copies up to uiLen bytes of the image at ulPos for the download.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx:   the loader context of the download.
+ *   pImage: image being sent.
+ *   ulPos:  image position.
+ *   uiLen:  bytes wanted, fewer are copied where the image ends.
+ *   pDst:   receives the bytes.
+ *
+ * Return Value:
+ *   true, or false if the bytes of a compressed image do not decompress.
+ *
+ * Notes:
+ *   The chunks of a compressed image are only checked when they are first
+ *   decompressed, here. A corrupt one sets bImageCorrupt, which ends the
+ *   download.
+ *
+ *****************************************************************************/
+static bool fw_upload_CtxImageCopy(fw_upload_ctx_t* pCtx,
+                                   const fw_upload_image_t* pImage,
+                                   uint32 ulPos, uint32 uiLen, uint8* pDst) {
+  uint32 uiAvail = (ulPos < pImage->uiSize) ? (pImage->uiSize - ulPos) : 0;
 
-  memcpy(&ucByteBuffer[uiLenToSend] - uiLenToSend, pFileBuffer + ulCurrFileSize,
-         uiLenToSend);
-  ulCurrFileSize += uiLenToSend;
-  ulCmd = fw_upload_GetCmd(ucByteBuffer);
-  if (ulCmd == CMD7) {
-    cmd7_Req = true;
-    ucDataLen = 0;
-  } else {
-    ucDataLen = fw_upload_GetDataLen(ucByteBuffer);
-    memcpy(&ucByteBuffer[uiLenToSend], pFileBuffer + ulCurrFileSize, ucDataLen);
-    ulCurrFileSize += ucDataLen;
-    if ((ulCurrFileSize < uiTotalFileSize) &&
-        (ulCmd == CMD6 || ulCmd == CMD4)) {
-      EntryPoint_Req = true;
-    }
+  if (uiAvail > uiLen) {
+    uiAvail = uiLen;
   }
-#ifdef DEBUG_PRINT
-  VND_LOGV("The buffer is to be sent: %d", uiLenToSend + ucDataLen);
-  for (int i = 0; i < (uiLenToSend + ucDataLen); i++) {
-    if (i % 16 == 0) {
-      VND_LOGV("\n");
-    }
-    VND_LOGV(" %02x ", ucByteBuffer[i]);
+  if (fw_upload_ImageCopy(pImage, ulPos, uiLen, pDst) < uiAvail) {
+    VND_LOGE("Image data at %u does not decompress", ulPos);
+    pCtx->bImageCorrupt = true;
+    return false;
   }
-#endif
-  // start to send Temp buffer
-  uiLen = fw_upload_SendBuffer(uiLenToSend, ucByteBuffer, false);
-  VND_LOGV("File downloaded: %8u:%8u\r", ulCurrFileSize, uiTotalFileSize);
+  return true;
+}
 
-  return uiLen;
+/******************************************************************************
+ *
+ * Name: fw_upload_ImageBlock
+ *
+ * Description:
+ *   Returns the uiLen bytes of the image at ulPos.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx:   the loader context of the download.
+ *   pImage: image being sent.
+ *   ulPos:  position of the block in the image.
+ *   uiLen:  the length of the block.
+ *
+ * Return Value:
+ *   Pointer into the image, or to pByteBuffer when the block runs past the
+ *   end of the image or spans chunks of a compressed image. NULL if there
+ *   is no memory to stage it or it does not decompress.
+ *
+ * Notes:
+ *   A block that is cut off by the end of the image is staged, padded with
+ *   zeros. Blocks of an uncompressed image need no staging buffer.
+ *
+ *****************************************************************************/
+static const uint8* fw_upload_ImageBlock(fw_upload_ctx_t* pCtx,
+                                         const fw_upload_image_t* pImage,
+                                         uint32 ulPos, uint32 uiLen) {
+  const uint8* pBlock;
+  uint8* pStage = NULL;
+
+  if (pImage->pLz != NULL) {
+    pStage = fw_upload_ByteBuffer(pCtx, uiLen);
+    if (pStage == NULL) {
+      return NULL;
+    }
+  }
+  pBlock = fw_upload_ImageRead(pImage, ulPos, uiLen, pStage);
+  if (pBlock != NULL) {
+    return pBlock;
+  }
+  pStage = fw_upload_ByteBuffer(pCtx, uiLen);
+  if (pStage == NULL) {
+    return NULL;
+  }
+  memset(pStage, 0, uiLen);
+  if (!fw_upload_CtxImageCopy(pCtx, pImage, ulPos, uiLen, pStage)) {
+    return NULL;
+  }
+  VND_LOGE("Block at %u len %u exceeds image size %u", ulPos, uiLen,
+           pCtx->uiTotalFileSize);
+  return pStage;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_V3SendLenBytes
+ * Name: fw_upload_V1SendLenBytes
  *
  * Description:
- *   This function sends Len bytes to the Helper.
+ *   This function sends Len bytes(header+data) to the boot code.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   pFile: bin file being sent.
+ *   pImage: image being sent.
  *   uiLenTosend: the length will be sent.
- *   ulOffset: the offset of current sending.
  *
  * Return Value:
- *   None.
+ *   the 'len' of next header request.
  *
  * Notes:
- *   None.
+ *   A request for the header of the next block in pV1Blocks is answered
+ *   straight from the image; any other request is staged in pByteBuffer.
+ *   Returns 0 with bNoMemory set if there is no memory to stage it, with
+ *   bImageCorrupt set if it does not decompress, or with bWriteFailed set
+ *   if it could not be written.
  *
  *****************************************************************************/
-static void fw_upload_V3SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend,
-                                     uint32 ulOffset) {
-  // Retransmition of previous block
-  if (ulOffset == ulLastOffsetToSend) {
-    VND_LOGV("Resend offset %d...", ulOffset);
-    fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+static uint16 fw_upload_V1SendLenBytes(fw_upload_ctx_t* pCtx,
+                                       const fw_upload_image_t* pImage,
+                                       uint16 uiLenToSend) {
+  const fw_upload_block_t* pBlock = NULL;
+  const uint8* pBuf;
+  uint8* pStage;
+  uint16 ucDataLen, uiLen;
+  uint32 ulCmd;
+
+  pCtx->cmd7_Req = false;
+  pCtx->EntryPoint_Req = false;
+
+  // Skip blocks passed by requests that did not match the index
+  while ((pCtx->uiV1NextBlock < pCtx->uiV1Blocks) &&
+         (pCtx->pV1Blocks[pCtx->uiV1NextBlock].ulOffset <
+          pCtx->ulCurrFileSize)) {
+    pCtx->uiV1NextBlock++;
+  }
+  if ((pCtx->uiV1NextBlock < pCtx->uiV1Blocks) &&
+      (pCtx->pV1Blocks[pCtx->uiV1NextBlock].ulOffset ==
+       pCtx->ulCurrFileSize) &&
+      (pCtx->pV1Blocks[pCtx->uiV1NextBlock].uiHdrLen == uiLenToSend)) {
+    pBlock = &pCtx->pV1Blocks[pCtx->uiV1NextBlock++];
+  }
+
+  if (pBlock != NULL) {
+    // Header and data follow each other in the image, send them from there
+    pBuf = fw_upload_ImageBlock(pCtx, pImage, pBlock->ulOffset,
+                                uiLenToSend + pBlock->uiDataLen);
+    if (pBuf == NULL) {
+      return 0;
+    }
+    ulCmd = pBlock->ulCmd;
+    ucDataLen = pBlock->uiDataLen;
+    pCtx->ulCurrFileSize += uiLenToSend + ucDataLen;
+    if (ulCmd == CMD7) {
+      pCtx->cmd7_Req = true;
+    } else if ((pCtx->ulCurrFileSize < pCtx->uiTotalFileSize) &&
+               (ulCmd == CMD6 || ulCmd == CMD4)) {
+      pCtx->EntryPoint_Req = true;
+    }
+  } else {
+    if (pCtx->ulCurrFileSize + uiLenToSend > pCtx->uiTotalFileSize)
+      uiLenToSend = (uint16)(pCtx->uiTotalFileSize - pCtx->ulCurrFileSize);
+
+    // Room for a whole header even if the image ends inside it
+    pStage = fw_upload_ByteBuffer(pCtx, uiLenToSend + HDR_LEN);
+    if (pStage == NULL) {
+      return 0;
+    }
+    memset(pStage, 0, uiLenToSend + HDR_LEN);
+    if (!fw_upload_CtxImageCopy(pCtx, pImage, pCtx->ulCurrFileSize,
+                                uiLenToSend, pStage)) {
+      return 0;
+    }
+    pCtx->ulCurrFileSize += uiLenToSend;
+    ucDataLen = fw_upload_GetBlockDataLen(pStage, &ulCmd);
+    if (ulCmd == CMD7) {
+      pCtx->cmd7_Req = true;
+    } else {
+      pStage = fw_upload_ByteBuffer(pCtx, uiLenToSend + ucDataLen);
+      if (pStage == NULL) {
+        return 0;
+      }
+      memset(&pStage[uiLenToSend], 0, ucDataLen);
+      if (!fw_upload_CtxImageCopy(pCtx, pImage, pCtx->ulCurrFileSize,
+                                  ucDataLen, &pStage[uiLenToSend])) {
+        return 0;
+      }
+      pCtx->ulCurrFileSize += ucDataLen;
+      if ((pCtx->ulCurrFileSize < pCtx->uiTotalFileSize) &&
+          (ulCmd == CMD6 || ulCmd == CMD4)) {
+        pCtx->EntryPoint_Req = true;
+      }
+    }
+    pBuf = pStage;
+  }
+#ifdef DEBUG_PRINT
+  VND_LOGV("The buffer is to be sent: %d", uiLenToSend + ucDataLen);
+  for (int i = 0; i < (uiLenToSend + ucDataLen); i++) {
+    if (i % 16 == 0) {
+      VND_LOGV("\n");
+    }
+    VND_LOGV(" %02x ", pBuf[i]);
+  }
+#endif
+  // start to send Temp buffer
+  uiLen = fw_upload_SendBuffer(pCtx, uiLenToSend, pBuf, false);
+  VND_LOGV("File downloaded: %8u:%8u\r", pCtx->ulCurrFileSize,
+           pCtx->uiTotalFileSize);
+
+  return uiLen;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_StatsRequest
+ *
+ * Description:
+ *   Accounts an answered 0xA7 request in blockStats.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   uiLen:       length of the data block sent, 0 if none.
+ *   uiError:     error bits of the request.
+ *   bRetransmit: the block was already sent for the same offset.
+ *   ullAckNs:    when the ack was issued.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The request arrival is the time its header was received, the block
+ *   counts as written when the port has accepted all of it.
+ *
+ *****************************************************************************/
+static void fw_upload_StatsRequest(fw_upload_ctx_t* pCtx, uint16 uiLen,
+                                   uint16 uiError, bool bRetransmit,
+                                   uint64 ullAckNs) {
+  uint8 i;
+
+  pCtx->blockStats.uiRequests++;
+  fw_upload_HistAdd(&pCtx->blockStats.reqToAck,
+                    (uint32)((ullAckNs - pCtx->ullReqRcvdNs) / 1000));
+  if (uiError != 0) {
+    pCtx->blockStats.uiErrRequests++;
+    for (i = 0; i < 16; i++) {
+      pCtx->blockStats.uiErrBitCnt[i] += (uiError >> i) & 0x1;
+    }
+  }
+  if (uiLen != 0) {
+    pCtx->blockStats.uiBlocks++;
+    pCtx->blockStats.ullBytes += uiLen;
+    if (bRetransmit) {
+      pCtx->blockStats.uiRetransmits++;
+    }
+    fw_upload_HistAdd(&pCtx->blockStats.ackToData,
+                      (uint32)((fw_upload_GetTimeNs() - ullAckNs) / 1000));
+    fw_upload_HistAdd(&pCtx->blockStats.blockLen, uiLen);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ProgressWrite
+ *
+ * Description:
+ *   Writes the progress to szProgressFile as name=value lines.
+ *
+ * Conditions For Use:
+ *   szProgressFile is set.
+ *
+ * Arguments:
+ *   pProgress: the progress.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The file is written next to its old version and renamed over it, so a
+ *   reader never sees half of it.
+ *
+ *****************************************************************************/
+static void fw_upload_ProgressWrite(fw_upload_ctx_t* pCtx,
+                                    const fw_upload_progress_t* pProgress) {
+  char szTmp[MAX_PATH_LEN + 4];
+  char szBuf[256];
+  int32 iLen;
+  int32 fd;
+
+  iLen = snprintf(szBuf, sizeof(szBuf),
+                  "bytes_sent=%u\ntotal_bytes=%u\nbytes_per_sec=%u\n"
+                  "eta_ms=%u\nelapsed_ms=%u\nbaud=%u\nretransmits=%u\n"
+                  "done=%d\nresult=%u\n",
+                  pProgress->uiBytesSent, pProgress->uiTotalBytes,
+                  pProgress->uiBytesPerSec, pProgress->uiEtaMs,
+                  pProgress->uiElapsedMs, pProgress->uiBaudRate,
+                  pProgress->uiRetransmits, pProgress->bDone,
+                  pProgress->ulResult);
+  snprintf(szTmp, sizeof(szTmp), "%s.tmp", pCtx->szProgressFile);
+  fd = open(szTmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    VND_LOGW("%s open failed: %s (%d)", szTmp, strerror(errno), errno);
+    return;
+  }
+  if (write(fd, szBuf, (size_t)iLen) != iLen) {
+    VND_LOGW("%s write failed: %s (%d)", szTmp, strerror(errno), errno);
+    close(fd);
+    return;
+  }
+  close(fd);
+  if (rename(szTmp, pCtx->szProgressFile) != 0) {
+    VND_LOGW("%s rename failed: %s (%d)", szTmp, strerror(errno), errno);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_Progress
+ *
+ * Description:
+ *   Publishes the download progress if the interval is over.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   bDone:    the download is over, publish regardless of the interval.
+ *   ulResult: result of the download once bDone.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Called after every block, costs a clock read unless something is
+ *   published.
+ *
+ *****************************************************************************/
+static void fw_upload_Progress(fw_upload_ctx_t* pCtx, bool bDone,
+                               uint32 ulResult) {
+  fw_upload_progress_t progress;
+  uint64 ullNow;
+  uint64 ullElapsedNs;
+
+  if ((pCtx->pfnProgress == NULL) && (pCtx->szProgressFile[0] == '\0')) {
+    return;
+  }
+  ullNow = fw_upload_GetTimeNs();
+  if (!bDone && (ullNow < pCtx->ullProgressNextNs)) {
+    return;
+  }
+  pCtx->ullProgressNextNs = ullNow + pCtx->uiProgressIntervalMs * NSEC_PER_MSEC;
+  ullElapsedNs = ullNow - pCtx->ullProgressStartNs;
+
+  memset(&progress, 0, sizeof(progress));
+  progress.uiTotalBytes = pCtx->uiTotalFileSize;
+  progress.uiBytesSent = (pCtx->ulCurrFileSize < pCtx->uiTotalFileSize)
+                             ? pCtx->ulCurrFileSize
+                             : pCtx->uiTotalFileSize;
+  if (bDone && (ulResult == DOWNLOAD_SUCCESS)) {
+    progress.uiBytesSent = pCtx->uiTotalFileSize;
+  }
+  progress.uiElapsedMs = (uint32)(ullElapsedNs / NSEC_PER_MSEC);
+  if (ullElapsedNs != 0) {
+    progress.uiBytesPerSec =
+        (uint32)((uint64)progress.uiBytesSent * NSEC_PER_SEC / ullElapsedNs);
+  }
+  if (progress.uiBytesPerSec != 0) {
+    progress.uiEtaMs =
+        (uint32)((uint64)(progress.uiTotalBytes - progress.uiBytesSent) *
+                 1000 / progress.uiBytesPerSec);
+  }
+  progress.uiBaudRate =
+      (pCtx->uiDlBaudRate != 0) ? pCtx->uiDlBaudRate : pCtx->uiProgressBaud;
+  progress.uiRetransmits = pCtx->blockStats.uiRetransmits + pCtx->uiV1Resends;
+  progress.bDone = bDone;
+  progress.ulResult = bDone ? ulResult : DOWNLOAD_SUCCESS;
+
+  if (pCtx->pfnProgress != NULL) {
+    pCtx->pfnProgress(&progress, pCtx->pProgressCtx);
+  }
+  if (pCtx->szProgressFile[0] != '\0') {
+    fw_upload_ProgressWrite(pCtx, &progress);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_V3SendLenBytes
+ *
+ * Description:
+ *   This function acks the request and sends Len bytes to the Helper.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage: image being sent.
+ *   uiLenTosend: the length will be sent.
+ *   ulOffset: the offset of current sending.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Nothing is sent if there is no memory to stage the block, bNoMemory is
+ *   set then, or if it does not decompress, which sets bImageCorrupt.
+ *
+ *****************************************************************************/
+static void fw_upload_V3SendLenBytes(fw_upload_ctx_t* pCtx,
+                                     const fw_upload_image_t* pImage,
+                                     uint16 uiLenToSend, uint32 ulOffset) {
+  uint64 cpuStart = fw_upload_GetCpuTimeNs();
+  bool bRetransmit = (ulOffset == pCtx->ulLastOffsetToSend);
+  uint64 ullAckNs;
+  const uint8* pBlock;
+
+  // Retransmition of previous block
+  if (bRetransmit) {
+    VND_LOGV("Resend offset %d...", ulOffset);
+    pBlock =
+        fw_upload_ImageBlock(pCtx, pImage, pCtx->ulLastBlockPos, uiLenToSend);
+    if (pBlock == NULL) {
+      return;
+    }
+    ullAckNs = fw_upload_GetTimeNs();
+    fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, pBlock, uiLenToSend);
   } else {
     // The length requested by the Helper is equal to the Block
     // sizes used while creating the FW.bin. The usual
     // block sizes are 128, 256, 512.
     // uiLenToSend % 16 == 0. This means the previous packet
     // was error free (CRC ok) or this is the first packet received.
-    //  We can clear the ucByteBuffer and populate fresh data.
-    memset(ucByteBuffer, 0, MAX_LENGTH * sizeof(uint8));
-    memcpy(ucByteBuffer, pFileBuffer + ulOffset - change_baudrate_buffer_len -
-                             cmd7_change_timeout_len - cmd5_len,
-           uiLenToSend);
-    ulCurrFileSize = ulOffset - change_baudrate_buffer_len -
-                     cmd7_change_timeout_len - cmd5_len + uiLenToSend;
+    // The block is sent straight from the image, only its position is
+    // kept for a retransmission.
+    pCtx->ulLastBlockPos = ulOffset - pCtx->change_baudrate_buffer_len -
+                           pCtx->cmd7_change_timeout_len - pCtx->cmd5_len;
+    pCtx->ulCurrFileSize = pCtx->ulLastBlockPos + uiLenToSend;
+    pBlock =
+        fw_upload_ImageBlock(pCtx, pImage, pCtx->ulLastBlockPos, uiLenToSend);
+    if (pBlock == NULL) {
+      return;
+    }
+    ullAckNs = fw_upload_GetTimeNs();
 #ifdef TEST_CODE
+    // The test cases corrupt the block, work on a copy
+    if (fw_upload_ByteBuffer(pCtx, uiLenToSend) == NULL) {
+      return;
+    }
+    memmove(pCtx->pByteBuffer, pBlock, uiLenToSend);
+    fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, NULL, 0);
 
     if (uiLenToSend == HDR_LEN) {
       if (ucTestCase == 321 && !ucTestDone) {
         VND_LOGV("TC-%d:  Sleeping for %dms before sending %d bytes HEADER",
                  ucTestCase, ucSleepTimeMs, uiLenToSend);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
         ucTestDone = 1;
       } else if (ucTestCase == 322 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send only 8 bytes of 16-byte HEADER, then sleep for %dms",
             ucTestCase, ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, 8);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, 8);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 323 && !ucTestDone) {
@@ -1360,18 +1930,18 @@ static void fw_upload_V3SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend,
             "TC-%d:  Send 8 bytes of 16-byte HEADER, sleep for %dms, then send "
             "remaining 8 bytes HEADER",
             ucTestCase, ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, 8);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, 8);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, &ucByteBuffer[8], 8);
+        fw_upload_ComWriteChars(pCtx->iFd, &pCtx->pByteBuffer[8], 8);
         ucTestDone = 1;
       } else if (ucTestCase == 324 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send 8 bytes of 16-byte HEADER, sleep for %dms, then send "
             "full 16 bytes HEADER",
             ucTestCase, ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, 8);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, 8);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
         ucTestDone = 1;
       } else if (ucTestCase == 325 && !ucTestDone) {
         VND_LOGV(
@@ -1383,20 +1953,20 @@ static void fw_upload_V3SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend,
       } else if (ucTestCase == 326 && !ucTestDone) {
         VND_LOGV("TC-%d:  Send 16-byte HEADER with last byte changed to 7C",
                  ucTestCase);
-        myCrcCorrByte = ucByteBuffer[uiLenToSend - 1];
-        ucByteBuffer[uiLenToSend - 1] = 0x7c;
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
-        ucByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
+        myCrcCorrByte = pCtx->pByteBuffer[uiLenToSend - 1];
+        pCtx->pByteBuffer[uiLenToSend - 1] = 0x7c;
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
+        pCtx->pByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
         ucTestDone = 1;
       } else if (ucTestCase == 327 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send 16-byte HEADER with last byte changed to 7C, then "
             "sleep for %dms",
             ucTestCase, ucSleepTimeMs);
-        myCrcCorrByte = ucByteBuffer[uiLenToSend - 1];
-        ucByteBuffer[uiLenToSend - 1] = 0x7c;
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
-        ucByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
+        myCrcCorrByte = pCtx->pByteBuffer[uiLenToSend - 1];
+        pCtx->pByteBuffer[uiLenToSend - 1] = 0x7c;
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
+        pCtx->pByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 328 && !ucTestDone) {
@@ -1407,21 +1977,21 @@ static void fw_upload_V3SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend,
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else {
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
       }
     } else {
       if (ucTestCase == 301 && !ucTestDone) {
         VND_LOGV("TC-%d:  Sleeping for %dms before sending %d bytes DATA",
                  ucTestCase, ucSleepTimeMs, uiLenToSend);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
         ucTestDone = 1;
       } else if (ucTestCase == 302 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send only first 8 bytes of %d bytes of DATA, then sleep "
             "for %dms",
             ucTestCase, uiLenToSend, ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, 8);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, 8);
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else if (ucTestCase == 303 && !ucTestDone) {
@@ -1429,18 +1999,19 @@ static void fw_upload_V3SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend,
             "TC-%d:  Send first 8 bytes of %d bytes DATA, sleep for %dms, then "
             "send remaining %d DATA",
             ucTestCase, uiLenToSend, ucSleepTimeMs, uiLenToSend - 8);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, 8);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, 8);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, &ucByteBuffer[8], uiLenToSend - 8);
+        fw_upload_ComWriteChars(pCtx->iFd, &pCtx->pByteBuffer[8],
+                                uiLenToSend - 8);
         ucTestDone = 1;
       } else if (ucTestCase == 304 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send first 8 bytes of %d bytes DATA, sleep for %dms, then "
             "send full %d bytes DATA",
             ucTestCase, uiLenToSend, ucSleepTimeMs, uiLenToSend);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, 8);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, 8);
         fw_upload_DelayInMs(ucSleepTimeMs);
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
         ucTestDone = 1;
       } else if (ucTestCase == 305 && !ucTestDone) {
         VND_LOGV("TC-%d:  Sleep for %dms, and NOT sending %d bytes DATA",
@@ -1450,144 +2021,559 @@ static void fw_upload_V3SendLenBytes(uint8* pFileBuffer, uint16 uiLenToSend,
       } else if (ucTestCase == 306 && !ucTestDone) {
         VND_LOGV("TC-%d:  Send %d bytes DATA with last byte changed to 7C",
                  ucTestCase, uiLenToSend);
-        myCrcCorrByte = ucByteBuffer[uiLenToSend - 1];
-        ucByteBuffer[uiLenToSend - 1] = 0x7c;
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
-        ucByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
+        myCrcCorrByte = pCtx->pByteBuffer[uiLenToSend - 1];
+        pCtx->pByteBuffer[uiLenToSend - 1] = 0x7c;
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
+        pCtx->pByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
         ucTestDone = 1;
       } else if (ucTestCase == 307 && !ucTestDone) {
         VND_LOGV(
             "TC-%d:  Send %d bytes DATA with last byte changed to 7C, then "
             "sleep for %dms",
             ucTestCase, uiLenToSend, ucSleepTimeMs);
-        myCrcCorrByte = ucByteBuffer[uiLenToSend - 1];
-        ucByteBuffer[uiLenToSend - 1] = 0x7c;
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
-        ucByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
+        myCrcCorrByte = pCtx->pByteBuffer[uiLenToSend - 1];
+        pCtx->pByteBuffer[uiLenToSend - 1] = 0x7c;
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
+        pCtx->pByteBuffer[uiLenToSend - 1] = myCrcCorrByte;
         fw_upload_DelayInMs(ucSleepTimeMs);
         ucTestDone = 1;
       } else {
-        fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+        fw_upload_ComWriteChars(pCtx->iFd, pCtx->pByteBuffer, uiLenToSend);
       }
     }
 
 #else
 
-    fw_upload_ComWriteChars(mchar_fd, ucByteBuffer, uiLenToSend);
+    fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, pBlock, uiLenToSend);
 
 #endif
-    ulLastOffsetToSend = ulOffset;
+    pCtx->ulLastOffsetToSend = ulOffset;
   }
+  fw_upload_StatsRequest(pCtx, uiLenToSend, 0, bRetransmit, ullAckNs);
+  pCtx->ullSendCpuNs += fw_upload_GetCpuTimeNs() - cpuStart;
 }
 
 /******************************************************************************
  *
- * Name: fw_Change_Baudrate
+ * Name: fw_upload_PaceWait
  *
  * Description:
- *   This function changes the baud rate of bootrom.
+ *   Waits for the controller to answer instead of sleeping a fixed time.
+ *   Returns once uiCount more bytes have been received and the line has
+ *   then been idle for PACE_QUIET_MS, or after uiMaxMs.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   pPortName:        Serial port value.
- *   iFirstBaudRate:   The default baud rate of boot rom.
- *   iSecondBaudRate:  The changed baud rate.
+ *   uiCount: bytes to wait for, 0 to only wait for the line to go idle.
+ *   uiMaxMs: the fixed delay this wait replaces.
  *
  * Return Value:
- *   true:            Change baud rate successfully
- *   false:           Change baud rate unsuccessfully
+ *   true:   uiCount bytes were received.
+ *   false:  uiMaxMs expired first.
+ *
+ * Notes:
+ *   The time waited is added to ullPaceWaitNs and uiMaxMs to uiPaceFixedMs,
+ *   both are logged when the download completes.
+ *
+ *****************************************************************************/
+static bool fw_upload_PaceWait(fw_upload_ctx_t* pCtx, uint32 uiCount,
+                               uint32 uiMaxMs) {
+  fw_upload_deadline_t deadline;
+  fw_upload_deadline_t quietDeadline;
+  uint64 ullStartNs = fw_upload_GetTimeNs();
+  uint32 uiHave = fw_upload_GetBufferSize(pCtx->iFd);
+  bool bResult;
+
+  fw_upload_DeadlineInit(&deadline, uiMaxMs, NULL);
+  bResult = fw_upload_WaitForBytesUntil(pCtx->iFd, uiHave + uiCount, &deadline);
+  if (bResult) {
+    // Let a burst of repeated requests finish before it is looked at
+    do {
+      uiHave = fw_upload_GetBufferSize(pCtx->iFd);
+      fw_upload_DeadlineInit(&quietDeadline, PACE_QUIET_MS, &deadline);
+    } while (!fw_upload_DeadlineExpired(&deadline) &&
+             fw_upload_WaitForBytesUntil(pCtx->iFd, uiHave + 1,
+                                         &quietDeadline));
+  }
+  pCtx->ullPaceWaitNs += fw_upload_GetTimeNs() - ullStartNs;
+  pCtx->uiPaceFixedMs += uiMaxMs;
+  return bResult;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_WaitFor_Offset
+ *
+ * Description:
+ *   This function gets offset value from helper.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   offset value, 1 if it failed its complement.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-static int32 fw_Change_Baudrate(int8* pPortName, uint32 iFirstBaudRate,
-                                uint32 iSecondBaudRate,
-                                bool bFirstWaitHeaderSignature) {
-  uint8 uartConfig[60];
-  uint8 ucBuffer[80];
-  uint32 j;
-  uint32 uartClk = 0x00C00000;
-  uint32 uartDiv = 0x1;
-  uint16 uiLenToSend = 0;
-  uint32 uiCrc = 0;
-  uint32 uiLen = 0;
-  bool bRetVal = false;
-  int32 ucResult = -1;
-  uint8 ucLoadPayload = 0;
-  uint32 waitHeaderSigTime = 0;
-  bool uiReUsedInitBaudrate = false;
-  bool fw_upload_flag = false;
-  uint32 headLen = 0;
+static uint32 fw_upload_WaitFor_Offset(fw_upload_ctx_t* pCtx) {
+  uint32 ulOffset = 0x0;
+  uint32 ulOffsetComp = 0x0;
 
-  uint32 mcr = MCR;
-  uint32 init = INIT;
-  uint32 icr = ICR;
-  uint32 fcr = FCR;
-  uint32 brAddr = CLKDIVAddr;
-  uint32 divAddr = UARTDIVAddr;
-  uint32 mcrAddr = UARTMCRAddr;
-  uint32 reInitAddr = UARTREINITAddr;
-  uint32 icrAddr = UARTICRAddr;
-  uint32 fcrAddr = UARTFCRAddr;
+  if (!fw_upload_WaitForBytes(pCtx->iFd, 8, TIMEOUT_FOR_READ)) {
+    VND_LOGE("Timeout waiting for helper offset");
+  }
+  // Read the Offset.
+  fw_upload_ComReadChars(pCtx->iFd, (uint8*)&ulOffset, 4);
+  fw_upload_ComReadChars(pCtx->iFd, (uint8*)&ulOffsetComp, 4);
 
-  VND_LOGV("ComPort : %s", pPortName);
+  // Check if the offset is valid.
+  if ((ulOffset ^ ulOffsetComp) == 0xFFFFFFFFU) {
+    VND_LOGV("Helper ask for offset %u", ulOffset);
+  } else {
+    VND_LOGV("NAK case: helper Offset = %x", ulOffset);
+    VND_LOGV("NAK case: helper OffsetComp = %x", ulOffsetComp);
+    // Failure due to mismatch.
+    fw_upload_ComWriteChar(pCtx->iFd, (int8)REQUEST_NAK);
+    // Start all over again.
+    ulOffset = 1;
+  }
+  return ulOffset;
+}
 
-  for (j = 0; j < sizeof(UartCfgTbl) / sizeof(UART_BAUDRATE); j++) {
-    if (iSecondBaudRate == UartCfgTbl[j].iBaudRate) {
-      uartDiv = UartCfgTbl[j].iUartDivisor;
-      uartClk = UartCfgTbl[j].iClkDivisor;
-      ucResult = 0;
-      break;
+/******************************************************************************
+ *
+ * Name: fw_upload_WaitFor_ErrCode
+ *
+ * Description:
+ *   This function gets error code from helper.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   error code, 1 if it failed its complement.
+ *
+ * Notes:
+ *   An error code of 0 is acked along with the data sent next.
+ *
+ *****************************************************************************/
+static uint16 fw_upload_WaitFor_ErrCode(fw_upload_ctx_t* pCtx) {
+  static const uint8 ucV2Ack = V2_REQUEST_ACK;
+  static const uint8 ucV2TimeoutAck = V2_TIMEOUT_ACK;
+  uint16 uiError = 0x0;
+  uint16 uiErrorCmp = 0x0;
+
+  if (!fw_upload_WaitForBytes(pCtx->iFd, 4, TIMEOUT_FOR_READ)) {
+    VND_LOGE("Timeout waiting for helper error code");
+  }
+  // Read the Error Code.
+  fw_upload_ComReadChars(pCtx->iFd, (uint8*)&uiError, 2);
+  fw_upload_ComReadChars(pCtx->iFd, (uint8*)&uiErrorCmp, 2);
+
+  // Check if the Err Code is valid.
+  if ((uiError ^ uiErrorCmp) == 0xFFFF) {
+    VND_LOGV("Error Code is %d", uiError);
+    if (uiError == 0) {
+      // Successful. Send back the ack along with the requested data.
+      fw_upload_ComQueueChars(pCtx->iFd, &ucV2Ack, 1);
+    } else {
+      VND_LOGV("Helper NAK or CRC or Timeout");
+      // NAK/CRC/Timeout
+      (void)fw_upload_CtxWrite(pCtx, &ucV2TimeoutAck, 1);
     }
+  } else {
+    VND_LOGV("NAK case: helper ErrorCode = %x", uiError);
+    VND_LOGV("NAK case: helper ErrorCodeComp = %x", uiErrorCmp);
+    // Failure due to mismatch.
+    fw_upload_ComWriteChar(pCtx->iFd, (int8)REQUEST_NAK);
+    // Start all over again.
+    uiError = 1;
   }
+  return uiError;
+}
 
-  if (ucResult != 0) {
-    return ucResult;
-  }
+/******************************************************************************
+ *
+ * Name: fw_upload_SendIntBytes
+ *
+ * Description:
+ *   This function sends 4 bytes and 4bytes' compare.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   ulBytesToSent: 4 bytes need to be sent.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_SendIntBytes(fw_upload_ctx_t* pCtx,
+                                   uint32 ulBytesToSent) {
+  uint8 uTemp[8];
 
-  // Generate CRC value for CMD5 payload
-  memcpy(uartConfig + uiLen, &brAddr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &uartClk, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &divAddr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &uartDiv, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &mcrAddr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &mcr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &reInitAddr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &init, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &icrAddr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &icr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &fcrAddr, 4);
-  uiLen += 4;
-  memcpy(uartConfig + uiLen, &fcr, 4);
-  uiLen += 4;
-  headLen = uiLen + 4;
+  fw_upload_StoreBytes(ulBytesToSent, 4, uTemp);
+  fw_upload_StoreBytes(ulBytesToSent ^ 0xFFFFFFFFU, 4, &uTemp[4]);
+  (void)fw_upload_CtxWrite(pCtx, uTemp, sizeof(uTemp));
+}
 
-  fw_upload_gen_crc_table();
-  memcpy(m_Buffer_CMD5_Header + 8, &headLen, 4);
+/******************************************************************************
+ *
+ * Name: fw_upload_V2SendLenBytes
+ *
+ * Description:
+ *   This function sends Len bytes to the Helper.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage: image being sent.
+ *   uiLenTosend: the length will be sent.
+ *   ulOffset: the offset of current sending.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Nothing is sent if there is no memory to stage the block, bNoMemory is
+ *   set then, or if it does not decompress, which sets bImageCorrupt.
+ *
+ *****************************************************************************/
+static void fw_upload_V2SendLenBytes(fw_upload_ctx_t* pCtx,
+                                     const fw_upload_image_t* pImage,
+                                     uint16 uiLenToSend, uint32 ulOffset) {
+  const uint8* pBlock;
+
+  pBlock = fw_upload_ImageBlock(pCtx, pImage, ulOffset, uiLenToSend);
+  if (pBlock == NULL) {
+    return;
+  }
+  // Retransmition of previous block
+  if (ulOffset == pCtx->ulLastOffsetToSend) {
+    VND_LOGV("Retx offset %u...", ulOffset);
+  } else {
+    // The length requested by the Helper is equal to the Block sizes used
+    // while creating the FW.bin, usually 128, 256 or 512.
+    pCtx->ulCurrFileSize += uiLenToSend;
+    pCtx->ulLastOffsetToSend = ulOffset;
+  }
+  (void)fw_upload_CtxWrite(pCtx, pBlock, uiLenToSend);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_V2Restarted
+ *
+ * Description:
+ *   Finds out whether the helper starts over after the download, it then
+ *   sends 0xaa within V2_RESTART_TIMEOUT.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   true:   the helper starts over.
+ *   false:  the download is over.
+ *
+ * Notes:
+ *   The 0xaa is left for the header signature wait.
+ *
+ *****************************************************************************/
+static bool fw_upload_V2Restarted(fw_upload_ctx_t* pCtx) {
+  fw_upload_deadline_t deadline;
+  uint8 ucByte = 0xff;
+
+  fw_upload_DeadlineInit(&deadline, V2_RESTART_TIMEOUT, NULL);
+  if (!fw_upload_WaitForBytesUntil(pCtx->iFd, 1, &deadline) ||
+      (fw_upload_ComPeekChars(pCtx->iFd, &ucByte, 1) != 1) ||
+      (ucByte != V1_START_INDICATION)) {
+    return false;
+  }
+  VND_LOGV("ReDownload after %llu ms", fw_upload_DeadlineElapsedMs(&deadline));
+  return true;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_GetUartDivisors
+ *
+ * Description:
+ *   This function computes the CMD5 clock and UART divisors of a baud rate.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   uiBaudRate: the baud rate.
+ *   pUartDiv:   returns the UARTDIV value.
+ *   pClkDiv:    returns the CLKDIV value.
+ *
+ * Return Value:
+ *   true:            the divisors are set
+ *   false:           the baud rate cannot be generated
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static bool fw_upload_GetUartDivisors(uint32 uiBaudRate, uint32* pUartDiv,
+                                      uint32* pClkDiv) {
+  uint32 uartDiv = UART_MAX_UARTDIV;
+  uint64 fracClk;
+  uint64 clkDiv;
+
+  if (uiBaudRate == 0) {
+    return false;
+  }
+  // Faster rates run undivided above the usual clock
+  while ((uartDiv > 1) && ((uint64)uiBaudRate * UART_OVERSAMPLING * uartDiv >
+                           UART_MAX_FRAC_CLK_HZ)) {
+    uartDiv >>= 1;
+  }
+  fracClk = (uint64)uiBaudRate * UART_OVERSAMPLING * uartDiv;
+  clkDiv = ((fracClk << UART_CLKDIV_SHIFT) + UART_REF_CLK_HZ / 2) /
+           UART_REF_CLK_HZ;
+  if (clkDiv > 0xFFFFFFFFULL) {
+    return false;
+  }
+  *pUartDiv = uartDiv;
+  *pClkDiv = (uint32)clkDiv;
+  return true;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LadderInsert
+ *
+ * Description:
+ *   This function adds a baud rate to the download baud rate ladder.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   uiBaudRate: the baud rate, 0 is ignored.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The ladder stays sorted fastest first and without duplicates.
+ *
+ *****************************************************************************/
+static void fw_upload_LadderInsert(fw_upload_ctx_t* pCtx, uint32 uiBaudRate) {
+  uint32 i = 0;
+
+  while ((i < pCtx->uiBaudLadderLen) && (pCtx->uiBaudLadder[i] > uiBaudRate)) {
+    i++;
+  }
+  if ((uiBaudRate == 0) || (i == sizeof(pCtx->uiBaudLadder) / sizeof(uint32)) ||
+      ((i < pCtx->uiBaudLadderLen) && (pCtx->uiBaudLadder[i] == uiBaudRate))) {
+    return;
+  }
+  if (pCtx->uiBaudLadderLen == sizeof(pCtx->uiBaudLadder) / sizeof(uint32)) {
+    pCtx->uiBaudLadderLen--;
+  }
+  memmove(&pCtx->uiBaudLadder[i + 1], &pCtx->uiBaudLadder[i],
+          (pCtx->uiBaudLadderLen - i) * sizeof(uint32));
+  pCtx->uiBaudLadder[i] = uiBaudRate;
+  pCtx->uiBaudLadderLen++;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_RememberBaudRate
+ *
+ * Description:
+ *   This function stores the download baud rate to start the next download
+ *   with.
+ *
+ * Conditions For Use:
+ *   Called after a successful download.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The rate that worked is stored, the faster rates the bootloader did not
+ *   answer at are not tried again. If the download saw more CRC errors than
+ *   allowed, the next slower rate of the ladder is stored instead, and
+ *   after FW_UPLOAD_BAUD_LADDER_CLIMB_AFTER clean downloads there the
+ *   faster one is stored again.
+ *
+ *****************************************************************************/
+static void fw_upload_RememberBaudRate(fw_upload_ctx_t* pCtx) {
+  uint32 uiBaudRate = pCtx->uiDlBaudRate;
+  uint32 uiClimb = 0;
+  uint32 crcErrors =
+      pCtx->blockStats.uiErrBitCnt[0] + pCtx->blockStats.uiCrcErrors;
+  uint32 i;
+
+  if ((uiBaudRate == 0) || (pCtx->szDlBaudProp[0] == '\0')) {
+    return;
+  }
+  for (i = 0; i < pCtx->uiBaudLadderLen; i++) {
+    if (pCtx->uiBaudLadder[i] == uiBaudRate) {
+      break;
+    }
+  }
+  if (crcErrors > pCtx->uiBaudLadderCrcThreshold) {
+    if (i + 1 < pCtx->uiBaudLadderLen) {
+      uiBaudRate = pCtx->uiBaudLadder[i + 1];
+      uiClimb = FW_UPLOAD_BAUD_LADDER_CLIMB_AFTER;
+    }
+    VND_LOGE("%u CRC errors at %u baud, next download starts at %u baud",
+             crcErrors, pCtx->uiDlBaudRate, uiBaudRate);
+  } else if (uiBaudRate == pCtx->uiDlBaudStored) {
+    uiClimb = (uint32)get_prop_int32(pCtx->szDlClimbProp);
+    if (uiClimb > 0) {
+      uiClimb--;
+      if ((uiClimb == 0) && (i > 0) && (i < pCtx->uiBaudLadderLen)) {
+        uiBaudRate = pCtx->uiBaudLadder[i - 1];
+        VND_LOGD("%u baud clean, next download tries %u baud again",
+                 pCtx->uiDlBaudRate, uiBaudRate);
+      }
+    }
+  }
+  if ((uint32)get_prop_int32(pCtx->szDlBaudProp) != uiBaudRate) {
+    set_prop_int32(pCtx->szDlBaudProp, (int)uiBaudRate);
+  }
+  if ((uint32)get_prop_int32(pCtx->szDlClimbProp) != uiClimb) {
+    set_prop_int32(pCtx->szDlClimbProp, (int)uiClimb);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: fw_Change_Baudrate
+ *
+ * Description:
+ *   This function changes the baud rate of bootrom.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pPortName:        Serial port value.
+ *   iFirstBaudRate:   The default baud rate of boot rom.
+ *   iSecondBaudRate:  The changed baud rate.
+ *
+ * Return Value:
+ *   true:            Change baud rate successfully
+ *   false:           Change baud rate unsuccessfully
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static int32 fw_Change_Baudrate(fw_upload_ctx_t* pCtx, int8* pPortName,
+                                uint32 iFirstBaudRate, uint32 iSecondBaudRate,
+                                bool bFirstWaitHeaderSignature) {
+  uint8 uartConfig[60];
+  uint8 ucBuffer[80];
+  uint8 ucCmd5Header[16];
+  uint32 uartClk = 0x00C00000;
+  uint32 uartDiv = 0x1;
+  uint16 uiLenToSend = 0;
+  uint32 uiCrc = 0;
+  uint32 uiLen = 0;
+  bool bRetVal = false;
+  int32 ucResult = -1;
+  uint8 ucLoadPayload = 0;
+  uint32 waitHeaderSigTime = 0;
+  fw_upload_deadline_t budget;
+  fw_upload_deadline_t stepDeadline;
+  bool uiReUsedInitBaudrate = false;
+  bool fw_upload_flag = false;
+  uint32 headLen = 0;
+
+  uint32 mcr = MCR;
+  uint32 init = INIT;
+  uint32 icr = ICR;
+  uint32 fcr = FCR;
+  uint32 brAddr = CLKDIVAddr;
+  uint32 divAddr = UARTDIVAddr;
+  uint32 mcrAddr = UARTMCRAddr;
+  uint32 reInitAddr = UARTREINITAddr;
+  uint32 icrAddr = UARTICRAddr;
+  uint32 fcrAddr = UARTFCRAddr;
+
+  VND_LOGV("ComPort : %s", pPortName);
+
+  if (!fw_upload_GetUartDivisors(iSecondBaudRate, &uartDiv, &uartClk)) {
+    return ucResult;
+  }
+  ucResult = 0;
+  VND_LOGD("Baudrate %u: UARTDIV %u, CLKDIV 0x%08x", iSecondBaudRate, uartDiv,
+           uartClk);
+
+  // Generate CRC value for CMD5 payload
+  memcpy(uartConfig + uiLen, &brAddr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &uartClk, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &divAddr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &uartDiv, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &mcrAddr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &mcr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &reInitAddr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &init, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &icrAddr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &icr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &fcrAddr, 4);
+  uiLen += 4;
+  memcpy(uartConfig + uiLen, &fcr, 4);
+  uiLen += 4;
+  headLen = uiLen + 4;
 
-  uiCrc = (uint32)fw_upload_update_crc(0, m_Buffer_CMD5_Header, 12);
+  memcpy(ucCmd5Header, m_Buffer_CMD5_Header, sizeof(ucCmd5Header));
+  memcpy(ucCmd5Header + 8, &headLen, 4);
+
+  uiCrc = fw_upload_crc32(0, ucCmd5Header, 12);
   uiCrc = (uint32)SWAPL(uiCrc);
-  memcpy(m_Buffer_CMD5_Header + 12, &uiCrc, 4);
+  memcpy(ucCmd5Header + 12, &uiCrc, 4);
 
-  uiCrc = (uint32)fw_upload_update_crc(0, uartConfig, uiLen);
+  uiCrc = fw_upload_crc32(0, uartConfig, uiLen);
   uiCrc = (uint32)SWAPL(uiCrc);
   memcpy(uartConfig + uiLen, &uiCrc, 4);
   uiLen += 4;
 
+  fw_upload_DeadlineInit(&budget, CHANGE_BAUDRATE_BUDGET_MS, NULL);
   while (!bRetVal) {
+    if (fw_upload_DeadlineExpired(&budget)) {
+      VND_LOGE("Baudrate change to %d gave up after %llu ms", iSecondBaudRate,
+               fw_upload_DeadlineElapsedMs(&budget));
+      return -2;
+    }
     if (ucLoadPayload != 0 || uiReUsedInitBaudrate) {
       waitHeaderSigTime = TIMEOUT_VAL_MILLISEC;
     } else {
@@ -1597,12 +2583,14 @@ static int32 fw_Change_Baudrate(int8* pPortName, uint32 iFirstBaudRate,
     // If the second baudrate is used, wait for 2s to check 0xa5
     fw_upload_flag = false;
     if (bFirstWaitHeaderSignature == true) {
-      if (fw_upload_WaitForHeaderSignature(waitHeaderSigTime) == true) {
+      fw_upload_DeadlineInit(&stepDeadline, waitHeaderSigTime, &budget);
+      if (fw_upload_WaitForHeaderSignatureUntil(pCtx, &stepDeadline) == true) {
         fw_upload_flag = true;
         if (ucLoadPayload) {
-          if (uiProVer == Ver3) {
-            VND_LOGD("Baudrate changed successfully");
-            change_baudrate_buffer_len = HDR_LEN + uiNewLen;
+          if (pCtx->uiProVer == Ver3) {
+            VND_LOGD("Baudrate changed successfully in %llu ms",
+                     fw_upload_DeadlineElapsedMs(&budget));
+            pCtx->change_baudrate_buffer_len = HDR_LEN + pCtx->uiNewLen;
           }
           break;
         }
@@ -1617,9 +2605,9 @@ static int32 fw_Change_Baudrate(int8* pPortName, uint32 iFirstBaudRate,
         VND_LOGD(
             "0xa5 or 0xa7 not received on second baudrate, falling back to "
             "first baudrate");
-        close(mchar_fd);
-        mchar_fd = init_uart(pPortName, iFirstBaudRate, 0);
-        if (mchar_fd < 0) {
+        pCtx->iFd = fw_upload_ComSetBaud(pCtx->iFd, pPortName, iFirstBaudRate,
+                                         0);
+        if (pCtx->iFd < 0) {
           return -1;
         }
         ucLoadPayload = 0;
@@ -1627,75 +2615,150 @@ static int32 fw_Change_Baudrate(int8* pPortName, uint32 iFirstBaudRate,
         continue;
       }
     }
-    if (uiProVer == Ver1) {
-      uiLenToSend = fw_upload_WaitFor_Len(NULL);
+    if (pCtx->uiProVer == Ver1) {
+      uiLenToSend = fw_upload_WaitFor_Len(pCtx);
       if ((uiLenToSend == 0) || (uiLenToSend == 1)) {
         continue;
       } else if (uiLenToSend == HDR_LEN) {
         // Download CMD5 header and Payload packet.
         VND_LOGV("Sending header");
-        tcflush(mchar_fd, TCIFLUSH);
-        memcpy(ucBuffer, m_Buffer_CMD5_Header, HDR_LEN);
+        fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+        memcpy(ucBuffer, ucCmd5Header, HDR_LEN);
         memcpy(ucBuffer + HDR_LEN, uartConfig, uiLen);
-        fw_upload_SendBuffer(uiLenToSend, ucBuffer, true);
-        close(mchar_fd);
-        mchar_fd =
-            init_uart(pPortName, iSecondBaudRate,
-                      1);  // TODO: there is no check if mchar_fd is valid
-        if (mchar_fd < 0) {
+        fw_upload_SendBuffer(pCtx, uiLenToSend, ucBuffer, true);
+        pCtx->iFd = fw_upload_ComSetBaud(pCtx->iFd, pPortName, iSecondBaudRate,
+                                         1);
+        if (pCtx->iFd < 0) {
           return -1;
         }
         ucLoadPayload = 1;
       } else {
         // Download CMD5 header and Payload packet
         VND_LOGV("Sending payload");
-        fw_upload_ComWriteChars(mchar_fd, uartConfig, uiLen);
-        close(mchar_fd);
-        mchar_fd = init_uart(pPortName, iSecondBaudRate, 1);
+        fw_upload_ComWriteChars(pCtx->iFd, uartConfig, uiLen);
+        pCtx->iFd = fw_upload_ComSetBaud(pCtx->iFd, pPortName, iSecondBaudRate,
+                                         1);
+        if (pCtx->iFd < 0) {
+          return -1;
+        }
         ucLoadPayload = 1;
       }
-    } else if (uiProVer == Ver3) {
+    } else if (pCtx->uiProVer == Ver3) {
       bool sig_check = true;
       if (bFirstWaitHeaderSignature == true) {
-        sig_check = fw_upload_WaitFor_Req(iSecondBaudRate);
+        sig_check = fw_upload_WaitFor_Req(pCtx, iSecondBaudRate);
       }
 
       if (sig_check == true) {
-        if (uiNewLen != 0 && ucRcvdHeader == V3_HEADER_DATA_REQ) {
-          if (uiNewError == 0) {
-            fw_upload_Send_Ack(V3_REQUEST_ACK);
+        if (pCtx->uiNewLen != 0 && pCtx->ucRcvdHeader == V3_HEADER_DATA_REQ) {
+          if (pCtx->uiNewError == 0) {
             bFirstWaitHeaderSignature = true;
 
-            if (uiNewLen == HDR_LEN) {
+            if (pCtx->uiNewLen == HDR_LEN) {
               VND_LOGV("Sending header");
-              fw_upload_ComWriteChars(mchar_fd, m_Buffer_CMD5_Header, uiNewLen);
-              ulLastOffsetToSend = ulNewOffset;
+              fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, ucCmd5Header,
+                                 pCtx->uiNewLen);
+              pCtx->ulLastOffsetToSend = pCtx->ulNewOffset;
             } else {
               VND_LOGV("Sending payload");
-              fw_upload_ComWriteChars(mchar_fd, uartConfig, uiNewLen);
+              fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, uartConfig,
+                                 pCtx->uiNewLen);
               // Reopen Uart by using the second baudrate after downloading the
               // payload.
-              close(mchar_fd);
-              mchar_fd = init_uart(pPortName, iSecondBaudRate, 1);
+              pCtx->iFd = fw_upload_ComSetBaud(pCtx->iFd, pPortName,
+                                               iSecondBaudRate, 1);
+              if (pCtx->iFd < 0) {
+                return -1;
+              }
               ucLoadPayload = 1;
             }
 
           } else  // NAK,TIMEOUT,INVALID COMMAND...
           {
-            tcflush(mchar_fd, TCIFLUSH);
-            fw_upload_Send_Ack(V3_TIMEOUT_ACK);
+            fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+            fw_upload_Send_Ack(pCtx, V3_TIMEOUT_ACK, NULL, 0);
           }
         }
       } else {
         VND_LOGE("Error occurred in fw_upload_WaitFor_Req function");
       }
     } else {
-      VND_LOGV("%d Protocol Version not supported", uiProVer);
+      VND_LOGV("%d Protocol Version not supported", pCtx->uiProVer);
     }
   }
   return ucResult;
 }
 
+/******************************************************************************
+ *
+ * Name: fw_Change_Baudrate_Ladder
+ *
+ * Description:
+ *   This function changes the baud rate of bootrom to the fastest rate of
+ *   the download baud rate ladder that works.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pPortName:        Serial port value.
+ *   iFirstBaudRate:   The default baud rate of boot rom.
+ *   iSecondBaudRate:  The baud rate to fall back to last.
+ *
+ * Return Value:
+ *   Result of fw_Change_Baudrate() at the last rate tried.
+ *
+ * Notes:
+ *   The ladder starts at the rate stored by the last download if that is
+ *   still part of it, see fw_upload_RememberBaudRate(). A rate the
+ *   bootloader does not answer at is dropped and the next slower one is
+ *   tried from the first baud rate again.
+ *
+ *****************************************************************************/
+static int32 fw_Change_Baudrate_Ladder(fw_upload_ctx_t* pCtx,
+                                       int8* pPortName, uint32 iFirstBaudRate,
+                                       uint32 iSecondBaudRate,
+                                       bool bFirstWaitHeaderSignature) {
+  uint32 uiLastGood = 0;
+  uint32 i = 0;
+  uint32 j;
+  int32 result = -1;
+
+  if (pCtx->szDlBaudProp[0] != '\0') {
+    uiLastGood = (uint32)get_prop_int32(pCtx->szDlBaudProp);
+  }
+  fw_upload_LadderInsert(pCtx, iSecondBaudRate);
+  for (j = 0; j < pCtx->uiBaudLadderLen; j++) {
+    if (pCtx->uiBaudLadder[j] == uiLastGood) {
+      i = j;
+      break;
+    }
+  }
+  for (; i < pCtx->uiBaudLadderLen; i++) {
+    result = fw_Change_Baudrate(pCtx, pPortName, iFirstBaudRate,
+                                pCtx->uiBaudLadder[i],
+                                bFirstWaitHeaderSignature);
+    if (result == 0) {
+      pCtx->uiDlBaudRate = pCtx->uiBaudLadder[i];
+      pCtx->uiDlBaudStored = uiLastGood;
+      break;
+    }
+    VND_LOGE("Baudrate change to %u failed (%d)", pCtx->uiBaudLadder[i],
+             result);
+    if (i + 1 < pCtx->uiBaudLadderLen) {
+      // The bootloader is back at the first baud rate, start over there
+      pCtx->iFd = fw_upload_ComSetBaud(pCtx->iFd, pPortName, iFirstBaudRate, 0);
+      if (pCtx->iFd < 0) {
+        return -1;
+      }
+      pCtx->ulLastOffsetToSend = 0xFFFF;
+      bFirstWaitHeaderSignature = true;
+      VND_LOGD("Falling back to %u baud", pCtx->uiBaudLadder[i + 1]);
+    }
+  }
+  return result;
+}
+
 /******************************************************************************
  *
  * Name: fw_Change_Timeout
@@ -1716,33 +2779,36 @@ static int32 fw_Change_Baudrate(int8* pPortName, uint32 iFirstBaudRate,
  *   None.
  *
  *****************************************************************************/
-static int32 fw_Change_Timeout() {
+static int32 fw_Change_Timeout(fw_upload_ctx_t* pCtx) {
   int32 Status = -1;
   bool bFirst = true;
   bool bRetVal = false;
   uint8 reTryNumber = 0;
-  fw_upload_gen_crc_table();
+  fw_upload_deadline_t budget;
+  fw_upload_deadline_t stepDeadline;
 
-  if (enable_poke_controller && (uiProVer == Ver3)) {
-    send_poke = true;
+  if (enable_poke_controller && (pCtx->uiProVer == Ver3)) {
+    pCtx->send_poke = true;
   }
 
+  fw_upload_DeadlineInit(&budget, CHANGE_TIMEOUT_BUDGET_MS, NULL);
   while (!bRetVal) {
-    if (fw_upload_WaitForHeaderSignature(TIMEOUT_VAL_MILLISEC)) {
+    fw_upload_DeadlineInit(&stepDeadline, TIMEOUT_VAL_MILLISEC, &budget);
+    if (fw_upload_WaitForHeaderSignatureUntil(pCtx, &stepDeadline)) {
       // if(ucRcvdHeader != V3_START_INDICATION && ucRcvdHeader !=
       // V1_START_INDICATION) {
       //   return Status;
       // }
-      if (uiProVer == Ver3) {
-        if (fw_upload_WaitFor_Req(1)) {
-          if (uiNewLen != 0) {
-            if (uiNewError == 0) {
+      if (pCtx->uiProVer == Ver3) {
+        if (fw_upload_WaitFor_Req(pCtx, 1)) {
+          if (pCtx->uiNewLen != 0) {
+            if (pCtx->uiNewError == 0) {
               VND_LOGV(" === Succ: REQ = 0xA7, Errcode = 0 ");
-              if (bFirst || ulLastOffsetToSend == ulNewOffset) {
-                fw_upload_Send_Ack(V3_REQUEST_ACK);
-                fw_upload_ComWriteChars(
-                    mchar_fd, m_Buffer_CMD7_ChangeTimeoutValue, uiNewLen);
-                ulLastOffsetToSend = ulNewOffset;
+              if (bFirst || pCtx->ulLastOffsetToSend == pCtx->ulNewOffset) {
+                fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK,
+                                   m_Buffer_CMD7_ChangeTimeoutValue,
+                                   pCtx->uiNewLen);
+                pCtx->ulLastOffsetToSend = pCtx->ulNewOffset;
                 bFirst = false;
               } else {
                 bRetVal = true;
@@ -1750,8 +2816,8 @@ static int32 fw_Change_Timeout() {
               }
             } else {
               if (reTryNumber < 6) {
-                tcflush(mchar_fd, TCIFLUSH);
-                fw_upload_Send_Ack(V3_TIMEOUT_ACK);
+                fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+                fw_upload_Send_Ack(pCtx, V3_TIMEOUT_ACK, NULL, 0);
                 reTryNumber++;
               } else {
                 bRetVal = true;
@@ -1762,7 +2828,7 @@ static int32 fw_Change_Timeout() {
           VND_LOGE("Error occurred in fw_upload_WaitFor_Req function");
         }
       }
-      if (uiProVer == Ver1) {
+      if (pCtx->uiProVer != Ver3) {
         Status = 1;
         break;
       }
@@ -1771,6 +2837,8 @@ static int32 fw_Change_Timeout() {
       break;
     }
   }
+  VND_LOGD("Change timeout status %d after %llu ms", Status,
+           fw_upload_DeadlineElapsedMs(&budget));
   return Status;
 }
 /******************************************************************************
@@ -1790,46 +2858,47 @@ static int32 fw_Change_Timeout() {
  *   -1 if CMD5 is not sent
  *   -2 if read_sig_hdr_after_cmd5 fails
  *****************************************************************************/
-static int bt_send_cmd5_data_ver3(uint8* cmd5_data,
+static int bt_send_cmd5_data_ver3(fw_upload_ctx_t* pCtx, uint8* cmd5_data,
                                   bool read_sig_hdr_after_cmd5) {
   bool header_sent = false;
   int ret = -1;
   if (cmd5_data != NULL) {
     while (ret != 0) {
-      if (fw_upload_WaitFor_Req(0)) {
-        if (uiNewLen != 0 && uiNewError == 0) {
-          fw_upload_Send_Ack(V3_REQUEST_ACK);
-          if ((header_sent == false) && (uiNewLen == HDR_LEN)) {
-            fw_upload_ComWriteChars(mchar_fd, cmd5_data, uiNewLen);
+      if (fw_upload_WaitFor_Req(pCtx, 0)) {
+        if (pCtx->uiNewLen != 0 && pCtx->uiNewError == 0) {
+          if ((header_sent == false) && (pCtx->uiNewLen == HDR_LEN)) {
+            fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, cmd5_data, pCtx->uiNewLen);
             header_sent = true;
-            VND_LOGD("Sent CMD5 Header: %d", uiNewLen);
+            VND_LOGD("Sent CMD5 Header: %d", pCtx->uiNewLen);
           } else if (header_sent == true) {
-            fw_upload_ComWriteChars(mchar_fd, cmd5_data + HDR_LEN, uiNewLen);
+            fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, cmd5_data + HDR_LEN,
+                               pCtx->uiNewLen);
             header_sent = false;
             ret = 0;
-            cmd5_len = (uint32_t)(uiNewLen + HDR_LEN);
-            VND_LOGD("Sent CMD5 payload: %d", uiNewLen);
+            pCtx->cmd5_len = (uint32_t)(pCtx->uiNewLen + HDR_LEN);
+            VND_LOGD("Sent CMD5 payload: %d", pCtx->uiNewLen);
           } else {
+            fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, NULL, 0);
             VND_LOGE(
                 "Unexpected Error CMD5 uiNewLen = %d uiNewError = %d "
                 "header_sent=%d",
-                uiNewLen, uiNewError, header_sent);
+                pCtx->uiNewLen, pCtx->uiNewError, header_sent);
           }
         } else {
-          tcflush(mchar_fd, TCIFLUSH);
-          fw_upload_Send_Ack(V3_TIMEOUT_ACK);
-          if (uiNewError & BT_MIC_FAIL_BIT) {
-            change_baudrate_buffer_len = 0;
-            cmd5_len = 0;
-            ulCurrFileSize = 0;
-            ulLastOffsetToSend = 0xFFFF;
+          fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+          fw_upload_Send_Ack(pCtx, V3_TIMEOUT_ACK, NULL, 0);
+          if (pCtx->uiNewError & BT_MIC_FAIL_BIT) {
+            pCtx->change_baudrate_buffer_len = 0;
+            pCtx->cmd5_len = 0;
+            pCtx->ulCurrFileSize = 0;
+            pCtx->ulLastOffsetToSend = 0xFFFF;
           }
         }
       } else {
         VND_LOGE("Error occurred in fw_upload_WaitFor_Req function");
       }
       if ((ret != 0) || read_sig_hdr_after_cmd5) {
-        if (!fw_upload_WaitForHeaderSignature(TIMEOUT_VAL_MILLISEC)) {
+        if (!fw_upload_WaitForHeaderSignature(pCtx, TIMEOUT_VAL_MILLISEC)) {
           ret = -2;
           break;
         }
@@ -1856,19 +2925,21 @@ static int bt_send_cmd5_data_ver3(uint8* cmd5_data,
  *    Len of next header if success and read_sig_hdr_after_cmd5 is true
  *    1 if CMD5 is not sent
  *****************************************************************************/
-static uint16 bt_send_cmd5_data_ver1(uint8* cmd5_data,
+static uint16 bt_send_cmd5_data_ver1(fw_upload_ctx_t* pCtx,
+                                     const uint8* cmd5_data,
                                      bool read_sig_hdr_after_cmd5) {
   uint16 ret = 1;
   uint8 retry = 3;
   uint16 uiLenToSend = 0;
   if (cmd5_data != NULL) {
     while (retry--) {
-      uiLenToSend = fw_upload_WaitFor_Len(NULL);
+      uiLenToSend = fw_upload_WaitFor_Len(pCtx);
       if (uiLenToSend != HDR_LEN) {
         VND_LOGV("Unexpected Header Length Received: %d", uiLenToSend);
         /* If expected header length is invalid, check after signature header
          */
-        if (fw_upload_WaitForHeaderSignature(TIMEOUT_VAL_MILLISEC) == false) {
+        if (fw_upload_WaitForHeaderSignature(pCtx,
+                                             TIMEOUT_VAL_MILLISEC) == false) {
           VND_LOGV("Header Signature Timeout CMD5 not Sent");
           return ret;
         }
@@ -1880,31 +2951,74 @@ static uint16 bt_send_cmd5_data_ver1(uint8* cmd5_data,
         break;
       }
     }
-    tcflush(mchar_fd, TCIFLUSH);
-    ret = fw_upload_SendBuffer(HDR_LEN, cmd5_data, !read_sig_hdr_after_cmd5);
+    fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+    ret = fw_upload_SendBuffer(pCtx, HDR_LEN, cmd5_data,
+                               !read_sig_hdr_after_cmd5);
+    if (pCtx->bWriteFailed) {
+      return 1;
+    }
     VND_LOGV("CMD5 sent successfully");
   }
   return ret;
 }
+
 /******************************************************************************
  *
- * Function:      fw_loader_get_default_fw_name
+ * Name: fw_upload_SendRomTimeoutPatch
+ *
+ * Description:
+ *   Raises the request timeout of the 8887 ROM bootloader to 2 s before the
+ *   helper is downloaded.
+ *
+ * Conditions For Use:
+ *   The version 1 bootloader is waiting for a header.
+ *
+ * Arguments:
+ *   pCtx: the loader context of the controller.
+ *
+ * Return Value:
+ *   true if the ROM asked for the next header after the patch.
+ *
+ * Notes:
+ *   Other version 1 ROMs look the same on the wire, so the patch is only
+ *   sent when bt_vnd_mrvl_set_rom_timeout_patch() enabled it.
+ *
+ *****************************************************************************/
+static bool fw_upload_SendRomTimeoutPatch(fw_upload_ctx_t* pCtx) {
+  if (bt_send_cmd5_data_ver1(pCtx, m_Buffer_CMD5_RomTimeout, false) != 0) {
+    VND_LOGW("ROM timeout patch not sent");
+    return false;
+  }
+  // Requests may repeat until the patch takes effect, take the last one
+  fw_upload_ComDrain(pCtx->iFd);
+  fw_upload_PaceWait(pCtx, 5, V1_ROM_PATCH_DELAY);
+  return fw_upload_WaitForHeaderSignature(pCtx, TIMEOUT_VAL_MILLISEC);
+}
+/******************************************************************************
  *
- * Description:   Incase bootcode version 3 is used get default FW Path.
+ * Function:      fw_upload_DefaultFwName
+ *
+ * Description:   Incase bootcode version 3 is used get default FW Path, or
+ *                the image of the chip in the firmware bundle.
  *
  * Arguments:
+ * pCtx : the loader context that found the bootloader.
  * fw_name : Pointer to Firmware Path array.
  * fw_name_size: Size of fw_name.
  *
  * Return Value: NA
  *****************************************************************************/
-void fw_loader_get_default_fw_name(char fw_name[], uint32 fw_name_size) {
+static void fw_upload_DefaultFwName(fw_upload_ctx_t* pCtx, char fw_name[],
+                                    uint32 fw_name_size) {
   uint8_t i = 0;
-  if (uiProVer == Ver3) {
+  if ((pCtx->uiProVer == Ver3) && (pCtx->szBundleImage[0] != '\0')) {
+    (void)strlcpy(fw_name, pCtx->szBundleImage, fw_name_size);
+    VND_LOGI("Auto-selected Firmware= %s", fw_name);
+  } else if (pCtx->uiProVer == Ver3) {
     uint8_t size_of_array =
         (uint8_t)(sizeof(soc_fw_name_dict) / sizeof(soc_fw_name_dict[0]));
     for (i = 0; i < size_of_array; i++) {
-      if (soc_fw_name_dict[i].soc_id == chip_id) {
+      if (soc_fw_name_dict[i].soc_id == pCtx->chip_id) {
         memset(fw_name, 0, fw_name_size);
         (void)strlcpy(fw_name, FW_DEFAULT_PATH, fw_name_size);
         strlcat(fw_name, soc_fw_name_dict[i].default_fw_name, fw_name_size);
@@ -1915,7 +3029,7 @@ void fw_loader_get_default_fw_name(char fw_name[], uint32 fw_name_size) {
     if (i == size_of_array) {
       VND_LOGE(
           "Unable to Map Chip ID %04x to FW Name, using default FW path %s",
-          chip_id, fw_name);
+          pCtx->chip_id, fw_name);
     }
   }
 }
@@ -1930,7 +3044,7 @@ void fw_loader_get_default_fw_name(char fw_name[], uint32 fw_name_size) {
  *
  * Return Value: Pointer to FW Config CMD5 if success or NULL
  *****************************************************************************/
-static uint8* bt_get_fw_config_cmd5_data(void) {
+static uint8* bt_get_fw_config_cmd5_data(fw_upload_ctx_t* pCtx) {
   VND_LOGD("Opening CMD5 file");
   FILE* fp = fopen(pFilename_fw_init_config_bin, "r");
   uint8* ret = NULL;
@@ -1949,9 +3063,9 @@ static uint8* bt_get_fw_config_cmd5_data(void) {
       if (fseek(fp, 0, SEEK_SET) < 0) {
         VND_LOGE("fseek error: %s (%d)", strerror(errno), errno);
       }
-      ret = (uint8*)((fread(fw_init_config_bin, 1U, (size_t)data_size, fp) ==
-                      (uint32)data_size)
-                         ? fw_init_config_bin
+      ret = (uint8*)((fread(pCtx->fw_init_config_bin, 1U, (size_t)data_size,
+                            fp) == (uint32)data_size)
+                         ? pCtx->fw_init_config_bin
                          : NULL);
     } else {
       VND_LOGE("CMD5 File read error:data_size=%ld %s %d", data_size,
@@ -1975,35 +3089,367 @@ static uint8* bt_get_fw_config_cmd5_data(void) {
  * Return Value:
  *                0 if success, -1 otherwise
  *****************************************************************************/
-static int send_fw_config(void) {
+static int send_fw_config(fw_upload_ctx_t* pCtx) {
   uint16 uiLenToSend = 0;
   int ret;
-  if (uiProVer == Ver1) {
-    uiLenToSend = bt_send_cmd5_data_ver1(bt_get_fw_config_cmd5_data(), true);
+  if (pCtx->uiProVer == Ver1) {
+    uiLenToSend = bt_send_cmd5_data_ver1(pCtx, bt_get_fw_config_cmd5_data(pCtx),
+                                         true);
     if (uiLenToSend == HDR_LEN) {
       ret = 0;
     } else {
       ret = -1;
     }
-  } else if (uiProVer == Ver3) {
-    ret = bt_send_cmd5_data_ver3(bt_get_fw_config_cmd5_data(), true);
+  } else if (pCtx->uiProVer == Ver3) {
+    ret = bt_send_cmd5_data_ver3(pCtx, bt_get_fw_config_cmd5_data(pCtx), true);
   } else {
     ret = -1;
   }
   if (ret == 0) {
     VND_LOGV(" ========== Download Complete FW CONFIG=========");
   } else {
-    VND_LOGD("Sending FW config CMD5 FAILED protocol version %d", uiProVer + 1);
+    VND_LOGD("Sending FW config CMD5 FAILED protocol version %d",
+             pCtx->uiProVer + 1);
   }
 
   return ret;
 }
 /******************************************************************************
  *
- * Name: fw_upload_FW
+ * Name: fw_upload_PrepareImage
  *
  * Description:
- *   This function performs the task of FW load over UART.
+ *   This function opens, maps and checks the image to download.
+ *
+ * Conditions For Use:
+ *   Runs on the thread started by bt_vnd_mrvl_prepare_fw().
+ *
+ * Arguments:
+ *   pArg: the fw_upload_prep_t naming the image.
+ *
+ * Return Value:
+ *   NULL.
+ *
+ * Notes:
+ *   The outcome is left in the fw_upload_prep_t. The image is split into
+ *   blocks by fw_upload_V1Serve(), only a V1 bootloader needs them.
+ *
+ *****************************************************************************/
+static void* fw_upload_PrepareImage(void* pArg) {
+  fw_upload_prep_t* pPrep = (fw_upload_prep_t*)pArg;
+  uint32 ulResult;
+
+  if (pPrep->iBundleEntry >= 0) {
+    ulResult = fw_upload_BundleImage(&fwBundle, (uint32)pPrep->iBundleEntry,
+                                     &pPrep->image);
+  } else {
+    pPrep->pFile = fopen(pPrep->szFileName, "rb");
+    if (pPrep->pFile == NULL) {
+      VND_LOGE("%s file open failed", pPrep->szFileName);
+      VND_LOGE("Error: %s (%d)", strerror(errno), errno);
+      ulResult = OPEN_FILE_FAIL;
+    } else {
+      ulResult = fw_upload_ImageOpen(&pPrep->image, pPrep->pFile);
+    }
+  }
+  if (ulResult == DOWNLOAD_SUCCESS) {
+    // Bundle images are all in the block format
+    ulResult = fw_upload_ImageVerify(&pPrep->image, pPrep->iBundleEntry >= 0);
+  }
+  pPrep->ulResult = ulResult;
+  pPrep->ullReadyNs = fw_upload_GetTimeNs();
+  return NULL;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_PrepareWait
+ *
+ * Description:
+ *   This function waits until the image started by bt_vnd_mrvl_prepare_fw()
+ *   is ready.
+ *
+ * Conditions For Use:
+ *   bt_vnd_mrvl_prepare_fw() has been called.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS or the error met while preparing the image.
+ *
+ * Notes:
+ *   Logs how much of the preparation ran behind the bootloader handshake.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_PrepareWait(fw_upload_ctx_t* pCtx) {
+  uint64 ullWaitNs = fw_upload_GetTimeNs();
+  uint64 ullPrepNs;
+
+  if (pCtx->imagePrep.bThread) {
+    pthread_join(pCtx->imagePrep.thread, NULL);
+    pCtx->imagePrep.bThread = false;
+  }
+  ullWaitNs = fw_upload_GetTimeNs() - ullWaitNs;
+  ullPrepNs = pCtx->imagePrep.ullReadyNs - pCtx->imagePrep.ullStartNs;
+  VND_LOGD("Image prepared in %llu us, waited %llu us, %llu us hidden",
+           ullPrepNs / 1000, ullWaitNs / 1000,
+           (ullPrepNs > ullWaitNs) ? (ullPrepNs - ullWaitNs) / 1000 : 0ULL);
+  return pCtx->imagePrep.ulResult;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_V1Serve
+ *
+ * Description:
+ *   Answers an 0xa5 request of the V1 bootloader, sending block after block
+ *   until it asks for nothing more.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage:       image being sent.
+ *   bReadRequest: read the length of the request, else a header is asked
+ *                 for.
+ *   pbDone:       set once the image has been sent.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS or the error that ends the download.
+ *
+ * Notes:
+ *   The image is indexed on the first request, V2 and V3 images are not
+ *   in the V1 block format. A compressed image is not indexed, its blocks
+ *   are staged as they are requested so each chunk is decompressed once.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_V1Serve(fw_upload_ctx_t* pCtx,
+                                const fw_upload_image_t* pImage,
+                                bool bReadRequest, bool* pbDone) {
+  uint16 uiLenToSend = (uint16)HDR_LEN;
+  uint32 ulResult;
+
+  // Read the 'Length' bytes requested by Helper
+  if (bReadRequest) {
+    uiLenToSend = fw_upload_WaitFor_Len(pCtx);
+    if (uiLenToSend == 1) {
+      return DOWNLOAD_SUCCESS;
+    }
+  }
+  if ((pCtx->pV1Blocks == NULL) && (pImage->pLz == NULL)) {
+    pCtx->pV1Blocks = fw_upload_ImageIndex(pImage, &pCtx->uiV1Blocks,
+                                           &ulResult);
+    if (pCtx->pV1Blocks == NULL) {
+      return ulResult;
+    }
+  }
+
+  VND_LOGV("Number of bytes to be downloaded: %8u\r", pCtx->uiTotalFileSize);
+  fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+  do {
+    if (uiLenToSend > pCtx->uiTotalFileSize) {
+      return INVALID_LEN_TO_SEND;
+    }
+    uiLenToSend = fw_upload_V1SendLenBytes(pCtx, pImage, uiLenToSend);
+    if (pCtx->bNoMemory) {
+      return MALLOC_RETURNED_NULL;
+    }
+    if (pCtx->bImageCorrupt) {
+      return IMAGE_CRC_CHECK_FAIL;
+    }
+    if (pCtx->bWriteFailed) {
+      return WRITE_PORT_FAIL;
+    }
+    pCtx->uiBlocksSent++;
+    fw_upload_Progress(pCtx, false, DOWNLOAD_SUCCESS);
+  } while (uiLenToSend != 0);
+  VND_LOGV("File downloaded: %8u:%8u\r", pCtx->ulCurrFileSize,
+           pCtx->uiTotalFileSize);
+  // If the Length requested is 0, download is complete.
+  *pbDone = true;
+  return DOWNLOAD_SUCCESS;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_V2Serve
+ *
+ * Description:
+ *   Answers an 0xa6 request of the V2 helper: a length, an offset and an
+ *   error code, each followed by its complement.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage:       image being sent.
+ *   bReadRequest: unused, the helper needs no setup before the download.
+ *   pbDone:       set once the image has been sent.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS or the error that ends the download.
+ *
+ * Notes:
+ *   A length of 0 ends the download, the number of bytes sent is then
+ *   returned to the helper. It is over unless the helper asks again or
+ *   starts over.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_V2Serve(fw_upload_ctx_t* pCtx,
+                                const fw_upload_image_t* pImage,
+                                bool bReadRequest, bool* pbDone) {
+  uint16 uiLenToSend;
+  uint32 ulOffset;
+  uint16 uiErrCode;
+
+  (void)bReadRequest;
+  uiLenToSend = fw_upload_WaitFor_Len(pCtx);
+  if ((uiLenToSend == 1) || (pCtx->ucRcvdHeader != V2_HEADER_DATA_REQ)) {
+    // An 0xaa, or an 0xa5 left over from the boot ROM, was acked
+    return DOWNLOAD_SUCCESS;
+  }
+  ulOffset = fw_upload_WaitFor_Offset(pCtx);
+  uiErrCode = fw_upload_WaitFor_ErrCode(pCtx);
+  if (uiErrCode == 0) {
+    if (uiLenToSend != 0) {
+      fw_upload_V2SendLenBytes(pCtx, pImage, uiLenToSend, ulOffset);
+      if (pCtx->bNoMemory) {
+        return MALLOC_RETURNED_NULL;
+      }
+      if (pCtx->bImageCorrupt) {
+        return IMAGE_CRC_CHECK_FAIL;
+      }
+      pCtx->uiBlocksSent++;
+      fw_upload_Progress(pCtx, false, DOWNLOAD_SUCCESS);
+      VND_LOGV("sent %u bytes..", ulOffset);
+    } else {
+      // download complete
+      fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+      fw_upload_SendIntBytes(pCtx, pCtx->ulCurrFileSize);
+      // Done unless the helper asks for something else or starts over
+      if (!fw_upload_PaceWait(pCtx, 1, V2_RETRY_DELAY) &&
+          !fw_upload_V2Restarted(pCtx)) {
+        *pbDone = true;
+      }
+    }
+  } else {
+    /*wait until multiple uiErrCode == 1 have been sent, if we get
+     *uiErrCode = 1 again after that, we consider 0x6b is missing.
+     */
+    fw_upload_PaceWait(pCtx, 0, V2_RETRY_DELAY);
+    fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+    fw_upload_SendIntBytes(pCtx, ulOffset);
+  }
+  VND_LOGV("File downloaded: %8u:%8u\r", pCtx->ulCurrFileSize,
+           pCtx->uiTotalFileSize);
+
+  // Ensure any pending write data is completely written
+  if (0 != fw_upload_ComDrain(pCtx->iFd)) {
+    VND_LOGV("tcdrain failed. Errno = %s (%d)", strerror(errno), errno);
+  }
+  return DOWNLOAD_SUCCESS;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_V3Serve
+ *
+ * Description:
+ *   Answers an 0xa7 request of the V3 bootloader.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pImage:       image being sent.
+ *   bReadRequest: unused, the request is read by fw_upload_WaitFor_Req().
+ *   pbDone:       set once the image has been sent.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS or the error that ends the download.
+ *
+ * Notes:
+ *   A BT MIC failure makes the bootloader ask for the image from its start.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_V3Serve(fw_upload_ctx_t* pCtx,
+                                const fw_upload_image_t* pImage,
+                                bool bReadRequest, bool* pbDone) {
+  FILE* pFile = pCtx->imagePrep.pFile;
+
+  (void)bReadRequest;
+  if (!fw_upload_WaitFor_Req(pCtx, 0)) {
+    VND_LOGE("Error occurred in fw_upload_WaitFor_Req function");
+  } else if (pCtx->uiNewLen != 0) {
+    if (pCtx->uiNewError == 0) {
+      VND_LOGV(" === Succ: REQ = 0xA7, Errcode = 0 ");
+      fw_upload_V3SendLenBytes(pCtx, pImage, pCtx->uiNewLen,
+                               pCtx->ulNewOffset);
+      if (pCtx->bNoMemory) {
+        return MALLOC_RETURNED_NULL;
+      }
+      if (pCtx->bImageCorrupt) {
+        return IMAGE_CRC_CHECK_FAIL;
+      }
+      pCtx->uiBlocksSent++;
+      fw_upload_Progress(pCtx, false, DOWNLOAD_SUCCESS);
+
+      VND_LOGV(" sent %d bytes..", pCtx->uiNewLen);
+    } else  // NAK,TIMEOUT,INVALID COMMAND...
+    {
+      VND_LOGV(" === Fail: REQ = 0xA7, Errcode != 0 ");
+      fw_upload_ComFlush(pCtx->iFd, TCIFLUSH);
+      fw_upload_StatsRequest(pCtx, 0, pCtx->uiNewError, false,
+                             fw_upload_GetTimeNs());
+      fw_upload_Send_Ack(pCtx, V3_TIMEOUT_ACK, NULL, 0);
+      if (pCtx->uiNewError & BT_MIC_FAIL_BIT) {
+        pCtx->change_baudrate_buffer_len = 0;
+        pCtx->cmd5_len = 0;
+        pCtx->ulCurrFileSize = 0;
+        pCtx->ulLastOffsetToSend = 0xFFFF;
+      }
+    }
+  } else {
+    /* check if download complete */
+    fw_upload_StatsRequest(pCtx, 0, pCtx->uiNewError, false,
+                           fw_upload_GetTimeNs());
+    if (pCtx->uiNewError == 0) {
+      fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, NULL, 0);
+      *pbDone = true;
+      return DOWNLOAD_SUCCESS;
+    } else if (pCtx->uiNewError & BT_MIC_FAIL_BIT) {
+      fw_upload_Send_Ack(pCtx, V3_REQUEST_ACK, NULL, 0);
+      if ((pFile != NULL) && (fseek(pFile, 0, SEEK_SET) < 0)) {
+        VND_LOGE("fseek error: %s (%d)", strerror(errno), errno);
+      }
+      pCtx->change_baudrate_buffer_len = 0;
+      pCtx->cmd5_len = 0;
+      pCtx->ulCurrFileSize = 0;
+      pCtx->ulLastOffsetToSend = 0xFFFF;
+    } else {
+      VND_LOGV("Non-empty terminating else statement uiNewError = %d",
+               pCtx->uiNewError);
+    }
+  }
+  VND_LOGV("File downloaded: %8u:%8u\r", pCtx->ulCurrFileSize,
+           pCtx->uiTotalFileSize);
+  return DOWNLOAD_SUCCESS;
+}
+
+// Protocol of each bootloader version, picked by the header signature wait
+static const fw_upload_protocol_t fwProtocols[] = {
+    [Ver1] = {"V1", fw_upload_V1Serve, MAX_CTS_TIMEOUT},
+    [Ver2] = {"V2 helper", fw_upload_V2Serve, V2_MAX_CTS_TIMEOUT},
+    [Ver3] = {"V3", fw_upload_V3Serve, MAX_CTS_TIMEOUT},
+};
+
+/******************************************************************************
+ *
+ * Name: fw_upload_FW
+ *
+ * Description:
+ *   This function performs the task of FW load over UART.
  *
  * Conditions For Use:
  *   None.
@@ -2020,56 +3466,59 @@ static int send_fw_config(void) {
  *   false:           Download unsuccessfully
  *
  * Notes:
- *   None.
+ *   The image is read by bt_vnd_mrvl_prepare_fw() while the bootloader is
+ *   set up, unless the caller started that earlier, and is released before
+ *   returning.
  *
  *****************************************************************************/
-static uint32 fw_upload_FW(int8* pPortName, uint32 iBaudRate, int8* pFileName,
+static uint32 fw_upload_FW(fw_upload_ctx_t* pCtx, int8* pPortName,
+                           uint32 iBaudRate, int8* pFileName,
                            uint32 iSecondBaudRate) {
-  uint8* pFileBuffer = NULL;
-  uint32 ulReadLen = 0;
-  FILE* pFile = NULL;
-  bool bRetVal = false;
+  const fw_upload_image_t* pImage = NULL;
+  bool bDone = false;
   int32 result = 0;
-  int32 TotalFileSize;
-  uint16 uiLenToSend = (uint16)HDR_LEN;
   bool bFirstWaitHeaderSignature = true;
   bool check_sig_hdr = true;
-#if (UART_DOWNLOAD_FW == 1)
-  /*FW config CMD5 needs to be sent before Helper and Firmware only once*/
-  static bool send_fw_config_cmd5 = true;
-#endif
-  // Open File for reading.
-  pFile = fopen(pFileName, "rb");
-
-  if (pFile == NULL) {
-    VND_LOGE("%s file open failed", pFileName);
-    VND_LOGE("Error: %s (%d)", strerror(errno), errno);
-    return OPEN_FILE_FAIL;
-  }
+  // Read the image on a thread while the bootloader is set up
+  fw_upload_PrepareFw(pCtx, pFileName);
 
-  result = fw_Change_Timeout();
+  result = fw_Change_Timeout(pCtx);
 
   if (result == -1) {
-    fclose(pFile);
+    fw_upload_ReleaseFw(pCtx);
     return START_INDICATION_NOT_FOUND;
   }
+  if (pCtx->bWriteFailed) {
+    fw_upload_ReleaseFw(pCtx);
+    return WRITE_PORT_FAIL;
+  }
 
   if (result == 0) {
-    cmd7_change_timeout_len = HDR_LEN;
+    pCtx->cmd7_change_timeout_len = HDR_LEN;
     bFirstWaitHeaderSignature = false;
   }
+  VND_LOGD("Bootloader protocol %s", fwProtocols[pCtx->uiProVer].pName);
+
+  if (pCtx->bRomTimeoutPatch && (pCtx->uiProVer == Ver1)) {
+    fw_upload_SendRomTimeoutPatch(pCtx);
+  }
+
+  if (pCtx->uiProVer == Ver2) {
+    // The length of the first request is read right after its signature
+    check_sig_hdr = false;
+    if (iSecondBaudRate != 0) {
+      VND_LOGW("The helper keeps its baud rate, ignoring %u", iSecondBaudRate);
+      iSecondBaudRate = 0;
+    }
+  }
 
   if (iSecondBaudRate != 0) {
-    uint32 j = 0;
-    result = fw_Change_Baudrate(pPortName, iBaudRate, iSecondBaudRate,
-                                bFirstWaitHeaderSignature);
+    result = fw_Change_Baudrate_Ladder(pCtx, pPortName, iBaudRate,
+                                       iSecondBaudRate,
+                                       bFirstWaitHeaderSignature);
     switch (result) {
       case -1:
-        VND_LOGV("Second baud rate %d is not support", iSecondBaudRate);
-        VND_LOGV("Fw loader only supports the baud rate as");
-        for (j = 0; j < sizeof(UartCfgTbl) / sizeof(UART_BAUDRATE); j++) {
-          VND_LOGV(" %d ", UartCfgTbl[j].iBaudRate);
-        }
+        VND_LOGV("Second baud rate %d is not supported", iSecondBaudRate);
         break;
       case -2:
         VND_LOGV(
@@ -2080,260 +3529,1365 @@ static uint32 fw_upload_FW(int8* pPortName, uint32 iBaudRate, int8* pFileName,
         break;
     }
     if (result != 0) {
-      fclose(pFile);
+      fw_upload_ReleaseFw(pCtx);
       return CHANGE_BAUDRATE_FAIL;
     }
   }
 
 #if ((UART_DOWNLOAD_FW == true))
   VND_LOGD("Sending FW Config");
-  if (send_fw_config_cmd5 == true) {
-    if (send_fw_config() == 0) {
+  // The helper takes no configuration, it is sent to the image loader
+  if ((pCtx->send_fw_config_cmd5 == true) && (pCtx->uiProVer != Ver2)) {
+    if (send_fw_config(pCtx) == 0) {
       check_sig_hdr = false;
     }
-    send_fw_config_cmd5 = false;
+    pCtx->send_fw_config_cmd5 = false;
   }
 #endif
-  // Calculate the size of the file to be downloaded.
-  VND_LOGD("Opening FW file");
-  result = fseek(pFile, 0, SEEK_END);
-  if (result != 0) {
-    VND_LOGE("fseek error: %s (%d)", strerror(errno), errno);
-    fclose(pFile);
-    return FEEK_SEEK_ERROR;
-  }
-
-  TotalFileSize = (int32)ftell(pFile);
-  if (TotalFileSize == -1) {
-    VND_LOGV("Error:Download Size is 0");
-    VND_LOGE("Error: %s (%d)", strerror(errno), errno);
-    fclose(pFile);
-    return FILESIZE_IS_ZERO;
-  }
-  uiTotalFileSize = (uint32)TotalFileSize;
-  pFileBuffer = (uint8*)malloc((size_t)uiTotalFileSize);
-  if (pFileBuffer == NULL) {
-    VND_LOGV("malloc() returned NULL while allocating size for file");
-    fclose(pFile);
-    return MALLOC_RETURNED_NULL;
-  }
-
-  result = fseek(pFile, 0, SEEK_SET);
-  if (result != 0) {
-    VND_LOGE("fseek error: %s (%d)", strerror(errno), errno);
-    free(pFileBuffer);
-    fclose(pFile);
-    return FEEK_SEEK_ERROR;
-  }
 
-  if (pFileBuffer != (void*)0) {
-    ulReadLen = (uint32)fread((void*)pFileBuffer, (size_t)1,
-                              (size_t)uiTotalFileSize, pFile);
-    if (ulReadLen != uiTotalFileSize) {
-      VND_LOGV("Error:Read File Fail");
-      free(pFileBuffer);
-      fclose(pFile);
-      return READ_FILE_FAIL;
-    }
+  result = (int32)fw_upload_PrepareWait(pCtx);
+  if (result != DOWNLOAD_SUCCESS) {
+    fw_upload_ReleaseFw(pCtx);
+    return (uint32)result;
   }
-  ulCurrFileSize = 0;
-  VND_LOGD("Closing FW file");
+  pImage = &pCtx->imagePrep.image;
+  pCtx->uiTotalFileSize = pImage->uiSize;
+  pCtx->ulCurrFileSize = 0;
+  pCtx->uiV1NextBlock = 0;
 
-  while (!bRetVal) {
-    // Wait to Receive 0xa5, 0xaa, 0xab, 0xa7
+  while (!bDone) {
+    // Wait to Receive 0xa5, 0xaa, 0xa6, 0xab, 0xa7
     if (check_sig_hdr && (!iSecondBaudRate)) {
-      if (fw_upload_WaitForHeaderSignature(TIMEOUT_VAL_MILLISEC) != true) {
-        VND_LOGV("0xa5,0xaa,0xab or 0xa7 is not received in %d ms",
+      if (fw_upload_WaitForHeaderSignature(pCtx,
+                                           TIMEOUT_VAL_MILLISEC) != true) {
+        VND_LOGV("0xa5,0xaa,0xa6,0xab or 0xa7 is not received in %d ms",
                  TIMEOUT_VAL_MILLISEC);
-        free(pFileBuffer);
-        fclose(pFile);
+        fw_upload_ReleaseFw(pCtx);
         return HEADER_SIGNATURE_TIMEOUT;
       }
     }
-    if (uiProVer == Ver1) {
-      // Read the 'Length' bytes requested by Helper
-      if (check_sig_hdr) {
-        uiLenToSend = fw_upload_WaitFor_Len(pFile);
-      }
-      if (uiLenToSend == 1) {
-        continue;
-      }
-
-      VND_LOGV("Number of bytes to be downloaded: %8u\r", uiTotalFileSize);
-      tcflush(mchar_fd, TCIFLUSH);
-      do {
-        if (uiLenToSend > uiTotalFileSize) {
-          free(pFileBuffer);
-          fclose(pFile);
-          return INVALID_LEN_TO_SEND;
-        }
-        uiLenToSend = fw_upload_V1SendLenBytes(pFileBuffer, uiLenToSend);
-      } while (uiLenToSend != 0);
-      VND_LOGV("File downloaded: %8u:%8u\r", ulCurrFileSize, uiTotalFileSize);
-      // If the Length requested is 0, download is complete.
-      if (uiLenToSend == 0) {
-        bRetVal = true;
-        break;
-      }
-    } else if (uiProVer == Ver3) {
-      if (fw_upload_WaitFor_Req(0)) {
-        if (uiNewLen != 0) {
-          if (uiNewError == 0) {
-            VND_LOGV(" === Succ: REQ = 0xA7, Errcode = 0 ");
-            fw_upload_Send_Ack(V3_REQUEST_ACK);
-            fw_upload_V3SendLenBytes(pFileBuffer, uiNewLen, ulNewOffset);
-
-            VND_LOGV(" sent %d bytes..", uiNewLen);
-          } else  // NAK,TIMEOUT,INVALID COMMAND...
-          {
-            uint8 i;
-            VND_LOGV(" === Fail: REQ = 0xA7, Errcode != 0 ");
-            for (i = 0; i < 7; i++) {
-              uiErrCnt[i] += (uint8)((uiNewError >> i) & 0x1);
-            }
-            tcflush(mchar_fd, TCIFLUSH);
-            fw_upload_Send_Ack(V3_TIMEOUT_ACK);
-            if (uiNewError & BT_MIC_FAIL_BIT) {
-              change_baudrate_buffer_len = 0;
-              cmd5_len = 0;
-              ulCurrFileSize = 0;
-              ulLastOffsetToSend = 0xFFFF;
-            }
-          }
-        } else {
-          /* check if download complete */
-          if (uiNewError == 0) {
-            fw_upload_Send_Ack(V3_REQUEST_ACK);
-            bRetVal = true;
-            break;
-          } else if (uiNewError & BT_MIC_FAIL_BIT) {
-            uiErrCnt[7] += 1;
-            fw_upload_Send_Ack(V3_REQUEST_ACK);
-            if (fseek(pFile, 0, SEEK_SET) < 0) {
-              VND_LOGE("fseek error: %s (%d)", strerror(errno), errno);
-            }
-            change_baudrate_buffer_len = 0;
-            cmd5_len = 0;
-            ulCurrFileSize = 0;
-            ulLastOffsetToSend = 0xFFFF;
-          } else {
-            VND_LOGV("Non-empty terminating else statement uiNewError = %d",
-                     uiNewError);
-          }
-        }
-      } else {
-        VND_LOGE("Error occurred in fw_upload_WaitFor_Req function");
-      }
-      VND_LOGV("File downloaded: %8u:%8u\r", ulCurrFileSize, uiTotalFileSize);
-    } else {
-      VND_LOGV("%d Protocol Version not supported", uiProVer);
+    result = (int32)fwProtocols[pCtx->uiProVer].pfnServe(pCtx, pImage,
+                                                        check_sig_hdr, &bDone);
+    if ((result == DOWNLOAD_SUCCESS) && pCtx->bWriteFailed) {
+      result = WRITE_PORT_FAIL;
+    }
+    if (result != DOWNLOAD_SUCCESS) {
+      fw_upload_ReleaseFw(pCtx);
+      return (uint32)result;
     }
     iSecondBaudRate = 0;
     check_sig_hdr = true;
   }
 
-  if (pFileBuffer != NULL) {
-    free(pFileBuffer);
-    pFileBuffer = NULL;
-  }
-  fclose(pFile);
+  fw_upload_ReleaseFw(pCtx);
   return DOWNLOAD_SUCCESS;
 }
 
 /******************************************************************************
  *
- * Name: fw_upload_check_FW
+ * Name: fw_upload_CtxInit
  *
  * Description:
- *   This function performs the task of FW load over UART.
+ *   Sets a loader context to the state of a port nothing was done on yet.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   pPortName:       Com port number.
- *   iBaudRate:       the initial baud rate.
- *   ucFlowCtrl:      the flow ctrl of uart.
+ *   pCtx: the context.
+ *   iFd:  port of the controller.
  *
  * Return Value:
- *   true:            Need Download FW
- *   false:           No need Download FW
+ *   None.
  *
  * Notes:
- *   None.
+ *   The baud ladder, poke and progress settings start empty. The download
+ *   baud rate is stored in PROP_BLUETOOTH_DL_BAUDRATE and
+ *   PROP_BLUETOOTH_DL_BAUD_CLIMB.
  *
  *****************************************************************************/
-bool bt_vnd_mrvl_check_fw_status(void) {
-  bool bRetVal = false;
-
-  if (mchar_fd < 0) {
-    VND_LOGE("Port is not open or file not found");
-    return bRetVal;
-  }
-
-  // Wait to Receive 0xa5, 0xaa, 0xab, 0xa7
-  bRetVal = fw_upload_WaitForHeaderSignature(1000);
-
-  VND_LOGD("fw_upload_WaitForHeaderSignature return %d", bRetVal);
-
-  return bRetVal;
+static void fw_upload_CtxInit(fw_upload_ctx_t* pCtx, int32 iFd) {
+  memset(pCtx, 0, sizeof(*pCtx));
+  pCtx->iFd = iFd;
+  pCtx->send_fw_config_cmd5 = true;
+  pCtx->uiBaudLadderCrcThreshold = FW_UPLOAD_BAUD_LADDER_CRC_THRESHOLD;
+  (void)strlcpy(pCtx->szDlBaudProp, PROP_BLUETOOTH_DL_BAUDRATE,
+                sizeof(pCtx->szDlBaudProp));
+  (void)strlcpy(pCtx->szDlClimbProp, PROP_BLUETOOTH_DL_BAUD_CLIMB,
+                sizeof(pCtx->szDlClimbProp));
+  pCtx->iBundleEntry = -1;
+  pCtx->uiProVer = Ver1;
+  pCtx->send_poke = true;
+  pCtx->ucRcvdHeader = 0xFF;
+  pCtx->ulLastOffsetToSend = 0xFFFF;
 }
 
 /******************************************************************************
  *
- * Name: bt_vnd_mrvl_download_fw
+ * Name: fw_upload_CtxReset
  *
  * Description:
- *   Wrapper of fw_upload_FW.
+ *   Forgets the bootloader found on the port, the next header signature
+ *   wait finds out its version and chip again.
  *
  * Conditions For Use:
  *   None.
  *
  * Arguments:
- *   pPortName:       Com port number.
- *   iBaudRate:       the initial baud rate.
- *   ucFlowCtrl:      the flow ctrl of uart.
- *   pFileName:       the file name for downloading.
- *   iSecondBaudRate: the second baud rate.
+ *   pCtx: the context.
  *
  * Return Value:
- *   0:            Download successfully
- *   1:           Download unsuccessfully
+ *   None.
+ *
+ * Notes:
+ *   The settings and the prepared image are kept.
+ *
+ *****************************************************************************/
+static void fw_upload_CtxReset(fw_upload_ctx_t* pCtx) {
+  pCtx->uiProVer = Ver1;
+  pCtx->chip_id = 0;
+  pCtx->send_poke = true;
+  pCtx->bVerChecked = false;
+  pCtx->ucRcvdHeader = 0xFF;
+  pCtx->szBundleImage[0] = '\0';
+  pCtx->iBundleEntry = -1;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DefaultCtxInit
+ *
+ * Description:
+ *   Sets up the context of the bt_vnd_mrvl_*() functions that do not take
+ *   one.
+ *
+ * Conditions For Use:
+ *   Called once through defaultCtxOnce.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
  *
  * Notes:
  *   None.
  *
  *****************************************************************************/
-uint32 bt_vnd_mrvl_download_fw(int8* pPortName, uint32 iBaudrate,
-                               int8* pFileName, uint32 iSecondBaudrate) {
-  uint64 start;
-  uint64 cost;
-  uint32 ulResult;
+static void fw_upload_DefaultCtxInit(void) {
+  fw_upload_CtxInit(&defaultCtx, mchar_fd);
+}
 
-  start = fw_upload_GetTime();
+/******************************************************************************
+ *
+ * Name: fw_upload_DefaultCtx
+ *
+ * Description:
+ *   Returns the context of the bt_vnd_mrvl_*() functions that do not take
+ *   one.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   The context, on mchar_fd.
+ *
+ * Notes:
+ *   mchar_fd is read again on every call since the port may have been
+ *   reopened in between.
+ *
+ *****************************************************************************/
+static fw_upload_ctx_t* fw_upload_DefaultCtx(void) {
+  pthread_once(&defaultCtxOnce, fw_upload_DefaultCtxInit);
+  defaultCtx.iFd = mchar_fd;
+  return &defaultCtx;
+}
 
-  VND_LOGI("Protocol: NXP Proprietary");
-  VND_LOGI("FW Loader Version: %s", VERSION);
-  VND_LOGD("ComPort : %s", pPortName);
-  VND_LOGD("BaudRate: %d", iBaudrate);
+/******************************************************************************
+ *
+ * Name: fw_upload_DefaultSettings
+ *
+ * Description:
+ *   Returns the context of the bt_vnd_mrvl_*() functions that do not take
+ *   one, to read the settings made with bt_vnd_mrvl_set_*().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   The context.
+ *
+ * Notes:
+ *   Unlike fw_upload_DefaultCtx() nothing is written, so the download
+ *   threads of bt_vnd_mrvl_download_parallel() can call it together.
+ *
+ *****************************************************************************/
+static const fw_upload_ctx_t* fw_upload_DefaultSettings(void) {
+  pthread_once(&defaultCtxOnce, fw_upload_DefaultCtxInit);
+  return &defaultCtx;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ProbeFwStatus
+ *
+ * Description:
+ *   This function finds out whether the controller runs its bootloader or
+ *   firmware. An HCI reset is sent and the bootloader header signature or
+ *   the Command Complete of the firmware, whichever comes first, decides.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx: the loader context of the controller.
+ *
+ * Return Value:
+ *   FW_STATUS_BOOTLOADER: Need Download FW
+ *   FW_STATUS_RUNNING:    Firmware answered, no need Download FW
+ *   FW_STATUS_UNKNOWN:    Nothing answered in FW_STATUS_PROBE_MS
+ *
+ * Notes:
+ *   When the bootloader is poked, the HCI reset is only waited for during
+ *   FW_STATUS_HCI_PROBE_MS, the poke then goes out as before.
+ *
+ *****************************************************************************/
+static fw_upload_fw_status_t fw_upload_ProbeFwStatus(fw_upload_ctx_t* pCtx) {
+  uint64 start = fw_upload_GetTimeNs();
+  fw_upload_deadline_t deadline;
+  fw_upload_deadline_t probeDeadline;
+  fw_upload_fw_status_t status = FW_STATUS_UNKNOWN;
+  int32 iResult;
+
+  if (pCtx->iFd < 0) {
+    VND_LOGE("Port is not open or file not found");
+    return status;
+  }
+
+  fw_upload_DeadlineInit(&deadline, FW_STATUS_PROBE_MS, NULL);
+  fw_upload_DeadlineInit(
+      &probeDeadline,
+      enable_poke_controller ? FW_STATUS_HCI_PROBE_MS : FW_STATUS_PROBE_MS,
+      &deadline);
+  iResult = fw_upload_ComProbeHci(pCtx->iFd, HCI_CMD_NXP_RESET,
+                                  ucBootSignatures, sizeof(ucBootSignatures),
+                                  &probeDeadline);
+  if (iResult == FW_UPLOAD_PROBE_HCI_EVENT) {
+    status = FW_STATUS_RUNNING;
+  } else if (((iResult >= 0) || enable_poke_controller) &&
+             fw_upload_WaitForHeaderSignatureUntil(pCtx, &deadline)) {
+    // Wait to Receive 0xa5, 0xaa, 0xab, 0xa7
+    status = FW_STATUS_BOOTLOADER;
+  }
+
+  VND_LOGD("Controller state %s, decided in %llu us",
+           (status == FW_STATUS_RUNNING)      ? "firmware"
+           : (status == FW_STATUS_BOOTLOADER) ? "bootloader"
+                                              : "unknown",
+           (fw_upload_GetTimeNs() - start) / 1000);
+  return status;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_probe_fw_status
+ *
+ * Description:
+ *   This function finds out whether the controller on mchar_fd runs its
+ *   bootloader or firmware.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   See fw_upload_ProbeFwStatus().
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+fw_upload_fw_status_t bt_vnd_mrvl_probe_fw_status(void) {
+  return fw_upload_ProbeFwStatus(fw_upload_DefaultCtx());
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_check_FW
+ *
+ * Description:
+ *   This function performs the task of FW load over UART.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pPortName:       Com port number.
+ *   iBaudRate:       the initial baud rate.
+ *   ucFlowCtrl:      the flow ctrl of uart.
+ *
+ * Return Value:
+ *   true:            Need Download FW
+ *   false:           No need Download FW
+ *
+ * Notes:
+ *   See bt_vnd_mrvl_probe_fw_status().
+ *
+ *****************************************************************************/
+bool bt_vnd_mrvl_check_fw_status(void) {
+  return bt_vnd_mrvl_probe_fw_status() == FW_STATUS_BOOTLOADER;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_LogBlockStats
+ *
+ * Description:
+ *   Logs the request counters and histograms of the last V3 download.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Comparing the host turnaround with the port write time shows whether
+ *   the host or the wire limits the download.
+ *
+ *****************************************************************************/
+static void fw_upload_LogBlockStats(fw_upload_ctx_t* pCtx) {
+  const uint32* pBits = pCtx->blockStats.uiErrBitCnt;
+
+  if (pCtx->blockStats.uiRequests == 0) {
+    return;
+  }
+  VND_LOGD("V3: %u requests, %u blocks (%u resent), %llu bytes, "
+           "%u with errors, %u bad CRC",
+           pCtx->blockStats.uiRequests, pCtx->blockStats.uiBlocks,
+           pCtx->blockStats.uiRetransmits, pCtx->blockStats.ullBytes,
+           pCtx->blockStats.uiErrRequests, pCtx->blockStats.uiCrcErrors);
+  if (pCtx->blockStats.uiErrRequests != 0) {
+    VND_LOGD("V3 errors: crc %u, nak %u, ack timeout %u, header timeout %u, "
+             "data timeout %u, invalid cmd %u, wifi mic %u, bt mic %u",
+             pBits[0], pBits[1], pBits[2], pBits[3], pBits[4], pBits[5],
+             pBits[6], pBits[7]);
+  }
+  fw_upload_HistLog("V3 request to ack", "us", &pCtx->blockStats.reqToAck);
+  fw_upload_HistLog("V3 ack to data written", "us",
+                    &pCtx->blockStats.ackToData);
+  fw_upload_HistLog("V3 block length", "bytes", &pCtx->blockStats.blockLen);
+  VND_LOGD("V3 host turnaround %llu us, port writes %llu us",
+           pCtx->blockStats.reqToAck.ullTotal,
+           pCtx->blockStats.ackToData.ullTotal);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_SetBaudLadder
+ *
+ * Description:
+ *   Replaces the download baud rates of a context.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx:       the loader context.
+ *   pBaudRates: the baud rates, in any order.
+ *   uiCount:    number of baud rates, those past
+ *               FW_UPLOAD_MAX_BAUD_LADDER are ignored.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static void fw_upload_SetBaudLadder(fw_upload_ctx_t* pCtx,
+                                    const uint32* pBaudRates,
+                                    uint32 uiCount) {
+  uint32 i;
+
+  pCtx->uiBaudLadderLen = 0;
+  for (i = 0; (i < uiCount) && (i < FW_UPLOAD_MAX_BAUD_LADDER); i++) {
+    fw_upload_LadderInsert(pCtx, pBaudRates[i]);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_set_baud_ladder
+ *
+ * Description:
+ *   Sets the baud rates to try for the download, on top of iSecondBaudRate.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pBaudRates:     the baud rates, in any order.
+ *   uiCount:        number of baud rates, at most FW_UPLOAD_MAX_BAUD_LADDER.
+ *   uiCrcThreshold: CRC errors tolerated before the next download starts
+ *                   at a slower rate.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Only used when bt_vnd_mrvl_download_fw() gets a second baud rate.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_set_baud_ladder(const uint32* pBaudRates, uint32 uiCount,
+                                 uint32 uiCrcThreshold) {
+  fw_upload_ctx_t* pCtx = fw_upload_DefaultCtx();
+
+  fw_upload_SetBaudLadder(pCtx, pBaudRates, uiCount);
+  pCtx->uiBaudLadderCrcThreshold = uiCrcThreshold;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_set_progress
+ *
+ * Description:
+ *   Sets where the progress of the next downloads is published.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pfnCb:        called with the progress, NULL if none.
+ *   pCbCtx:       passed to pfnCb.
+ *   uiIntervalMs: time between two reports during a download.
+ *   pStatsFile:   file rewritten with every report, NULL or empty if none.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The progress is published at most once per interval while blocks are
+ *   sent, and once more when the download is over.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_set_progress(fw_upload_progress_cb_t pfnCb, void* pCbCtx,
+                              uint32 uiIntervalMs, const char* pStatsFile) {
+  fw_upload_ctx_t* pCtx = fw_upload_DefaultCtx();
+
+  pCtx->pfnProgress = pfnCb;
+  pCtx->pProgressCtx = pCbCtx;
+  pCtx->uiProgressIntervalMs = uiIntervalMs;
+  pCtx->szProgressFile[0] = '\0';
+  if (pStatsFile != NULL) {
+    (void)strlcpy(pCtx->szProgressFile, pStatsFile,
+                  sizeof(pCtx->szProgressFile));
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_set_poke_backoff
+ *
+ * Description:
+ *   Sets the intervals after which an unanswered poke is sent again.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pIntervalsMs: ms to wait after each poke, the last one repeating.
+ *   uiCount:      number of intervals, at most FW_UPLOAD_MAX_POKE_BACKOFF.
+ *                 0 sends a single poke.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Only used with enable_poke_controller. Intervals of 0 are raised to
+ *   1 ms.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_set_poke_backoff(const uint32* pIntervalsMs,
+                                  uint32 uiCount) {
+  fw_upload_ctx_t* pCtx = fw_upload_DefaultCtx();
+  uint32 i;
+
+  pCtx->uiPokeBackoffLen = 0;
+  for (i = 0; (i < uiCount) && (i < FW_UPLOAD_MAX_POKE_BACKOFF); i++) {
+    pCtx->uiPokeBackoff[pCtx->uiPokeBackoffLen++] =
+        (pIntervalsMs[i] != 0) ? pIntervalsMs[i] : 1;
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_set_rom_timeout_patch
+ *
+ * Description:
+ *   Sets whether the request timeout of the 8887 ROM bootloader is raised
+ *   before a version 1 download.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   bEnable: true to send the patch.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Only 8887 ROMs understand the patch, see fw_upload_SendRomTimeoutPatch().
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_set_rom_timeout_patch(bool bEnable) {
+  fw_upload_DefaultCtx()->bRomTimeoutPatch = bEnable;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_port_opened
+ *
+ * Description:
+ *   Notes that the port to the controller has just been opened, the time
+ *   until the bootloader is first heard from is logged.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_port_opened(void) {
+  fw_upload_ctx_t* pCtx = fw_upload_DefaultCtx();
+
+  pCtx->ullPortOpenNs = fw_upload_GetTimeNs();
+  pCtx->uiPokesSent = 0;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_get_download_stats
+ *
+ * Description:
+ *   Returns the request counters and histograms of the last V3 download.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pStats: filled with the counters, all zero if the last download did not
+ *           use the V3 protocol.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The counters are reset by bt_vnd_mrvl_download_fw().
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_get_download_stats(fw_upload_block_stats_t* pStats) {
+  *pStats = fw_upload_DefaultCtx()->blockStats;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_open_fw_bundle
+ *
+ * Description:
+ *   This function maps a bundle of firmware images for several chips, the
+ *   image of the chip is then selected as soon as the V3 start indication
+ *   names it.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pFileName: the bundle file.
+ *
+ * Return Value:
+ *   true if the bundle can be used.
+ *
+ * Notes:
+ *   The bundle stays mapped, opening the same file again does nothing.
+ *   Chips the bundle has no image for use fw_loader_get_default_fw_name().
+ *
+ *****************************************************************************/
+bool bt_vnd_mrvl_open_fw_bundle(int8* pFileName) {
+  fw_upload_ctx_t* pCtx = fw_upload_DefaultCtx();
+  FILE* pFile;
+  uint32 ulResult;
+
+  if ((fwBundle.pData != NULL) && (strcmp(szBundlePath, pFileName) == 0)) {
+    return true;
+  }
+  fw_upload_ReleaseFw(pCtx);
+  fw_upload_BundleClose(&fwBundle);
+  pCtx->szBundleImage[0] = '\0';
+  pCtx->iBundleEntry = -1;
+  pFile = fopen(pFileName, "rb");
+  if (pFile == NULL) {
+    VND_LOGE("%s file open failed", pFileName);
+    VND_LOGE("Error: %s (%d)", strerror(errno), errno);
+    return false;
+  }
+  ulResult = fw_upload_BundleOpen(&fwBundle, pFile);
+  fclose(pFile);
+  if (ulResult != DOWNLOAD_SUCCESS) {
+    VND_LOGE("%s is not usable, error %u", pFileName, ulResult);
+    return false;
+  }
+  (void)strlcpy(szBundlePath, pFileName, sizeof(szBundlePath));
+  return true;
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_PrepareFw
+ *
+ * Description:
+ *   This function starts reading the image of the next download on a
+ *   thread, so that it is ready by the time the bootloader asks for it.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx:      the loader context of the download.
+ *   pFileName: the file name for downloading.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Nothing is done if pFileName is being prepared already. Errors are
+ *   reported by the bt_vnd_mrvl_download_fw() that uses the image. If the
+ *   thread cannot be started the image is prepared before returning.
+ *
+ *****************************************************************************/
+static void fw_upload_PrepareFw(fw_upload_ctx_t* pCtx, int8* pFileName) {
+  if (pCtx->imagePrep.bStarted) {
+    if (strcmp(pCtx->imagePrep.szFileName, pFileName) == 0) {
+      return;
+    }
+    fw_upload_ReleaseFw(pCtx);
+  }
+  memset(&pCtx->imagePrep, 0, sizeof(pCtx->imagePrep));
+  (void)strlcpy(pCtx->imagePrep.szFileName, pFileName,
+                sizeof(pCtx->imagePrep.szFileName));
+  pCtx->imagePrep.iBundleEntry = -1;
+  if ((pCtx->szBundleImage[0] != '\0') && (strcmp(pFileName,
+                                                  pCtx->szBundleImage) == 0)) {
+    pCtx->imagePrep.iBundleEntry = pCtx->iBundleEntry;
+  }
+  pCtx->imagePrep.bStarted = true;
+  pCtx->imagePrep.ullStartNs = fw_upload_GetTimeNs();
+  if (pthread_create(&pCtx->imagePrep.thread, NULL, fw_upload_PrepareImage,
+                     &pCtx->imagePrep) == 0) {
+    pCtx->imagePrep.bThread = true;
+  } else {
+    VND_LOGW("Image thread not started, preparing %s now", pFileName);
+    fw_upload_PrepareImage(&pCtx->imagePrep);
+  }
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_prepare_fw
+ *
+ * Description:
+ *   This function starts reading the image of the next download on
+ *   mchar_fd, see fw_upload_PrepareFw().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pFileName: the file name for downloading.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_prepare_fw(int8* pFileName) {
+  fw_upload_PrepareFw(fw_upload_DefaultCtx(), pFileName);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_ReleaseFw
+ *
+ * Description:
+ *   This function releases the image started by fw_upload_PrepareFw() and
+ *   the staging buffer of the download.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx: the loader context of the download.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   Waits for the thread if it is still reading the image. Nothing else is
+ *   done if no image is prepared.
+ *
+ *****************************************************************************/
+static void fw_upload_ReleaseFw(fw_upload_ctx_t* pCtx) {
+  free(pCtx->pByteBuffer);
+  pCtx->pByteBuffer = NULL;
+  pCtx->uiByteBufferSize = 0;
+  if (!pCtx->imagePrep.bStarted) {
+    return;
+  }
+  if (pCtx->imagePrep.bThread) {
+    pthread_join(pCtx->imagePrep.thread, NULL);
+  }
+  fw_upload_ImageIndexRelease(pCtx->pV1Blocks);
+  pCtx->pV1Blocks = NULL;
+  pCtx->uiV1Blocks = 0;
+  fw_upload_ImageClose(&pCtx->imagePrep.image);
+  if (pCtx->imagePrep.pFile != NULL) {
+    fclose(pCtx->imagePrep.pFile);
+  }
+  memset(&pCtx->imagePrep, 0, sizeof(pCtx->imagePrep));
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_release_fw
+ *
+ * Description:
+ *   This function releases the image started by bt_vnd_mrvl_prepare_fw().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   None.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_release_fw(void) {
+  fw_upload_ReleaseFw(fw_upload_DefaultCtx());
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_DownloadFw
+ *
+ * Description:
+ *   Wrapper of fw_upload_FW.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx:            the loader context of the controller.
+ *   pPortName:       Com port number.
+ *   iBaudRate:       the initial baud rate.
+ *   ucFlowCtrl:      the flow ctrl of uart.
+ *   pFileName:       the file name for downloading.
+ *   iSecondBaudRate: the second baud rate.
+ *
+ * Return Value:
+ *   0:            Download successfully
+ *   1:           Download unsuccessfully
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+static uint32 fw_upload_DownloadFw(fw_upload_ctx_t* pCtx, int8* pPortName,
+                                   uint32 iBaudrate, int8* pFileName,
+                                   uint32 iSecondBaudrate) {
+  uint64 start;
+  uint64 cost;
+  uint32 ulResult;
+  fw_upload_rx_stats_t rxStats;
+  fw_upload_tx_stats_t txStats;
+  uint64 ctsLowMs = 0;
+  uint32 ctsTimeoutMs;
+
+  start = fw_upload_GetTime();
+  pCtx->ulCurrFileSize = 0;
+  pCtx->ulLastOffsetToSend = 0xFFFF;
+  pCtx->ulLastBlockPos = 0;
+  pCtx->change_baudrate_buffer_len = 0;
+  pCtx->cmd7_change_timeout_len = 0;
+  pCtx->cmd5_len = 0;
+  pCtx->cmd7_Req = false;
+  pCtx->EntryPoint_Req = false;
+  pCtx->uiErrCase = false;
+  pCtx->b16BytesData = false;
+  pCtx->bNoMemory = false;
+  pCtx->bWriteFailed = false;
+  pCtx->bImageCorrupt = false;
+  pCtx->uiBlocksSent = 0;
+  pCtx->ullSendCpuNs = 0;
+  pCtx->uiDlBaudRate = 0;
+  pCtx->uiDlBaudStored = 0;
+  pCtx->uiV1Resends = 0;
+  pCtx->uiV1StaleRequests = 0;
+  pCtx->ullV1ResyncNs = 0;
+  pCtx->ullPaceWaitNs = 0;
+  pCtx->uiPaceFixedMs = 0;
+  pCtx->uiProgressBaud = iBaudrate;
+  pCtx->ullProgressStartNs = fw_upload_GetTimeNs();
+  pCtx->ullProgressNextNs =
+      pCtx->ullProgressStartNs + pCtx->uiProgressIntervalMs * NSEC_PER_MSEC;
+  memset(&pCtx->blockStats, 0, sizeof(pCtx->blockStats));
+  fw_upload_ResetRxStats();
+  fw_upload_ResetTxStats();
+
+  VND_LOGI("Protocol: NXP Proprietary");
+  VND_LOGI("FW Loader Version: %s", VERSION);
+  VND_LOGD("ComPort : %s", pPortName);
+  VND_LOGD("BaudRate: %d", iBaudrate);
   VND_LOGD("Filename: %s", pFileName);
   VND_LOGD("iSecondBaudrate: %u", iSecondBaudrate);
 
-  ulResult = fw_upload_FW(pPortName, iBaudrate, pFileName, iSecondBaudrate);
+  ulResult = fw_upload_FW(pCtx, pPortName, iBaudrate, pFileName,
+                          iSecondBaudrate);
+  // A final ack may still wait for a data block that never comes
+  fw_upload_ComSendQueued(pCtx->iFd);
+  fw_upload_Progress(pCtx, true, ulResult);
+  fw_upload_LogBlockStats(pCtx);
   if (ulResult == 0) {
     VND_LOGI("Download Complete");
+    fw_upload_RememberBaudRate(pCtx);
     cost = fw_upload_GetTime() - start;
     VND_LOGD("time:%llu", cost);
-    if (fw_upload_ComGetCTS_after_fw_dwnl(mchar_fd, MAX_CTS_TIMEOUT) == true) {
-      VND_LOGD("CTS is low");
+    fw_upload_GetRxStats(&rxStats);
+    VND_LOGD("RX: %llu reads, %llu ioctls, %llu polls, %llu bytes, %u blocks",
+             rxStats.ulReadCalls, rxStats.ulIoctlCalls, rxStats.ulPollCalls,
+             rxStats.ulBytesRead, pCtx->uiBlocksSent);
+    fw_upload_GetTxStats(&txStats);
+    VND_LOGD("TX: %llu writes, %llu bytes (%llu B/s), %llu short writes, "
+             "%llu us blocked",
+             txStats.ulWriteCalls, txStats.ulBytesWritten,
+             cost ? (txStats.ulBytesWritten * 1000 / cost) : 0ULL,
+             txStats.ulShortWrites, txStats.ulBlockedUs);
+    VND_LOGD("Send path: %llu ns CPU per block", pCtx->uiBlocksSent
+             ? (pCtx->ullSendCpuNs / pCtx->uiBlocksSent) : 0ULL);
+    if (pCtx->uiV1Resends > 0) {
+      VND_LOGD("V1 resync: %u resends, %u stale requests, %llu ns CPU",
+               pCtx->uiV1Resends, pCtx->uiV1StaleRequests, pCtx->ullV1ResyncNs);
+    }
+    if (pCtx->uiProVer == Ver2) {
+      VND_LOGD("Pacing: waited %llu ms, fixed delays took %u ms",
+               pCtx->ullPaceWaitNs / NSEC_PER_MSEC, pCtx->uiPaceFixedMs);
+    }
+    ctsTimeoutMs = fwProtocols[pCtx->uiProVer].uiCtsTimeoutMs;
+    if (fw_upload_ComGetCTS_after_fw_dwnl(pCtx->iFd, ctsTimeoutMs,
+                                          &ctsLowMs) == true) {
+      VND_LOGD("CTS is low %llu ms after download", ctsLowMs);
     } else {
-      VND_LOGE("wait CTS low timeout. Timeout_duration = %d", MAX_CTS_TIMEOUT);
+      VND_LOGE("wait CTS low timeout. Timeout_duration = %u", ctsTimeoutMs);
     }
   } else {
     VND_LOGV("Download Error, Error code = %d", ulResult);
+    // The retry finds out the bootloader again
+    fw_upload_CtxReset(pCtx);
     return ulResult;
   }
 
-  bVerChecked = false;
+  pCtx->bVerChecked = false;
   return 0;
 }
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_download_fw
+ *
+ * Description:
+ *   Downloads pFileName to the controller on mchar_fd, see
+ *   fw_upload_DownloadFw().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pPortName:       Com port number.
+ *   iBaudRate:       the initial baud rate.
+ *   pFileName:       the file name for downloading.
+ *   iSecondBaudRate: the second baud rate.
+ *
+ * Return Value:
+ *   0:            Download successfully
+ *   1:           Download unsuccessfully
+ *
+ * Notes:
+ *   mchar_fd is updated if the port had to be reopened.
+ *
+ *****************************************************************************/
+uint32 bt_vnd_mrvl_download_fw(int8* pPortName, uint32 iBaudrate,
+                               int8* pFileName, uint32 iSecondBaudrate) {
+  fw_upload_ctx_t* pCtx = fw_upload_DefaultCtx();
+  uint32 ulResult;
+
+  ulResult = fw_upload_DownloadFw(pCtx, pPortName, iBaudrate, pFileName,
+                                  iSecondBaudrate);
+  mchar_fd = pCtx->iFd;
+  return ulResult;
+}
+
+/******************************************************************************
+ *
+ * Function:      fw_loader_get_default_fw_name
+ *
+ * Description:   Incase bootcode version 3 is used get default FW Path, or
+ *                the image of the chip in the firmware bundle.
+ *
+ * Arguments:
+ * fw_name : Pointer to Firmware Path array.
+ * fw_name_size: Size of fw_name.
+ *
+ * Return Value: NA
+ *****************************************************************************/
+void fw_loader_get_default_fw_name(char fw_name[], uint32 fw_name_size) {
+  fw_upload_DefaultFwName(fw_upload_DefaultCtx(), fw_name, fw_name_size);
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_loader_create
+ *
+ * Description:
+ *   Creates a loader context for the controller on iFd, so that several
+ *   controllers can be handled at the same time.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   iFd: port of the controller, opened by the caller.
+ *
+ * Return Value:
+ *   The context, NULL if out of memory.
+ *
+ * Notes:
+ *   The baud ladder, poke backoff, ROM patch and progress settings are
+ *   copied from the bt_vnd_mrvl_set_*() ones. Free with
+ *   bt_vnd_mrvl_loader_destroy().
+ *
+ *****************************************************************************/
+fw_upload_ctx_t* bt_vnd_mrvl_loader_create(int32 iFd) {
+  const fw_upload_ctx_t* pDefault = fw_upload_DefaultSettings();
+  fw_upload_ctx_t* pCtx;
+
+  pCtx = (fw_upload_ctx_t*)malloc(sizeof(*pCtx));
+  if (pCtx == NULL) {
+    VND_LOGE("No memory for the loader context of fd %d", iFd);
+    return NULL;
+  }
+  fw_upload_CtxInit(pCtx, iFd);
+  memcpy(pCtx->uiBaudLadder, pDefault->uiBaudLadder,
+         sizeof(pCtx->uiBaudLadder));
+  pCtx->uiBaudLadderLen = pDefault->uiBaudLadderLen;
+  pCtx->uiBaudLadderCrcThreshold = pDefault->uiBaudLadderCrcThreshold;
+  memcpy(pCtx->uiPokeBackoff, pDefault->uiPokeBackoff,
+         sizeof(pCtx->uiPokeBackoff));
+  pCtx->uiPokeBackoffLen = pDefault->uiPokeBackoffLen;
+  pCtx->bRomTimeoutPatch = pDefault->bRomTimeoutPatch;
+  pCtx->pfnProgress = pDefault->pfnProgress;
+  pCtx->pProgressCtx = pDefault->pProgressCtx;
+  pCtx->uiProgressIntervalMs = pDefault->uiProgressIntervalMs;
+  (void)strlcpy(pCtx->szProgressFile, pDefault->szProgressFile,
+                sizeof(pCtx->szProgressFile));
+  return pCtx;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_loader_run
+ *
+ * Description:
+ *   Probes the controller of pCtx and downloads the firmware if its
+ *   bootloader answers.
+ *
+ * Conditions For Use:
+ *   pCtx comes from bt_vnd_mrvl_loader_create().
+ *
+ * Arguments:
+ *   pCtx:            the loader context of the controller.
+ *   pPortName:       Com port name, used if the port has to be reopened.
+ *   iBaudRate:       the initial baud rate.
+ *   pFileName:       the file name for downloading, NULL or empty to pick
+ *                    the image of the chip the V3 bootloader names.
+ *   iSecondBaudRate: the second baud rate.
+ *
+ * Return Value:
+ *   0 if the firmware runs, the error of the download otherwise.
+ *   HEADER_SIGNATURE_TIMEOUT if nothing answered the probe.
+ *
+ * Notes:
+ *   Contexts of different ports can run on their own threads. They share
+ *   the firmware bundle and the image index, which are locked, and the
+ *   transport and bt_vnd_mrvl_set_*() settings, which must not change
+ *   while a download runs. init_uart() keeps the port settings of
+ *   mchar_port only.
+ *
+ *****************************************************************************/
+uint32 bt_vnd_mrvl_loader_run(fw_upload_ctx_t* pCtx, int8* pPortName,
+                              uint32 iBaudRate, int8* pFileName,
+                              uint32 iSecondBaudRate) {
+  char szFileName[MAX_PATH_LEN];
+  fw_upload_fw_status_t status;
+
+  fw_upload_CtxReset(pCtx);
+  status = fw_upload_ProbeFwStatus(pCtx);
+  if (status == FW_STATUS_RUNNING) {
+    return DOWNLOAD_SUCCESS;
+  }
+  if (status != FW_STATUS_BOOTLOADER) {
+    return HEADER_SIGNATURE_TIMEOUT;
+  }
+  szFileName[0] = '\0';
+  if (pFileName != NULL) {
+    (void)strlcpy(szFileName, pFileName, sizeof(szFileName));
+  }
+  if (szFileName[0] == '\0') {
+    fw_upload_DefaultFwName(pCtx, szFileName, sizeof(szFileName));
+  }
+  return fw_upload_DownloadFw(pCtx, pPortName, iBaudRate, szFileName,
+                              iSecondBaudRate);
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_loader_get_fd
+ *
+ * Description:
+ *   Returns the port of the controller of pCtx.
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx: the loader context.
+ *
+ * Return Value:
+ *   The port, which differs from the one given to
+ *   bt_vnd_mrvl_loader_create() if the download had to reopen it.
+ *
+ * Notes:
+ *   None.
+ *
+ *****************************************************************************/
+int32 bt_vnd_mrvl_loader_get_fd(const fw_upload_ctx_t* pCtx) {
+  return pCtx->iFd;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_loader_destroy
+ *
+ * Description:
+ *   Releases the image and frees a context from
+ *   bt_vnd_mrvl_loader_create().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pCtx: the loader context, NULL does nothing.
+ *
+ * Return Value:
+ *   None.
+ *
+ * Notes:
+ *   The port is left open.
+ *
+ *****************************************************************************/
+void bt_vnd_mrvl_loader_destroy(fw_upload_ctx_t* pCtx) {
+  if (pCtx == NULL) {
+    return;
+  }
+  fw_upload_ReleaseFw(pCtx);
+  free(pCtx);
+}
+
+/******************************************************************************
+ *
+ * Name: fw_upload_PortThread
+ *
+ * Description:
+ *   Downloads the firmware to one controller of
+ *   bt_vnd_mrvl_download_parallel().
+ *
+ * Conditions For Use:
+ *   None.
+ *
+ * Arguments:
+ *   pArg: the fw_upload_port_t of the controller.
+ *
+ * Return Value:
+ *   NULL, the result is left in the fw_upload_port_t.
+ *
+ * Notes:
+ *   The port gets a context of its own. The progress callback is shared by
+ *   all ports, the progress file and the download baud rate properties get
+ *   the name of the port appended, e.g. "<file>.ttymxc0", so that each
+ *   controller has its own.
+ *
+ *****************************************************************************/
+static void* fw_upload_PortThread(void* pArg) {
+  fw_upload_port_t* pPort = (fw_upload_port_t*)pArg;
+  uint64 start = fw_upload_GetTimeNs();
+  const int8* pSuffix = strrchr(pPort->pPortName, '/');
+  fw_upload_ctx_t* pCtx;
+  int iLen;
+  int iClimbLen;
+
+  pCtx = bt_vnd_mrvl_loader_create(pPort->iFd);
+  if (pCtx == NULL) {
+    pPort->ulResult = MALLOC_RETURNED_NULL;
+    pPort->uiElapsedMs = 0;
+    return NULL;
+  }
+  if (pPort->pBaudLadder != NULL) {
+    fw_upload_SetBaudLadder(pCtx, pPort->pBaudLadder, pPort->uiBaudLadderLen);
+  }
+  pSuffix = (pSuffix != NULL) ? (pSuffix + 1) : pPort->pPortName;
+  iLen = snprintf(pCtx->szDlBaudProp, sizeof(pCtx->szDlBaudProp), "%s.%s",
+                  PROP_BLUETOOTH_DL_BAUDRATE, pSuffix);
+  iClimbLen =
+      snprintf(pCtx->szDlClimbProp, sizeof(pCtx->szDlClimbProp), "%s.%s",
+               PROP_BLUETOOTH_DL_BAUD_CLIMB, pSuffix);
+  if ((iLen < 0) || ((size_t)iLen >= sizeof(pCtx->szDlBaudProp)) ||
+      (iClimbLen < 0) ||
+      ((size_t)iClimbLen >= sizeof(pCtx->szDlClimbProp))) {
+    VND_LOGW("Port name %s too long, its download baud rate is not stored",
+             pPort->pPortName);
+    pCtx->szDlBaudProp[0] = '\0';
+    pCtx->szDlClimbProp[0] = '\0';
+  }
+  if (pCtx->szProgressFile[0] != '\0') {
+    int8 szFile[MAX_PATH_LEN];
+
+    iLen = snprintf(szFile, sizeof(szFile), "%s.%s", pCtx->szProgressFile,
+                    pSuffix);
+    if ((iLen < 0) || ((size_t)iLen >= sizeof(szFile))) {
+      VND_LOGW("Progress file of %s too long, not written", pPort->pPortName);
+      szFile[0] = '\0';
+    }
+    (void)strlcpy(pCtx->szProgressFile, szFile, sizeof(pCtx->szProgressFile));
+  }
+  pPort->ulResult =
+      bt_vnd_mrvl_loader_run(pCtx, pPort->pPortName, pPort->iBaudRate,
+                             pPort->pFileName, pPort->iSecondBaudRate);
+  pPort->iFd = bt_vnd_mrvl_loader_get_fd(pCtx);
+  bt_vnd_mrvl_loader_destroy(pCtx);
+  pPort->uiElapsedMs =
+      (uint32)((fw_upload_GetTimeNs() - start) / NSEC_PER_MSEC);
+  return NULL;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_download_parallel
+ *
+ * Description:
+ *   Downloads the firmware to several controllers at the same time, one
+ *   thread per port, so the whole takes as long as the slowest link.
+ *
+ * Conditions For Use:
+ *   The ports are opened by the caller and all use the selected transport.
+ *
+ * Arguments:
+ *   pPorts:  the controllers, each gets its result and timing.
+ *   uiCount: number of controllers, at most FW_UPLOAD_MAX_PARALLEL_PORTS.
+ *
+ * Return Value:
+ *   Number of controllers whose download failed.
+ *
+ * Notes:
+ *   The first port is handled on the calling thread. A port whose thread
+ *   cannot be started is handled there too, once the others are started.
+ *   Only the firmware bundle and the image index are shared between ports.
+ *
+ *****************************************************************************/
+uint32 bt_vnd_mrvl_download_parallel(fw_upload_port_t* pPorts, uint32 uiCount) {
+  uint64 start = fw_upload_GetTimeNs();
+  pthread_t threads[FW_UPLOAD_MAX_PARALLEL_PORTS];
+  bool bThread[FW_UPLOAD_MAX_PARALLEL_PORTS];
+  uint32 uiFailed = 0;
+  uint64 ullSumMs = 0;
+  uint32 i;
+
+  if (uiCount > FW_UPLOAD_MAX_PARALLEL_PORTS) {
+    VND_LOGW("%u ports, only the first %d are handled", uiCount,
+             FW_UPLOAD_MAX_PARALLEL_PORTS);
+    uiCount = FW_UPLOAD_MAX_PARALLEL_PORTS;
+  }
+  for (i = 1; i < uiCount; i++) {
+    bThread[i] =
+        (pthread_create(&threads[i], NULL, fw_upload_PortThread, &pPorts[i]) ==
+         0);
+    if (!bThread[i]) {
+      VND_LOGW("Thread of %s not started, downloading after the others",
+               pPorts[i].pPortName);
+    }
+  }
+  for (i = 0; i < uiCount; i++) {
+    if ((i == 0) || !bThread[i]) {
+      fw_upload_PortThread(&pPorts[i]);
+    }
+  }
+  for (i = 0; i < uiCount; i++) {
+    if ((i > 0) && bThread[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    VND_LOGI("%s: result %u in %u ms", pPorts[i].pPortName,
+             pPorts[i].ulResult, pPorts[i].uiElapsedMs);
+    ullSumMs += pPorts[i].uiElapsedMs;
+    if (pPorts[i].ulResult != DOWNLOAD_SUCCESS) {
+      uiFailed++;
+    }
+  }
+  VND_LOGI("%u controllers, %u failed, %llu ms for %llu ms of downloads",
+           uiCount, uiFailed, (fw_upload_GetTimeNs() - start) / NSEC_PER_MSEC,
+           ullSumMs);
+  return uiFailed;
+}
+
+#ifdef TEST_CODE
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_parallel_benchmark
+ *
+ * Description:
+ *   Measures how bt_vnd_mrvl_download_parallel() scales: 1, 2, 4, ... and
+ *   finally uiCount controllers are downloaded one after the other and then
+ *   all at once.
+ *
+ * Conditions For Use:
+ *   As for bt_vnd_mrvl_download_parallel().
+ *
+ * Arguments:
+ *   pPorts:   the controllers.
+ *   uiCount:  number of controllers, at most FW_UPLOAD_MAX_PARALLEL_PORTS.
+ *   pfnReset: puts the given controllers back into their bootloader and
+ *             fills in their ports.
+ *   pCbCtx:   passed to pfnReset.
+ *
+ * Return Value:
+ *   Number of downloads that failed.
+ *
+ * Notes:
+ *   pfnReset is called right before each download, e.g. to restart the
+ *   simulators on the master side of pty pairs used with
+ *   fw_upload_pty_transport, so no controller waits long in its bootloader.
+ *
+ *****************************************************************************/
+uint32 bt_vnd_mrvl_parallel_benchmark(fw_upload_port_t* pPorts,
+                                      uint32 uiCount,
+                                      fw_upload_bench_reset_cb_t pfnReset,
+                                      void* pCbCtx) {
+  uint64 ullSerialMs;
+  uint64 ullParallelMs;
+  uint64 start;
+  uint32 uiFailed = 0;
+  uint32 n;
+  uint32 i;
+
+  if (uiCount > FW_UPLOAD_MAX_PARALLEL_PORTS) {
+    uiCount = FW_UPLOAD_MAX_PARALLEL_PORTS;
+  }
+  for (n = 1; n <= uiCount; n = ((n < uiCount) && (n * 2 > uiCount))
+                                      ? uiCount
+                                      : (n * 2)) {
+    ullSerialMs = 0;
+    for (i = 0; i < n; i++) {
+      pfnReset(&pPorts[i], 1, pCbCtx);
+      start = fw_upload_GetTimeNs();
+      uiFailed += bt_vnd_mrvl_download_parallel(&pPorts[i], 1);
+      ullSerialMs += (fw_upload_GetTimeNs() - start) / NSEC_PER_MSEC;
+    }
+
+    pfnReset(pPorts, n, pCbCtx);
+    start = fw_upload_GetTimeNs();
+    uiFailed += bt_vnd_mrvl_download_parallel(pPorts, n);
+    ullParallelMs = (fw_upload_GetTimeNs() - start) / NSEC_PER_MSEC;
+
+    VND_LOGI("%u controllers: %llu ms one after the other, %llu ms at once, "
+             "speedup x%llu.%02llu",
+             n, ullSerialMs, ullParallelMs,
+             ullSerialMs / (ullParallelMs ? ullParallelMs : 1),
+             (ullSerialMs * 100 / (ullParallelMs ? ullParallelMs : 1)) % 100);
+  }
+  return uiFailed;
+}
+
+/******************************************************************************
+ *
+ * Name: bt_vnd_mrvl_benchmark
+ *
+ * Description:
+ *   Times the CRC32 implementations on an image and the waits on a
+ *   deadline, see fw_upload_CrcBenchmark() and
+ *   fw_upload_DeadlineBenchmark().
+ *
+ * Conditions For Use:
+ *   No download may be running.
+ *
+ * Arguments:
+ *   pFileName: the image, it is read as for a download.
+ *
+ * Return Value:
+ *   DOWNLOAD_SUCCESS, or the error preparing the image.
+ *
+ * Notes:
+ *   No port is used, so no bootloader waits while the benchmark runs.
+ *
+ *****************************************************************************/
+uint32 bt_vnd_mrvl_benchmark(int8* pFileName) {
+  fw_upload_ctx_t* pCtx;
+  fw_upload_image_t* pImage;
+  uint32 ulResult;
+
+  pCtx = bt_vnd_mrvl_loader_create(-1);
+  if (pCtx == NULL) {
+    return MALLOC_RETURNED_NULL;
+  }
+  fw_upload_PrepareFw(pCtx, pFileName);
+  ulResult = fw_upload_PrepareWait(pCtx);
+  pImage = &pCtx->imagePrep.image;
+  if ((ulResult == DOWNLOAD_SUCCESS) && (pImage->pData != NULL)) {
+    fw_upload_CrcBenchmark(pImage->pData, pImage->uiSize);
+  }
+  bt_vnd_mrvl_loader_destroy(pCtx);
+  fw_upload_DeadlineBenchmark();
+  return ulResult;
+}
+#endif
@@ -28,16 +28,72 @@
 #define FW_LOADER_H
 /*============================== Include Files ===============================*/
 #include "bt_vendor_nxp.h"
+#include "fw_loader_io.h"
 
 /*================================== Typedefs=================================*/
+/* Controller state, see bt_vnd_mrvl_probe_fw_status() */
+typedef enum {
+  FW_STATUS_UNKNOWN,
+  FW_STATUS_BOOTLOADER,
+  FW_STATUS_RUNNING,
+} fw_upload_fw_status_t;
 
-/*================================== Macros ==================================*/
+/* Download progress, see bt_vnd_mrvl_set_progress() */
+typedef struct {
+  uint32 uiBytesSent;    /* image bytes sent */
+  uint32 uiTotalBytes;   /* image size */
+  uint32 uiBytesPerSec;  /* image bytes per second since the start */
+  uint32 uiEtaMs;        /* time left at that rate */
+  uint32 uiElapsedMs;    /* time since the download started */
+  uint32 uiBaudRate;     /* baud rate of the download */
+  uint32 uiRetransmits;  /* blocks sent again */
+  bool bDone;            /* the download is over */
+  uint32 ulResult;       /* its result once bDone */
+} fw_upload_progress_t;
+
+/* Receives the progress every interval and when the download is over */
+typedef void (*fw_upload_progress_cb_t)(const fw_upload_progress_t* pProgress,
+                                        void* pCbCtx);
+
+/* State of the download to one controller, see bt_vnd_mrvl_loader_create() */
+typedef struct fw_upload_ctx fw_upload_ctx_t;
 
+/* Controller of bt_vnd_mrvl_download_parallel() */
 typedef struct {
-  uint32 iBaudRate;
-  uint32 iUartDivisor;
-  uint32 iClkDivisor;
-} UART_BAUDRATE;
+  int8* pPortName;           /* Com port name */
+  int32 iFd;                 /* port opened by the caller, updated if the
+                              * download had to reopen it */
+  uint32 iBaudRate;          /* initial baud rate */
+  uint32 iSecondBaudRate;    /* download baud rate, 0 for none */
+  const uint32* pBaudLadder; /* download baud rates, NULL for the ones of
+                              * bt_vnd_mrvl_set_baud_ladder() */
+  uint32 uiBaudLadderLen;
+  int8* pFileName;           /* image, NULL or empty to pick the one of the
+                              * chip */
+  uint32 ulResult;           /* result of the download */
+  uint32 uiElapsedMs;        /* time the download took */
+} fw_upload_port_t;
+
+#ifdef TEST_CODE
+/* Puts uiCount controllers of bt_vnd_mrvl_parallel_benchmark() back into
+ * their bootloader */
+typedef void (*fw_upload_bench_reset_cb_t)(fw_upload_port_t* pPorts,
+                                           uint32 uiCount, void* pCbCtx);
+#endif
+
+/*================================== Macros ==================================*/
+/* Download baud rates bt_vnd_mrvl_set_baud_ladder() accepts */
+#define FW_UPLOAD_MAX_BAUD_LADDER 8
+/* CRC errors tolerated at a download baud rate before the next download
+ * drops to a slower one */
+#define FW_UPLOAD_BAUD_LADDER_CRC_THRESHOLD 8
+/* Clean downloads at a rate dropped to for CRC errors before the faster
+ * one is tried again */
+#define FW_UPLOAD_BAUD_LADDER_CLIMB_AFTER 8
+/* Poke intervals bt_vnd_mrvl_set_poke_backoff() accepts */
+#define FW_UPLOAD_MAX_POKE_BACKOFF 8
+/* Controllers bt_vnd_mrvl_download_parallel() accepts */
+#define FW_UPLOAD_MAX_PARALLEL_PORTS 16
 
 extern int mchar_fd;
 extern uint8_t independent_reset_mode;
@@ -46,9 +102,35 @@ extern uint8_t independent_reset_mode;
 
 /*============================ Function Prototypes ===========================*/
 
-void init_crc8(void);
 bool bt_vnd_mrvl_check_fw_status(void);
+fw_upload_fw_status_t bt_vnd_mrvl_probe_fw_status(void);
 uint32 bt_vnd_mrvl_download_fw(int8* pPortName, uint32 iBaudRate,
                                int8* pFileName, uint32 iSecondBaudRate);
+void bt_vnd_mrvl_set_baud_ladder(const uint32* pBaudRates, uint32 uiCount,
+                                 uint32 uiCrcThreshold);
+void bt_vnd_mrvl_set_poke_backoff(const uint32* pIntervalsMs,
+                                  uint32 uiCount);
+void bt_vnd_mrvl_set_rom_timeout_patch(bool bEnable);
+void bt_vnd_mrvl_port_opened(void);
+void bt_vnd_mrvl_set_progress(fw_upload_progress_cb_t pfnCb, void* pCbCtx,
+                              uint32 uiIntervalMs, const char* pStatsFile);
+void bt_vnd_mrvl_get_download_stats(fw_upload_block_stats_t* pStats);
+bool bt_vnd_mrvl_open_fw_bundle(int8* pFileName);
+void bt_vnd_mrvl_prepare_fw(int8* pFileName);
+void bt_vnd_mrvl_release_fw(void);
 void fw_loader_get_default_fw_name(char fw_name[], uint32 fw_name_size);
+fw_upload_ctx_t* bt_vnd_mrvl_loader_create(int32 iFd);
+uint32 bt_vnd_mrvl_loader_run(fw_upload_ctx_t* pCtx, int8* pPortName,
+                              uint32 iBaudRate, int8* pFileName,
+                              uint32 iSecondBaudRate);
+int32 bt_vnd_mrvl_loader_get_fd(const fw_upload_ctx_t* pCtx);
+void bt_vnd_mrvl_loader_destroy(fw_upload_ctx_t* pCtx);
+uint32 bt_vnd_mrvl_download_parallel(fw_upload_port_t* pPorts, uint32 uiCount);
+#ifdef TEST_CODE
+uint32 bt_vnd_mrvl_parallel_benchmark(fw_upload_port_t* pPorts,
+                                      uint32 uiCount,
+                                      fw_upload_bench_reset_cb_t pfnReset,
+                                      void* pCbCtx);
+uint32 bt_vnd_mrvl_benchmark(int8* pFileName);
+#endif
 #endif  // FW_LOADER_H